@@ -16,6 +16,9 @@
 
 #include "algorithm_module.h"
 #include <pthread.h>
+#include <typeinfo>
+#include <cxxabi.h>
+#include <cstdlib>
 
 using namespace std;
 
@@ -23,12 +26,12 @@ int BlackHoleModule::runInternal()
 {
     ogeNameThread("am_BlackHole");
 
-    while(true) {
-        OGERead * r = getInputAlignment();
-        if(!r)
-            return 0;
-        OGERead::deallocate(r);
+    vector<OGERead *> reads;
+    while(getInputBatch(reads)) {
+        for(size_t i = 0; i < reads.size(); i++)
+            OGERead::deallocate(reads[i]);
     }
+    return 0;
 }
 
 bool AlgorithmModule::verbose = false;
@@ -44,6 +47,8 @@ void AlgorithmModule::setVerbose(bool set_verbose) {
 
 AlgorithmModule::AlgorithmModule()
 : source(NULL)
+, input_queue(ALGORITHM_MODULE_MAX_QUEUED_BATCHES)
+, input_batch_position(0)
 , finished_execution(false)
 , read_count(0)
 , write_count(0)
@@ -52,8 +57,15 @@ AlgorithmModule::AlgorithmModule()
 void * AlgorithmModule::algorithm_module_run(void * in)
 {
     AlgorithmModule * m = (AlgorithmModule *) in;
+    
+    m->input_budget.setName((m->source ? m->source->getModuleName() : string("input")) + " -> " + m->getModuleName());
 
     m->run_return_value = m->runInternal();
+    
+    // send any partial batch before sinks are allowed to see that we are done
+    m->flushOutput();
+    for(vector<AlgorithmModule *>::iterator i = m->sinks.begin(); i != m->sinks.end(); i++)
+        (*i)->input_queue.close();
     m->finished_execution = true;
 
     return 0;
@@ -128,42 +140,126 @@ int AlgorithmModule::finishAsync()
     return run_return_value;
 }
 
+void AlgorithmModule::putInputBatch(vector<OGERead *> & reads)
+{
+    if(reads.empty())
+        return;
+    
+    size_t bytes = 0;
+    for(size_t i = 0; i < reads.size(); i++)
+        bytes += reads[i]->memoryUsage();
+    
+    // wait for the sink to work through enough of its queue to make room
+    input_budget.acquire(bytes, reads.size());
+    
+    vector<OGERead *> * batch = new vector<OGERead *>();
+    batch->swap(reads);
+    input_queue.push(QueuedBatch(batch, bytes));
+}
+
 void AlgorithmModule::putInputAlignment(OGERead * read)
 {
-    while(input_queue.size() > 6000)
-        usleep(10000);
-    input_queue.push(read);
+    vector<OGERead *> reads(1, read);
+    putInputBatch(reads);
 }
 
 void AlgorithmModule::putOutputAlignment(OGERead * read)
 {
-    write_count++;
+    output_batch.push_back(read);
+    
+    if(output_batch.size() >= ALGORITHM_MODULE_BATCH_SIZE)
+        flushOutput();
+}
+
+void AlgorithmModule::flushOutput()
+{
+    if(!output_batch.empty())
+        putOutputBatch(output_batch);
+    output_batch.reserve(ALGORITHM_MODULE_BATCH_SIZE);
+}
+
+void AlgorithmModule::putOutputBatch(vector<OGERead *> & reads)
+{
+    write_count += reads.size();
     
-    if(sinks.size() == 0)
-        delete read;
+    if(sinks.size() == 0) {
+        for(size_t i = 0; i < reads.size(); i++)
+            OGERead::deallocate(reads[i]);
+        reads.clear();
+        return;
+    }
 
-    for(vector<AlgorithmModule *>::iterator i = sinks.begin(); i != sinks.end(); i++) {
-        if(sinks.begin() == i)
-            (*i)->putInputAlignment(read);
-        else {
-            OGERead * al = OGERead::allocate();
-            *al = *read;
-            (*i)->putInputAlignment(al);
+    // copies for the other sinks must be made before the first sink takes ownership of the reads
+    for(vector<AlgorithmModule *>::iterator i = sinks.begin() + 1; i != sinks.end(); i++) {
+        vector<OGERead *> copies(reads.size());
+        for(size_t j = 0; j < reads.size(); j++) {
+            copies[j] = OGERead::allocate();
+            *copies[j] = *reads[j];
         }
+        (*i)->putInputBatch(copies);
     }
+    
+    sinks.front()->putInputBatch(reads);
+    reads.clear();
+}
+
+vector<OGERead *> * AlgorithmModule::waitForInputBatch()
+{
+    QueuedBatch batch;
+    if(!input_queue.pop(batch))
+        return NULL;
+    input_budget.release(batch.bytes);
+    return batch.reads;
 }
 
 OGERead * AlgorithmModule::getInputAlignment()
 {
-    while(input_queue.size() == 0) {
-        if(source->finished_execution.isSet())
+    if(input_batch_position == input_batch.size()) {
+        vector<OGERead *> * batch = waitForInputBatch();
+        if(!batch)
             return NULL;
-        usleep(10000);
+        
+        input_batch.swap(*batch);
+        input_batch_position = 0;
+        delete batch;
     }
     
     read_count++;
 
-    return input_queue.pop();
+    return input_batch[input_batch_position++];
+}
+
+bool AlgorithmModule::getInputBatch(vector<OGERead *> & reads)
+{
+    // hand over anything left from a batch partially read by getInputAlignment()
+    if(input_batch_position != input_batch.size()) {
+        reads.assign(input_batch.begin() + input_batch_position, input_batch.end());
+        input_batch.clear();
+        input_batch_position = 0;
+    } else {
+        vector<OGERead *> * batch = waitForInputBatch();
+        if(!batch) {
+            reads.clear();
+            return false;
+        }
+        
+        reads.swap(*batch);
+        delete batch;
+    }
+    
+    read_count += reads.size();
+    
+    return true;
+}
+
+string AlgorithmModule::getModuleName() const
+{
+    const char * mangled = typeid(*this).name();
+    int status = 0;
+    char * demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+    string name = (0 == status && demangled) ? demangled : mangled;
+    free(demangled);
+    return name;
 }
 
 const BamHeader & AlgorithmModule::getHeader()
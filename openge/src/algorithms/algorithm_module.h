@@ -28,8 +28,16 @@
 #include <vector>
 
 #include "../util/thread_pool.h"
+#include "../util/queue_budget.h"
 #include "../commands/commands.h"
 
+// Number of reads collected by putOutputAlignment() before being passed on
+const size_t ALGORITHM_MODULE_BATCH_SIZE = 1024;
+
+// Maximum number of batches waiting in a module's input queue. The queue is normally
+// limited by its memory budget (see QueueBudget) well before this is reached.
+const size_t ALGORITHM_MODULE_MAX_QUEUED_BATCHES = 256;
+
 class AlgorithmModule
 {
 public:
@@ -63,13 +71,23 @@ public:
     // responsible for deleting it! This function should not by called by most algorithm
     // modules; only call if you are doing something creative with which modules you pass data
     // to, eg. SplitByChromosome.
-    virtual void putInputAlignment(OGERead * read);
+    //
+    // Reads are passed between modules in batches. putInputBatch() takes all of the reads
+    // in the vector, leaving it empty. putInputAlignment() passes a batch of one read.
+    virtual void putInputBatch(std::vector<OGERead *> & reads);
+    void putInputAlignment(OGERead * read);
 
 protected:
     // Use these functions when processing to get input data, and to pass the data to the next 
-    // module in the chain.
+    // module in the chain. Reads passed to putOutputAlignment() are collected into a batch,
+    // which is sent once full, or when runInternal() returns. getInputBatch() replaces the
+    // contents of the vector with the next batch, and returns false when there is no more
+    // input. Batch and single read functions can be mixed freely.
     virtual void putOutputAlignment(OGERead * read);
+    virtual void putOutputBatch(std::vector<OGERead *> & reads);
+    void flushOutput();
     OGERead * getInputAlignment();
+    bool getInputBatch(std::vector<OGERead *> & reads);
 
 public:
     virtual const BamHeader & getHeader();
@@ -79,6 +97,9 @@ public:
     static void setNothreads(bool nothreads);
     static void setVerbose(bool verbose);
     
+    // Name of the module's class, used in diagnostic messages.
+    std::string getModuleName() const;
+    
     size_t getReadCount() { return read_count; }
     size_t getWriteCount() { return write_count; }
     
@@ -93,10 +114,20 @@ protected:
     // Internal
     static void * algorithm_module_run(void * in);
     void setSource(AlgorithmModule * src) { source = src; }
+    std::vector<OGERead *> * waitForInputBatch();
 
     std::vector<AlgorithmModule *> sinks;
     AlgorithmModule * source;
-    SynchronizedQueue<OGERead *> input_queue;
+    struct QueuedBatch {
+        QueuedBatch(std::vector<OGERead *> * reads = NULL, size_t bytes = 0) : reads(reads), bytes(bytes) {}
+        std::vector<OGERead *> * reads;
+        size_t bytes;                           // charged to input_budget
+    };
+    SpscRing<QueuedBatch> input_queue;          // closed by the source when it finishes
+    QueueBudget input_budget;                   // memory held in input_queue
+    std::vector<OGERead *> input_batch;         // batch currently being read by getInputAlignment()
+    size_t input_batch_position;
+    std::vector<OGERead *> output_batch;        // reads collected by putOutputAlignment()
     pthread_t thread;
     SynchronizedFlag finished_execution;
     int run_return_value;
@@ -470,7 +470,7 @@ int LocalRealignment::map_func(OGERead * read, const ReadMetaDataTracker & metaD
         if(nothreads)
             read_list->runJob();
         else
-            ThreadPool::sharedPool()->addJob(read_list);
+            ThreadPool::sharedPool()->addJob(read_list, &clean_jobs);
         flushEmitQueue();
 
         do {
@@ -531,7 +531,7 @@ int LocalRealignment::map_func(OGERead * read, const ReadMetaDataTracker & metaD
         if(nothreads)
             read_list->runJob();
         else
-            ThreadPool::sharedPool()->addJob(read_list);
+            ThreadPool::sharedPool()->addJob(read_list, &clean_jobs);
         flushEmitQueue();
 
         do {
@@ -603,7 +603,7 @@ void LocalRealignment::onTraversalDone(IntervalData & interval_data, int result)
     interval_data.knownIndelsToTry.clear();
     interval_data.indelRodsSeen.clear();
     if(!nothreads)
-    ThreadPool::sharedPool()->waitForJobCompletion();
+    ThreadPool::sharedPool()->waitForJobCompletion(clean_jobs);
     manager->close();
 
 #ifdef LR_SUPPORT_ADDITIONAL_OUTPUT_FILES
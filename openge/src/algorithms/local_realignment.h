@@ -435,6 +435,7 @@ private:
 
     std::queue<Emittable *> emit_queue; //queue up reads ready to be emitted so that they are in order, including ReadBins that have been cleaned.
     mutex emit_mutex; // only one thread should emit() at once
+    ThreadJobGroup clean_jobs;  // CleanAndEmitReadList jobs running in the shared pool
     
     void flushEmitQueue() {
         // since multiple threads will call this, we need to ensure taht all thread pool workers
@@ -16,26 +16,75 @@
 
 #include "mark_duplicates.h"
 
-#include "../util/bam_serializer.h"
-#include "../util/bgzf_output_stream.h"
+#include "../util/spill_file.h"
 
 #include "../util/read_stream_reader.h"
+#include "../util/temp_directories.h"
+#include "../util/read_key_order.h"
 
 #include <algorithm>
+#include <climits>
+#include <cstring>
 using namespace std;
 
-MarkDuplicates::MarkDuplicates(string temp_directory)
-: numDuplicateIndices(0)
+// Flags of reads held while streaming. A read is output once it is no
+// longer waiting for its fragment or pair duplicate set.
+static const uint8_t HELD_FRAGMENT = 1;     // fragment set not complete
+static const uint8_t HELD_PAIR = 2;         // pair set not complete
+static const uint8_t HELD_MATCHED = 4;      // mate has been read
+static const uint8_t HELD_DUPLICATE = 8;
+
+static const string UNKNOWN_LIBRARY("Unknown Library");
+
+// Orders the heaps of ends waiting for the stream to pass their
+// fragment's (or the pair's later read's) 5' position, earliest on top.
+struct FragmentEndsLater {
+    bool operator()(const ReadEnds & a, const ReadEnds & b) const {
+        return a.getRead1Sequence() > b.getRead1Sequence() || (a.getRead1Sequence() == b.getRead1Sequence() && a.getRead1Coordinate() > b.getRead1Coordinate());
+    }
+};
+
+struct PairEndsLater {
+    bool operator()(const ReadEnds & a, const ReadEnds & b) const {
+        return a.getRead2Sequence() > b.getRead2Sequence() || (a.getRead2Sequence() == b.getRead2Sequence() && a.getRead2Coordinate() > b.getRead2Coordinate());
+    }
+};
+
+// Sorted ends in a vector, read the same way as a ReadEndsSortingCollection.
+class ReadEndsVectorSource {
+public:
+    ReadEndsVectorSource(const vector<ReadEnds> & ends) : ends(ends), position(0) {}
+    bool next(ReadEnds & out) {
+        if(position == ends.size())
+            return false;
+        out = ends[position++];
+        return true;
+    }
+protected:
+    const vector<ReadEnds> & ends;
+    size_t position;
+};
+
+MarkDuplicates::MarkDuplicates()
+: read_ends_memory(DEDUP_DEFAULT_READ_ENDS_MEMORY)
+, spill_unmatched_ends(false)
+, numDuplicateIndices(0)
 , nextLibraryId(1)
+, collect_metrics(false)
+, stream_window(DEDUP_DEFAULT_STREAM_WINDOW)
+, streaming(false)
+, stream_base(0)
+, frontier_sequence(-1)
+, frontier_coordinate(INT_MIN)
 , removeDuplicates(false)
 {
     char filename[64];
     pid_t pid = getpid();
     // we must include the pointer just in case there are multiple mark_duplicates calls in one OGE process-
     // for instance, if we split by chromosome.
-    sprintf(filename, "/oge_dedup_%d_%lx.bam",  pid, (uintptr_t)this);
+    sprintf(filename, "oge_dedup_%d_%lx.spill",  pid, (uintptr_t)this);
 
-    bufferFilename = (temp_directory + string(filename));
+    bufferFilename = TempDirectories::choose() + filename;
 }
 
 /////////////////
@@ -144,21 +193,21 @@ short MarkDuplicates::getScore(const OGERead & rec) {
 }
 
 /** Builds a read ends object that represents a single read. */
-ReadEnds * MarkDuplicates::buildReadEnds(BamHeader & header, long index, const OGERead & rec) {
-    ReadEnds * ends = new ReadEnds();
-    ends->read1Sequence    = rec.getRefID();
-    ends->read1Coordinate  = rec.IsReverseStrand() ? getUnclippedEnd(rec) : getUnclippedStart(rec);
-    ends->orientation = rec.IsReverseStrand() ? RE_R : RE_F;
-    ends->read1IndexInFile = index;
-    ends->score = getScore(rec);
+ReadEnds MarkDuplicates::buildReadEnds(BamHeader & header, int64_t index, const OGERead & rec) {
+    ReadEnds ends;
+    ends.setRead1Sequence(rec.getRefID());
+    ends.setRead1Coordinate(rec.IsReverseStrand() ? getUnclippedEnd(rec) : getUnclippedStart(rec));
+    ends.setOrientation(rec.IsReverseStrand() ? RE_R : RE_F);
+    ends.setRead1IndexInFile(index);
+    ends.setScore(getScore(rec));
     
     // Doing this lets the ends object know that it's part of a pair
     if (rec.IsPaired() && rec.IsMateMapped()) {
-        ends->read2Sequence = rec.getMateRefID();
+        ends.setRead2Sequence(rec.getMateRefID());
     }
     
     // Fill in the library ID
-    ends->libraryId = getLibraryId(header, rec);
+    ends.setLibraryId(getLibraryId(header, rec));
     
     return ends;
 }
@@ -184,13 +233,25 @@ readends_orientation_t MarkDuplicates::getOrientationByte(bool read1NegativeStra
  */
 void MarkDuplicates::buildSortedReadEndLists() {
     
-    ReadEndsMap tmp;
-    long index = 0;
+    int64_t index = 0;
 
     BamHeader header = source->getHeader();
 
-    BamSerializer<BgzfOutputStream > writer;
-    writer.open(bufferFilename, header);
+    pairSort.setMemoryLimit(read_ends_memory / (collect_metrics ? 4 : 2));
+    pairLocations.setMemoryLimit(read_ends_memory / 4);
+    fragSort.setMemoryLimit(read_ends_memory / 2);
+    if(collect_metrics)
+        startMetrics(header);
+
+    // in sorted input, the mate of the first read of a pair comes later, so
+    // its ends can be set aside until the sequence of the mate is reached
+    unmatchedEnds.setSpillBySequence(spill_unmatched_ends && header.getSortOrder() == BamHeader::SORT_COORDINATE, read_ends_memory / 4);
+
+    SpillWriter writer;
+    if(!writer.open(bufferFilename)) {
+        cerr << "MarkDuplicates ERROR: could not open tempfile " << bufferFilename << " for writing." << endl;
+        exit(-1);
+    }
     
     while (true) {
         OGERead * prec = getInputAlignment();
@@ -199,56 +260,13 @@ void MarkDuplicates::buildSortedReadEndLists() {
 
         OGERead & rec = *prec;
 
-        if (!rec.IsMapped() || rec.getRefID() == -1) {
-            // When we hit the unmapped reads or reads with no coordinate, just write them.
-        }
-        else if (rec.IsPrimaryAlignment()){
-            ReadEnds * fragmentEnd = buildReadEnds(header, index, rec);
-            fragSort.push_back(fragmentEnd);
-            
-            if (rec.IsPaired() && rec.IsMateMapped()) {
-                string read_group;
-                rec.GetTag("RG", read_group);
-
-                string key = read_group + string(":") + rec.getName();
-                ReadEnds * pairedEnds = tmp.remove(rec.getRefID(), key);
-                
-                // See if we've already seen the first end or not
-                if (pairedEnds == NULL) {
-                    pairedEnds = buildReadEnds(header, index, rec);
-                    tmp.put(pairedEnds->read1Sequence, key, pairedEnds);
-                }
-                else {
-                    int sequence = fragmentEnd->read1Sequence;
-                    int coordinate = fragmentEnd->read1Coordinate;
-                    
-                    // If the second read is actually later, just add the second read data, else flip the reads
-                    if (sequence > pairedEnds->read1Sequence ||
-                        (sequence == pairedEnds->read1Sequence && coordinate >= pairedEnds->read1Coordinate)) {
-                        pairedEnds->read2Sequence    = sequence;
-                        pairedEnds->read2Coordinate  = coordinate;
-                        pairedEnds->read2IndexInFile = index;
-                        pairedEnds->orientation = getOrientationByte(pairedEnds->orientation == RE_R, rec.IsReverseStrand());
-                    }
-                    else {
-                        pairedEnds->read2Sequence    = pairedEnds->read1Sequence;
-                        pairedEnds->read2Coordinate  = pairedEnds->read1Coordinate;
-                        pairedEnds->read2IndexInFile = pairedEnds->read1IndexInFile;
-                        pairedEnds->read1Sequence    = sequence;
-                        pairedEnds->read1Coordinate  = coordinate;
-                        pairedEnds->read1IndexInFile = index;
-                        pairedEnds->orientation = getOrientationByte(rec.IsReverseStrand(), pairedEnds->orientation == RE_R);
-                    }
-                    
-                    pairedEnds->score += getScore(rec);
-                    pairSort.push_back(pairedEnds);
-                }
-            }
-        }
+        // Unmapped reads and reads with no coordinate are just written.
+        if (rec.IsMapped() && rec.getRefID() != -1 && rec.IsPrimaryAlignment())
+            addReadEnds(header, index, rec);
         
         // Print out some stats every 1m reads
-        if (verbose && ++index % 100000 == 0) {
-            cerr << "\rRead " << index << " records. Tracking " << tmp.size() << " as yet unmatched pairs. Last sequence index: " << rec.getPosition() << std::flush;
+        if (++index % 100000 == 0 && verbose) {
+            cerr << "\rRead " << index << " records. Tracking " << unmatchedEnds.size() << " as yet unmatched pairs. Last sequence index: " << rec.getPosition() << std::flush;
         }
         
         writer.write(rec);
@@ -258,24 +276,110 @@ void MarkDuplicates::buildSortedReadEndLists() {
     writer.close();
     
     if(verbose)
-        cerr << "Read " << index << " records. " << tmp.size() << " pairs never matched." << endl << "Sorting pairs..." << flush;
-    if(nothreads)
-        sort(pairSort.begin(), pairSort.end(), compareReadEnds());
-    else
-        ogeSortMt(pairSort.begin(), pairSort.end(), compareReadEnds());
+        cerr << "Read " << index << " records. " << unmatchedEnds.size() << " pairs never matched." << endl << "Sorting pairs..." << flush;
+    pairSort.sort();
 
     if(verbose) cerr << "fragments..." << flush;
-    if(nothreads)
-        sort(fragSort.begin(), fragSort.end(), compareReadEnds());
-    else
-        ogeSortMt(fragSort.begin(), fragSort.end(), compareReadEnds());
-    if(verbose) cerr << "done." << endl;
+    fragSort.sort();
+    pairLocations.sort();
+    if(verbose) {
+        cerr << "done." << endl;
+        if(pairSort.spilledFiles() || fragSort.spilledFiles())
+            cerr << "Read ends were sorted in " << pairSort.spilledFiles() << " pair and " << fragSort.spilledFiles() << " fragment temporary files." << endl;
+        if(unmatchedEnds.spilledFiles())
+            cerr << "Unmatched pairs were set aside in " << unmatchedEnds.spilledFiles() << " temporary files." << endl;
+    }
     
-    vector<ReadEnds *>contents = tmp.allReadEnds();
+    unmatchedEnds.clear();
+    duplicateIndexes.assign(index);
+}
+
+/**
+ * Builds the fragment ends of a primary, mapped read, and the pair ends once
+ * both reads of a pair have been seen.
+ */
+void MarkDuplicates::addReadEnds(BamHeader & header, int64_t index, const OGERead & rec) {
+    ReadEnds fragmentEnd = buildReadEnds(header, index, rec);
+
+    if(streaming) {
+        if(fragmentEnd.getRead1Sequence() < frontier_sequence || (fragmentEnd.getRead1Sequence() == frontier_sequence && fragmentEnd.getRead1Coordinate() < frontier_coordinate)) {
+            cerr << "MarkDuplicates ERROR: read " << rec.getName() << " has more than " << DEDUP_STREAM_MAX_CLIP << " clipped bases. Leave out --dedup-window to mark duplicates without streaming." << endl;
+            exit(-1);
+        }
+        streamFragments.push_back(fragmentEnd);
+        push_heap(streamFragments.begin(), streamFragments.end(), FragmentEndsLater());
+    } else
+        fragSort.add(fragmentEnd);
     
-    // delete unmatched read ends
-    for(vector<ReadEnds *>::const_iterator i = contents.begin(); i != contents.end(); i++)
-        delete *i;
+    if (rec.IsPaired() && rec.IsMateMapped()) {
+        // pairs are matched by read group and name, without copying either
+        const char * read_group = ReadKeyOrder::findTag(rec, "RG");
+        size_t read_group_length = 0;
+        if(read_group && *read_group == 'Z')
+            read_group_length = strlen(++read_group);
+        const char * name = rec.getBamEncodedStringData().data();
+        size_t name_length = rec.getNameLength() - 1;
+        ReadEnds pairedEnds;
+        
+        // See if we've already seen the first end or not
+        if (!unmatchedEnds.remove(rec.getRefID(), read_group, read_group_length, name, name_length, pairedEnds)) {
+            pairedEnds = buildReadEnds(header, index, rec);
+            unmatchedEnds.put(rec.getMateRefID(), read_group, read_group_length, name, name_length, pairedEnds);
+        }
+        else {
+            int sequence = fragmentEnd.getRead1Sequence();
+            int coordinate = fragmentEnd.getRead1Coordinate();
+
+            if(streaming) {
+                uint8_t * state = streamState(pairedEnds.getRead1IndexInFile());
+                if(state)
+                    *state |= HELD_MATCHED;
+            }
+            
+            // If the second read is actually later, just add the second read data, else flip the reads
+            if (sequence > pairedEnds.getRead1Sequence() ||
+                (sequence == pairedEnds.getRead1Sequence() && coordinate >= pairedEnds.getRead1Coordinate())) {
+                pairedEnds.setRead2Sequence(sequence);
+                pairedEnds.setRead2Coordinate(coordinate);
+                pairedEnds.setRead2IndexInFile(index);
+                pairedEnds.setOrientation(getOrientationByte(pairedEnds.getOrientation() == RE_R, rec.IsReverseStrand()));
+            }
+            else {
+                pairedEnds.setRead2Sequence(pairedEnds.getRead1Sequence());
+                pairedEnds.setRead2Coordinate(pairedEnds.getRead1Coordinate());
+                pairedEnds.setRead2IndexInFile(pairedEnds.getRead1IndexInFile());
+                pairedEnds.setRead1Sequence(sequence);
+                pairedEnds.setRead1Coordinate(coordinate);
+                pairedEnds.setRead1IndexInFile(index);
+                pairedEnds.setOrientation(getOrientationByte(rec.IsReverseStrand(), pairedEnds.getOrientation() == RE_R));
+            }
+            
+            pairedEnds.setScore(pairedEnds.getScore() + getScore(rec));
+            if(streaming) {
+                streamPairs.push_back(pairedEnds);
+                push_heap(streamPairs.begin(), streamPairs.end(), PairEndsLater());
+            } else
+                pairSort.add(pairedEnds);
+
+            // both reads have the name, and so the location, of the pair
+            if(collect_metrics) {
+                short read_group_id = -1;
+                if(read_group_length) {
+                    map<string, short>::const_iterator id = readGroupIds.find(string(read_group, read_group_length));
+                    if(id != readGroupIds.end())
+                        read_group_id = id->second;
+                }
+                OpticalLocation optical = OpticalDuplicateFinder::location(read_group_id, name, name_length);
+                ReadEnds location = pairedEnds;
+                location.setLocation(optical.tile, optical.xy);
+                if(streaming) {
+                    streamPairLocations.push_back(location);
+                    push_heap(streamPairLocations.begin(), streamPairLocations.end(), PairEndsLater());
+                } else
+                    pairLocations.add(location);
+            }
+        }
+    }
 }
 
 /** Get the library ID for the given SAM record. */
@@ -287,6 +391,10 @@ short MarkDuplicates::getLibraryId(BamHeader & header, const OGERead & rec) {
     if(!libraryIds.count(library)) {
         libraryId = nextLibraryId++;
         libraryIds[library] = libraryId;
+        if(collect_metrics) {
+            libraryNames.resize(libraryId + 1);
+            libraryNames[libraryId] = library;
+        }
     } else
         libraryId = libraryIds[library];
     
@@ -302,7 +410,6 @@ string MarkDuplicates::getLibraryName(BamHeader & header, const OGERead & rec) {
     
     string read_group;
     static const string RG("RG");
-    static const string unknown_library("Unknown Library");
     rec.GetTag(RG, read_group);
     
     if (read_group.size() > 0 && header.getReadGroups().contains(read_group)) {
@@ -314,7 +421,7 @@ string MarkDuplicates::getLibraryName(BamHeader & header, const OGERead & rec) {
         }
     }
     
-    return unknown_library;
+    return UNKNOWN_LIBRARY;
 }
 
 /**
@@ -325,21 +432,40 @@ string MarkDuplicates::getLibraryName(BamHeader & header, const OGERead & rec) {
  */
 void MarkDuplicates::generateDuplicateIndexes() {
     
-    ReadEnds * firstOfNextChunk = NULL;
-    vector<ReadEnds *> nextChunk;
-    nextChunk.reserve(200);
-    
     // First just do the pairs
     if(verbose)
         cerr << "Finding duplicate pairs..." << flush;
     
-    for (int i = 0;i < pairSort.size(); i++) {
-        ReadEnds * next = pairSort[i];
-        if (firstOfNextChunk == NULL) {
-            firstOfNextChunk = next;
-            nextChunk.push_back(firstOfNextChunk);
-        }
-        else if (areComparableForDuplicates(*firstOfNextChunk, *next, true)) {
+    markDuplicatePairSets(pairSort);
+    pairSort.clear();
+
+    if(collect_metrics) {
+        if(verbose)
+            cerr << "optical duplicates..." << flush;
+        countOpticalDuplicateSets(pairLocations);
+    }
+    pairLocations.clear();
+    
+    // Now deal with the fragments
+    if(verbose)
+        cerr << "duplicate fragments..." << flush;
+    
+    markDuplicateFragmentSets(fragSort);
+    fragSort.clear();
+    
+    if(verbose)
+        cerr << "done." << endl << "Sorting list of duplicate records." << endl;
+}
+
+/** Marks duplicates in each set of comparable pairs from a sorted source. */
+template <class source_t>
+void MarkDuplicates::markDuplicatePairSets(source_t & sorted) {
+    vector<ReadEnds> nextChunk;
+    nextChunk.reserve(200);
+    
+    ReadEnds next;
+    while (sorted.next(next)) {
+        if (nextChunk.empty() || areComparableForDuplicates(nextChunk.front(), next, true)) {
             nextChunk.push_back(next);
         }
         else {
@@ -349,31 +475,26 @@ void MarkDuplicates::generateDuplicateIndexes() {
             
             nextChunk.clear();
             nextChunk.push_back(next);
-            firstOfNextChunk = next;
         }
     }
     markDuplicatePairs(nextChunk);
-    
-    for (int i = 0;i < pairSort.size(); i++) {
-        delete pairSort[i];
-        pairSort[i] = NULL;
-    }
-    pairSort.clear();
-    
-    // Now deal with the fragments
-    if(verbose)
-        cerr << "duplicate fragments..." << flush;
+}
+
+/** Marks duplicates in each set of comparable fragments from a sorted source. */
+template <class source_t>
+void MarkDuplicates::markDuplicateFragmentSets(source_t & sorted) {
+    vector<ReadEnds> nextChunk;
+    nextChunk.reserve(200);
     
     bool containsPairs = false;
     bool containsFrags = false;
-    firstOfNextChunk = NULL;
     
-    for (int i = 0;i < fragSort.size(); i++) {
-        ReadEnds * next = fragSort[i];
-        if (firstOfNextChunk != NULL && areComparableForDuplicates(*firstOfNextChunk, *next, false)) {
+    ReadEnds next;
+    while (sorted.next(next)) {
+        if (!nextChunk.empty() && areComparableForDuplicates(nextChunk.front(), next, false)) {
             nextChunk.push_back(next);
-            containsPairs = containsPairs || next->isPaired();
-            containsFrags = containsFrags || !next->isPaired();
+            containsPairs = containsPairs || next.isPaired();
+            containsFrags = containsFrags || !next.isPaired();
         }
         else {
             if (nextChunk.size() > 1 && containsFrags) {
@@ -382,32 +503,45 @@ void MarkDuplicates::generateDuplicateIndexes() {
             
             nextChunk.clear();
             nextChunk.push_back(next);
-            firstOfNextChunk = next;
-            containsPairs = next->isPaired();
-            containsFrags = !next->isPaired();
+            containsPairs = next.isPaired();
+            containsFrags = !next.isPaired();
         }
     }
     markDuplicateFragments(nextChunk, containsPairs);
-    
-    for (int i = 0;i < fragSort.size(); i++) {
-        delete fragSort[i];
-        fragSort[i] = NULL;
+}
+
+/**
+ * Counts the optical duplicates in each set of comparable pairs, from
+ * the locations of sorted pairs.
+ */
+template <class source_t>
+void MarkDuplicates::countOpticalDuplicateSets(source_t & sorted) {
+    vector<OpticalLocation> locations;
+    ReadEnds first, next;
+    bool more = sorted.next(next);
+
+    while(more) {
+        first = next;
+        locations.clear();
+        do {
+            locations.push_back(OpticalLocation(next.getLocationTile(), next.getLocationXY()));
+            more = sorted.next(next);
+        } while(more && areComparableForDuplicates(first, next, true));
+
+        if(locations.size() > 1)
+            optical_duplicates.addSet(first.getLibraryId(), &locations[0], locations.size());
     }
-    fragSort.clear();
-    
-    if(verbose)
-        cerr << "done." << endl << "Sorting list of duplicate records." << endl;
 }
 
 bool MarkDuplicates::areComparableForDuplicates(const ReadEnds & lhs, const ReadEnds & rhs, bool compareRead2) {
-    bool retval = (lhs.libraryId  == rhs.libraryId) &&
-    (lhs.read1Sequence   == rhs.read1Sequence) &&
-    (lhs.read1Coordinate == rhs.read1Coordinate) &&
-    (lhs.orientation     == rhs.orientation);
+    bool retval = (lhs.getLibraryId()  == rhs.getLibraryId()) &&
+    (lhs.getRead1Sequence()   == rhs.getRead1Sequence()) &&
+    (lhs.getRead1Coordinate() == rhs.getRead1Coordinate()) &&
+    (lhs.getOrientation()     == rhs.getOrientation());
     
     if (retval && compareRead2) {
-        retval = (lhs.read2Sequence   == rhs.read2Sequence) &&
-        (lhs.read2Coordinate == rhs.read2Coordinate);
+        retval = (lhs.getRead2Sequence()   == rhs.getRead2Sequence()) &&
+        (lhs.getRead2Coordinate() == rhs.getRead2Coordinate());
     }
     
     return retval;
@@ -423,6 +557,9 @@ int MarkDuplicates::runInternal() {
     
     ogeNameThread("am_MarkDuplicates");
 
+    if(stream_window && source->getHeader().getSortOrder() == BamHeader::SORT_COORDINATE)
+        return streamDuplicates();
+
     if(verbose)
         cerr << "Reading input file and constructing read end information." << endl;
     buildSortedReadEndLists();
@@ -437,7 +574,7 @@ int MarkDuplicates::runInternal() {
     in.open(bufferFilename);
 
     // Now copy over the file while marking all the necessary indexes as duplicates
-    long recordInFileIndex = 0;
+    IndexBitmap::Cursor duplicates(duplicateIndexes);
     
     long written = 0;
     while (true) {
@@ -445,16 +582,14 @@ int MarkDuplicates::runInternal() {
         if(!prec)
             break;
         
-        if (prec->IsPrimaryAlignment()) {
-            if (duplicateIndexes.count(recordInFileIndex) == 1)
-                prec->SetIsDuplicate(true);
-            else
-                prec->SetIsDuplicate(false);
-        }
-        recordInFileIndex++;
+        bool duplicate = duplicates.next();
+        if (prec->IsPrimaryAlignment())
+            prec->SetIsDuplicate(duplicate);
+        if (collect_metrics)
+            countRead(*prec, duplicate);
         
         if (removeDuplicates && prec->IsDuplicate()) {
-            // do nothing
+            delete prec;
         }
         else {
             putOutputAlignment(prec);
@@ -468,40 +603,299 @@ int MarkDuplicates::runInternal() {
         cerr << "\rWritten " << written << " records (" << written * 100 / read_count <<"%)." << endl;
 
     in.close();
+    duplicateIndexes.clear();
+    if(collect_metrics)
+        finishMetrics();
 
     remove(bufferFilename.c_str());
     
     return 0;
 }
 
-void MarkDuplicates::addIndexAsDuplicate(long bamIndex) {
-    duplicateIndexes.insert(bamIndex);
+/** Sets up the read groups and libraries that reads are counted by. */
+void MarkDuplicates::startMetrics(const BamHeader & header) {
+    const BamReadGroupRecords & read_groups = header.getReadGroups();
+    short id = 0;
+    for(BamReadGroupRecords::const_iterator i = read_groups.begin(); i != read_groups.end(); i++, id++) {
+        readGroupIds[i->getId()] = id;
+        if(!i->getLibrary().empty())
+            readGroupLibraries[i->getId()] = i->getLibrary();
+    }
+}
+
+string MarkDuplicates::readGroupOf(const OGERead & read) {
+    const char * read_group = ReadKeyOrder::findTag(read, "RG");
+    if(read_group && *read_group == 'Z')
+        return read_group + 1;
+    return string();
+}
+
+/** Counts a read being output in the metrics of its library. */
+void MarkDuplicates::countRead(const OGERead & read, bool duplicate) {
+    map<string, string>::const_iterator library = readGroupLibraries.find(readGroupOf(read));
+    LibraryDuplicationMetrics & m = metrics[library == readGroupLibraries.end() ? UNKNOWN_LIBRARY : library->second];
+
+    if (!read.IsMapped() || read.getRefID() == -1)
+        m.unmapped_reads++;
+    else if (!read.IsPrimaryAlignment())
+        m.secondary_or_supplementary_reads++;
+    else if (!read.IsPaired() || !read.IsMateMapped()) {
+        m.unpaired_reads_examined++;
+        if (duplicate)
+            m.unpaired_read_duplicates++;
+    } else {
+        m.read_pair_reads_examined++;
+        if (duplicate)
+            m.read_pair_read_duplicates++;
+    }
+}
+
+/** Adds the optical duplicates, once all duplicate sets have been counted. */
+void MarkDuplicates::finishMetrics() {
+    const map<int, uint64_t> & counts = optical_duplicates.finish();
+    for(map<int, uint64_t>::const_iterator i = counts.begin(); i != counts.end(); i++)
+        metrics[libraryNames[i->first]].read_pair_optical_duplicates += i->second;
+}
+
+void MarkDuplicates::addIndexAsDuplicate(int64_t bamIndex) {
+    if(streaming) {
+        uint8_t * state = streamState(bamIndex);
+        if(state)
+            *state |= HELD_DUPLICATE;
+    } else
+        duplicateIndexes.set(bamIndex);
     ++numDuplicateIndices;
 }
 
+/**
+ * Marks duplicates in coordinate sorted input as it streams through. Each
+ * read is held until the duplicate sets it can be part of are complete:
+ * its fragment set once later reads can't start at its 5' position, and
+ * its pair set once its mate has been read and the same is true of the
+ * later read of the pair. Held reads that don't fit in stream_window
+ * overflow to temporary files.
+ */
+int MarkDuplicates::streamDuplicates() {
+    BamHeader header = source->getHeader();
+    int64_t index = 0;
+    int last_sequence = 0, last_position = INT_MIN;
+    bool unmapped = false;
+
+    streaming = true;
+    stream_held.setMemoryLimit(stream_window);
+    unmatchedEnds.setSpillBySequence(spill_unmatched_ends, read_ends_memory / 4);
+    if(collect_metrics)
+        startMetrics(header);
+
+    if(verbose)
+        cerr << "Marking duplicates in coordinate sorted input as it is read." << endl;
+
+    while (true) {
+        OGERead * prec = getInputAlignment();
+        if(!prec)
+            break;
+
+        OGERead & rec = *prec;
+        int sequence = rec.getRefID();
+        int position = rec.getPosition();
+
+        if(sequence == -1) {
+            // reads with no coordinate come last, and end every duplicate set
+            if(!unmapped)
+                resolveStreamedEnds(INT_MAX, INT_MAX);
+            unmapped = true;
+        } else if(unmapped || sequence < last_sequence || (sequence == last_sequence && position < last_position)) {
+            cerr << "MarkDuplicates ERROR: input is not sorted by coordinate, at read " << rec.getName() << ". Leave out --dedup-window to mark duplicates without streaming." << endl;
+            exit(-1);
+        } else {
+            last_sequence = sequence;
+            last_position = position;
+        }
+
+        uint8_t state = 0;
+        if (rec.IsMapped() && sequence != -1 && rec.IsPrimaryAlignment()) {
+            state = HELD_FRAGMENT;
+            if(rec.IsPaired() && rec.IsMateMapped())
+                state |= HELD_PAIR;
+        }
+        stream_states.push_back(state);
+        if(state)
+            addReadEnds(header, index, rec);
+        stream_held.push(prec);
+
+        if(!unmapped)
+            resolveStreamedEnds(sequence, position - DEDUP_STREAM_MAX_CLIP);
+        outputStreamedReads();
+
+        if (++index % 100000 == 0 && verbose) {
+            cerr << "\rRead " << index << " records. Holding " << stream_held.size() << " records and " << unmatchedEnds.size() << " unmatched pairs." << std::flush;
+        }
+    }
+
+    resolveStreamedEnds(INT_MAX, INT_MAX);
+
+    // mates that were never read don't make pairs
+    for(deque<uint8_t>::iterator i = stream_states.begin(); i != stream_states.end(); i++)
+        *i &= ~HELD_PAIR;
+    outputStreamedReads();
+
+    if(verbose)
+        cerr << "\rRead " << index << " records. " << unmatchedEnds.size() << " pairs never matched. Marked " << numDuplicateIndices << " records as duplicates, holding " << stream_held.spilledReads() << " records in temporary files." << endl;
+    if(verbose && unmatchedEnds.spilledFiles())
+        cerr << "Unmatched pairs were set aside in " << unmatchedEnds.spilledFiles() << " temporary files." << endl;
+
+    unmatchedEnds.clear();
+    streaming = false;
+    if(collect_metrics)
+        finishMetrics();
+
+    return 0;
+}
+
+/** The flags of a held read, or NULL if it has already been output. */
+uint8_t * MarkDuplicates::streamState(int64_t index) {
+    if(index < stream_base)
+        return NULL;
+    return &stream_states[index - stream_base];
+}
+
+/**
+ * Marks duplicates in all the sets that are complete once no more reads
+ * start before the given sequence and coordinate.
+ */
+void MarkDuplicates::resolveStreamedEnds(int sequence, int coordinate) {
+    if(sequence < frontier_sequence || (sequence == frontier_sequence && coordinate <= frontier_coordinate))
+        return;
+    frontier_sequence = sequence;
+    frontier_coordinate = coordinate;
+
+    ReadEnds frontier;
+    frontier.setRead1Sequence(sequence);
+    frontier.setRead2Sequence(sequence);
+    frontier.setRead1Coordinate(coordinate);
+    frontier.setRead2Coordinate(coordinate);
+
+    vector<ReadEnds> complete;
+    while(!streamPairs.empty() && PairEndsLater()(frontier, streamPairs.front())) {
+        pop_heap(streamPairs.begin(), streamPairs.end(), PairEndsLater());
+        complete.push_back(streamPairs.back());
+        streamPairs.pop_back();
+    }
+    if(!complete.empty()) {
+        sort(complete.begin(), complete.end());
+        ReadEndsVectorSource source(complete);
+        markDuplicatePairSets(source);
+        for(vector<ReadEnds>::const_iterator i = complete.begin(); i != complete.end(); i++) {
+            uint8_t * state = streamState(i->getRead1IndexInFile());
+            if(state)
+                *state &= ~HELD_PAIR;
+            state = streamState(i->getRead2IndexInFile());
+            if(state)
+                *state &= ~HELD_PAIR;
+        }
+        complete.clear();
+    }
+
+    while(!streamPairLocations.empty() && PairEndsLater()(frontier, streamPairLocations.front())) {
+        pop_heap(streamPairLocations.begin(), streamPairLocations.end(), PairEndsLater());
+        complete.push_back(streamPairLocations.back());
+        streamPairLocations.pop_back();
+    }
+    if(!complete.empty()) {
+        sort(complete.begin(), complete.end());
+        ReadEndsVectorSource source(complete);
+        countOpticalDuplicateSets(source);
+        complete.clear();
+    }
+
+    while(!streamFragments.empty() && FragmentEndsLater()(frontier, streamFragments.front())) {
+        pop_heap(streamFragments.begin(), streamFragments.end(), FragmentEndsLater());
+        complete.push_back(streamFragments.back());
+        streamFragments.pop_back();
+    }
+    if(!complete.empty()) {
+        sort(complete.begin(), complete.end());
+        decideUnmatchedMates(complete);
+        ReadEndsVectorSource source(complete);
+        markDuplicateFragmentSets(source);
+        for(vector<ReadEnds>::const_iterator i = complete.begin(); i != complete.end(); i++) {
+            uint8_t * state = streamState(i->getRead1IndexInFile());
+            if(state)
+                *state &= ~HELD_FRAGMENT;
+        }
+    }
+}
+
+/**
+ * Reads whose mate hasn't been read yet would otherwise be held until it is,
+ * which for mates on another chromosome can be most of the input. Any other
+ * pair in the read's pair set has a read in the read's fragment set, with
+ * its mate on the same chromosome. If there is none, the pair set has just
+ * this pair, and the read isn't a duplicate.
+ */
+void MarkDuplicates::decideUnmatchedMates(const vector<ReadEnds>& sorted) {
+    map<int, int> mate_sequences;
+
+    for(size_t start = 0; start < sorted.size(); ) {
+        size_t end = start + 1;
+        while(end < sorted.size() && areComparableForDuplicates(sorted[start], sorted[end], false))
+            end++;
+
+        mate_sequences.clear();
+        for(size_t i = start; i < end; i++)
+            if(sorted[i].isPaired())
+                mate_sequences[sorted[i].getRead2Sequence()]++;
+
+        for(size_t i = start; i < end; i++) {
+            uint8_t * state = streamState(sorted[i].getRead1IndexInFile());
+            if(state && (*state & (HELD_PAIR | HELD_MATCHED)) == HELD_PAIR && mate_sequences[sorted[i].getRead2Sequence()] == 1)
+                *state &= ~HELD_PAIR;
+        }
+        start = end;
+    }
+}
+
+/** Outputs held reads, in order, until one is still waiting for a set. */
+void MarkDuplicates::outputStreamedReads() {
+    while(!stream_states.empty() && !(stream_states.front() & (HELD_FRAGMENT | HELD_PAIR))) {
+        uint8_t state = stream_states.front();
+        stream_states.pop_front();
+        stream_base++;
+
+        OGERead * read = stream_held.pop();
+        if (read->IsPrimaryAlignment())
+            read->SetIsDuplicate(state & HELD_DUPLICATE);
+        if (collect_metrics)
+            countRead(*read, state & HELD_DUPLICATE);
+
+        if (removeDuplicates && read->IsDuplicate())
+            delete read;
+        else
+            putOutputAlignment(read);
+    }
+}
+
 /**
  * Takes a list of ReadEnds objects and removes from it all objects that should
  * not be marked as duplicates.
  *
  * @param list
  */
-void MarkDuplicates::markDuplicatePairs(const vector<ReadEnds *>& list) {
+void MarkDuplicates::markDuplicatePairs(const vector<ReadEnds>& list) {
     short maxScore = 0;
-    ReadEnds * best = NULL;
+    size_t best = 0;
     
-    for (int i = 0; i < list.size(); i++) {
-        ReadEnds * end = list[i];
-        if (end->score > maxScore || best == NULL) {
-            maxScore = end->score;
-            best = end;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].getScore() > maxScore || i == 0) {
+            maxScore = list[i].getScore();
+            best = i;
         }
     }
     
-    for (int i = 0; i < list.size(); i++) {
-        ReadEnds * end = list[i];
-        if (end != best) {
-            addIndexAsDuplicate(end->read1IndexInFile);
-            addIndexAsDuplicate(end->read2IndexInFile);
+    for (size_t i = 0; i < list.size(); i++) {
+        if (i != best) {
+            addIndexAsDuplicate(list[i].getRead1IndexInFile());
+            addIndexAsDuplicate(list[i].getRead2IndexInFile());
         }
     }
 }
@@ -512,45 +906,26 @@ void MarkDuplicates::markDuplicatePairs(const vector<ReadEnds *>& list) {
  *
  * @param list
  */
-void MarkDuplicates::markDuplicateFragments(const vector<ReadEnds *>& list, bool containsPairs) {
+void MarkDuplicates::markDuplicateFragments(const vector<ReadEnds>& list, bool containsPairs) {
     if (containsPairs) {
-        for (int i = 0; i < list.size(); i++) {
-            ReadEnds * end = list[i];
-            if (!end->isPaired()) 
-                addIndexAsDuplicate(end->read1IndexInFile);
+        for (size_t i = 0; i < list.size(); i++) {
+            if (!list[i].isPaired()) 
+                addIndexAsDuplicate(list[i].getRead1IndexInFile());
         }
     }
     else {
         short maxScore = 0;
-        ReadEnds * best = NULL;
-        for (int i = 0; i < list.size(); i++) {
-            ReadEnds * end = list[i];
-            if (end->score > maxScore || best == NULL) {
-                maxScore = end->score;
-                best = end;
+        size_t best = 0;
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i].getScore() > maxScore || i == 0) {
+                maxScore = list[i].getScore();
+                best = i;
             }
         }
         
-        for (int i = 0; i < list.size(); i++) {
-            ReadEnds * end = list[i];
-            if (end != best)
-                addIndexAsDuplicate(end->read1IndexInFile);
+        for (size_t i = 0; i < list.size(); i++) {
+            if (i != best)
+                addIndexAsDuplicate(list[i].getRead1IndexInFile());
         }
     }
 }
-
-/** Comparator for ReadEnds that orders by read1 position then pair orientation then read2 position. */
-class ReadEndsComparator {
-    int compare(ReadEnds lhs, ReadEnds rhs) {
-        int retval = lhs.libraryId - rhs.libraryId;
-        if (retval == 0) retval = lhs.read1Sequence - rhs.read1Sequence;
-        if (retval == 0) retval = lhs.read1Coordinate - rhs.read1Coordinate;
-        if (retval == 0) retval = lhs.orientation - rhs.orientation;
-        if (retval == 0) retval = lhs.read2Sequence   - rhs.read2Sequence;
-        if (retval == 0) retval = lhs.read2Coordinate - rhs.read2Coordinate;
-        if (retval == 0) retval = (int) (lhs.read1IndexInFile - rhs.read1IndexInFile);
-        if (retval == 0) retval = (int) (lhs.read2IndexInFile - rhs.read2IndexInFile);
-        
-        return retval;
-    }
-};
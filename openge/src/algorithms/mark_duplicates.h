@@ -19,27 +19,93 @@
 
 #include "algorithm_module.h"
 #include "../util/picard_structures.h"
+#include "../util/spill_queue.h"
+#include "../util/index_bitmap.h"
+#include "../util/optical_duplicate_finder.h"
+#include "../util/duplication_metrics.h"
 
+#include <deque>
 #include <map>
 #include <string>
 #include <vector>
 
+// Memory for reads held back while streaming coordinate sorted input. 0
+// writes all reads to a temp file first.
+const size_t DEDUP_DEFAULT_STREAM_WINDOW = 0;
+
+// Clipped bases allowed at the start of a read when streaming. A read's
+// duplicates are only known once no later read can have its unclipped
+// 5' position, which for forward reads is before its alignment start.
+const int DEDUP_STREAM_MAX_CLIP = 10000;
+
+// Memory for sorting the ends of reads and pairs, before using temp files.
+const size_t DEDUP_DEFAULT_READ_ENDS_MEMORY = 512 * 1024 * 1024;
+
 class MarkDuplicates : public AlgorithmModule
 {
 protected:
-    std::vector<ReadEnds *> pairSort;
-    std::vector<ReadEnds *> fragSort;
-    std::set<int> duplicateIndexes;
-    int numDuplicateIndices;
+    ReadEndsSortingCollection pairSort;
+    ReadEndsSortingCollection fragSort;
+    size_t read_ends_memory;
+    bool spill_unmatched_ends;
+    IndexBitmap duplicateIndexes;
+    uint64_t numDuplicateIndices;
     
     std::map<std::string,short> libraryIds;
     short nextLibraryId;
     
     std::string bufferFilename;
+
+    ReadEndsMap unmatchedEnds;
+
+    // Metrics, only collected if asked for. The locations of pairs are kept
+    // in ends with the same keys as the pairs, so they sort into the same
+    // duplicate sets.
+    bool collect_metrics;
+    DuplicationMetrics metrics;
+    OpticalDuplicateFinder optical_duplicates;
+    ReadEndsSortingCollection pairLocations;
+    std::vector<ReadEnds> streamPairLocations;
+    std::vector<std::string> libraryNames;                  // by library ID
+    std::map<std::string, std::string> readGroupLibraries;
+    std::map<std::string, short> readGroupIds;
+
+    // Streaming state. Reads are held in stream_held, and their flags in
+    // stream_states, from index stream_base on, until their duplicate
+    // sets are complete.
+    size_t stream_window;
+    bool streaming;
+    int64_t stream_base;
+    std::deque<uint8_t> stream_states;
+    SpillQueue stream_held;
+    std::vector<ReadEnds> streamPairs;      // heaps of ends whose sets aren't complete
+    std::vector<ReadEnds> streamFragments;
+    int frontier_sequence, frontier_coordinate;
     
 public:
     bool removeDuplicates;
-    MarkDuplicates(std::string temp_directory);
+    MarkDuplicates();
+
+    // Memory for streaming coordinate sorted input, instead of writing all
+    // reads to a temporary file while finding duplicates. 0 disables.
+    size_t getStreamWindow() { return stream_window; }
+    void setStreamWindow(size_t stream_window) { this->stream_window = stream_window; }
+
+    // Memory for sorting read ends. Beyond it, they are sorted in temporary files.
+    size_t getReadEndsMemory() { return read_ends_memory; }
+    void setReadEndsMemory(size_t read_ends_memory) { this->read_ends_memory = read_ends_memory; }
+
+    // Set aside pairs whose mates are on later sequences of sorted input, in
+    // temporary files beyond a quarter of the read ends memory. Mates are
+    // then only found on the sequence the pair says they are on.
+    bool getSpillUnmatchedEnds() { return spill_unmatched_ends; }
+    void setSpillUnmatchedEnds(bool spill) { spill_unmatched_ends = spill; }
+
+    // Count duplicates, including optical duplicates, for getMetrics().
+    bool getCollectMetrics() { return collect_metrics; }
+    void setCollectMetrics(bool collect) { collect_metrics = collect; }
+    void setOpticalDistance(int distance) { optical_duplicates.setMaxDistance(distance); }
+    const DuplicationMetrics & getMetrics() const { return metrics; }
 
 protected:
     /////////////////
@@ -53,16 +119,31 @@ protected:
     ////////////////
     // From Picard MarkDuplicates.java
     short getScore(const OGERead & rec);
-    ReadEnds * buildReadEnds(BamHeader & header, long index, const OGERead & rec);
+    ReadEnds buildReadEnds(BamHeader & header, int64_t index, const OGERead & rec);
     readends_orientation_t getOrientationByte(bool read1NegativeStrand, bool read2NegativeStrand);
     void buildSortedReadEndLists();
+    void addReadEnds(BamHeader & header, int64_t index, const OGERead & rec);
     short getLibraryId(BamHeader & header, const OGERead & rec);
     std::string getLibraryName(BamHeader & header, const OGERead & rec);
     void generateDuplicateIndexes();
     bool areComparableForDuplicates(const ReadEnds & lhs, const ReadEnds & rhs, bool compareRead2);
-    void addIndexAsDuplicate(long bamIndex);
-    void markDuplicatePairs(const std::vector<ReadEnds *>& list);
-    void markDuplicateFragments(const std::vector<ReadEnds *>& list, bool containsPairs);
+    void addIndexAsDuplicate(int64_t bamIndex);
+    void markDuplicatePairs(const std::vector<ReadEnds>& list);
+    void markDuplicateFragments(const std::vector<ReadEnds>& list, bool containsPairs);
+    template <class source_t> void markDuplicatePairSets(source_t & sorted);
+    template <class source_t> void markDuplicateFragmentSets(source_t & sorted);
+    template <class source_t> void countOpticalDuplicateSets(source_t & sorted);
+
+    void startMetrics(const BamHeader & header);
+    void countRead(const OGERead & read, bool duplicate);
+    void finishMetrics();
+    std::string readGroupOf(const OGERead & read);
+
+    int streamDuplicates();
+    uint8_t * streamState(int64_t index);
+    void resolveStreamedEnds(int sequence, int coordinate);
+    void decideUnmatchedMates(const std::vector<ReadEnds>& sorted);
+    void outputStreamedReads();
 
     int runInternal();
 };
@@ -23,16 +23,21 @@
 #include "read_sorter.h"
 #include "../util/thread_pool.h"
 #include <cassert>
+#include <cstring>
 using namespace std;
 
 #include "../util/bamtools/Sort.h"
 
 #include "mark_duplicates.h"
 
-#include "../util/bam_serializer.h"
-#include "../util/bgzf_output_stream.h"
+#include "../util/spill_file.h"
+#include "../util/temp_directories.h"
+#include "../util/radix_sort.h"
+#include "../util/read_sort_keys.h"
 
 #include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 using namespace BamTools::Algorithms;
 
@@ -44,55 +49,282 @@ using namespace BamTools::Algorithms;
 #include <iostream>
 using namespace std;
 
-// generates mutiple sorted temp BAM files from single unsorted BAM file
-bool ReadSorter::GenerateSortedRuns(void) {
+// generates mutiple sorted temp BAM files from single unsorted BAM file. If
+// all of the reads fit in memory, sorts and outputs them instead. buffer
+// holds any reads that have already been taken from the input, or is NULL.
+bool ReadSorter::GenerateSortedRuns(vector<OGERead *> * buffer, size_t buffer_bytes) {
     
     if(isVerbose())
-        cerr << "Generating sorted temp files." << endl;
+        cerr << "Sorting reads." << endl;
     
-    // set up alignments buffer
-    vector<OGERead *> * buffer = new vector<OGERead *>();
-    buffer->reserve( (size_t)(alignments_per_tempfile*1.1) );
+    // While nothing has been spilled, the whole budget is used for one run.
+    // After that, it is shared between the run being read and the runs
+    // waiting for, or being written by, each thread.
+    const size_t writers = isNothreads() ? 0 : max(OGEParallelismSettings::getNumberThreads(), 1);
+    const size_t run_bytes = max(sort_memory / (1 + writers), (size_t)1);
+    run_budget.reset();
+    run_budget.setLimit(sort_memory);
+    merge_fan_in = CalculateMergeFanIn();
+
+    if(buffer)
+        run_budget.charge(buffer_bytes, buffer->size());
+    else {
+        buffer = new vector<OGERead *>();
+        buffer_bytes = 0;
+    }
 
     // iterate through file
     while (true) {
         OGERead * al = getInputAlignment();
         if(!al)
             break;
-
-        // store alignments until buffer is "full"
-        if ( buffer->size() < alignments_per_tempfile )
-            buffer->push_back(al);
         
-        // if buffer is "full"
-        else {
-            // create a sorted temp file with current buffer contents
-            // then push "al" into fresh buffer
-            CreateSortedTempFile(buffer);
+        size_t bytes = al->memoryUsage() + sizeof(OGERead *);
+        bool spilling = !m_tempFilenames.empty();
+        bool full = (alignments_per_tempfile && buffer->size() >= alignments_per_tempfile)
+            || (!buffer->empty() && buffer_bytes + bytes > (spilling ? run_bytes : sort_memory));
+
+        // if buffer is "full", create sorted temp files with its contents,
+        // then push "al" into a fresh buffer
+        if(full) {
+            if(spilling)
+                CreateSortedTempFile(buffer, buffer_bytes);
+            else {
+                if(isVerbose())
+                    cerr << "\rReads don't fit in " << sort_memory / (1024 * 1024) << " MB; using temp files." << endl;
+                SpillFirstRun(buffer, run_bytes);
+            }
             buffer = new vector<OGERead *>();
-            buffer->reserve( (size_t)(alignments_per_tempfile*1.1) );
-            buffer->push_back(al);
+            buffer_bytes = 0;
         }
+
+        // blocks while the runs being written hold the rest of the budget
+        run_budget.acquire(bytes);
+        buffer->push_back(al);
+        buffer_bytes += bytes;
+
         if(read_count % 100000 == 0 && verbose)
             cerr << "\rRead " << read_count/1000 << "K reads." << flush;
     }
     
+    if(isVerbose())
+        cerr << "\rRead " << read_count/1000 << "K reads (done)." << endl;
+    
+    if(m_tempFilenames.empty())
+        return OutputSortedBuffer(buffer, buffer_bytes);
+
     // handle any leftover buffer contents
     if ( !buffer->empty() )
-        CreateSortedTempFile(buffer);
+        CreateSortedTempFile(buffer, buffer_bytes);
+    else
+        delete buffer;
 
     //wait for all temp files to be created in other threads
     if(!isNothreads())
         thread_pool->waitForJobCompletion();
     
+    return true;
+}
+
+// The first run holds the whole budget. Split it into runs of the size used
+// from now on, so that they are sorted and written in parallel.
+void ReadSorter::SpillFirstRun(vector<OGERead *> * buffer, size_t run_bytes) {
+    vector<OGERead *> * run = new vector<OGERead *>();
+    size_t bytes = 0;
+
+    for(size_t i = 0; i < buffer->size(); i++) {
+        size_t read_bytes = (*buffer)[i]->memoryUsage() + sizeof(OGERead *);
+        if(!run->empty() && bytes + read_bytes > run_bytes) {
+            CreateSortedTempFile(run, bytes);
+            run = new vector<OGERead *>();
+            bytes = 0;
+        }
+        run->push_back((*buffer)[i]);
+        bytes += read_bytes;
+    }
+    CreateSortedTempFile(run, bytes);
+    delete buffer;
+}
+
+bool ReadSorter::OutputSortedBuffer(vector<OGERead *> * buffer, size_t buffer_bytes) {
+    if(isVerbose())
+        cerr << "Sorting " << buffer->size() << " reads in memory." << endl;
+
+    SortBuffer(*buffer);
+
+    for(size_t i = 0; i < buffer->size(); i++)
+        putOutputAlignment((*buffer)[i]);
+
+    run_budget.release(buffer_bytes);
+    delete buffer;
+    return true;
+}
+
+// A read held in the reorder window. Reads that sort equally leave the
+// window in the order they arrived, as they would from a stable sort.
+struct ReorderWindowItem {
+    ReadMergeItem item;
+    uint64_t sequence;
+    size_t bytes;
+};
+
+// Orders the window's priority queue so that the first read is on top.
+struct ReorderWindowLater {
+    bool operator()(const ReorderWindowItem & a, const ReorderWindowItem & b) const {
+        if(less(b.item, a.item))
+            return true;
+        if(less(a.item, b.item))
+            return false;
+        return a.sequence > b.sequence;
+    }
+    ReadMergeLess less;
+};
+
+// The sort order of the last read output from the reorder window. The read
+// itself belongs to the next module once it is output, so its name is kept.
+struct ReorderWindowLast {
+    uint64_t key;
+    std::string name;
+    uint16_t flag;
+
+    void set(const OGERead * read, uint64_t key) {
+        this->key = key;
+        name.assign(read->getBamEncodedStringData().c_str());
+        flag = read->getAlignmentFlag();
+    }
+
+    // true if a read with this key belongs before the last read
+    bool after(const OGERead * read, uint64_t key) const {
+        if(key != this->key)
+            return key < this->key;
+        if(key == OGE_POSITION_KEY_UNMAPPED)
+            return false;
+        int name_cmp = strcmp(read->getBamEncodedStringData().c_str(), name.c_str());
+        if(name_cmp != 0)
+            return name_cmp < 0;
+        return read->getAlignmentFlag() < flag;
+    }
+};
+
+// Input that is already sorted by coordinate, such as aligner output that
+// went through samtools sort, only needs neighbouring reads put in the
+// order of Sort::ByPosition (strand, then name). Reads are passed through a
+// window of reorder_window bytes, and the first read leaves the window
+// whenever it is full, so no temp files are needed. Each read is checked
+// against the last one to leave the window, as Statistics checks the
+// sorted flag.
+//
+// Reads that have left the window are held back until sort_memory bytes of
+// input have been found to be in order. If a read is out of order before
+// then, nothing has been output yet, and the reads are sorted as usual.
+// Once output has started, reads can't be taken back, so a read that is
+// out of order by more than the window aborts.
+bool ReadSorter::StreamPresortedReads(void) {
+    const size_t window_bytes = min(reorder_window, sort_memory);
+    if(isVerbose())
+        cerr << "Checking whether the input is sorted by coordinate." << endl;
+
+    ReadMergeLess less;
+    priority_queue<ReorderWindowItem, vector<ReorderWindowItem>, ReorderWindowLater> window;
+    size_t bytes = 0;
+    uint64_t sequence = 0;
+    ReorderWindowLast last;
+    bool any_left = false;
+    vector<OGERead *> held;
+    size_t held_bytes = 0;
+    bool streaming = false;
+
+    while(true) {
+        OGERead * al = getInputAlignment();
+        if(!al)
+            break;
+
+        ReorderWindowItem window_item;
+        window_item.item = less.item(al);
+        window_item.sequence = sequence++;
+        window_item.bytes = al->memoryUsage() + sizeof(ReorderWindowItem);
+
+        if(any_left && last.after(al, window_item.item.key)) {
+            if(!streaming) {
+                if(isVerbose())
+                    cerr << "\rInput is not sorted by coordinate; sorting it." << endl;
+
+                vector<OGERead *> * buffer = new vector<OGERead *>();
+                buffer->swap(held);
+                for( ; !window.empty(); window.pop())
+                    buffer->push_back(window.top().item.read);
+                buffer->push_back(al);
+
+                size_t buffer_bytes = 0;
+                for(size_t i = 0; i < buffer->size(); i++)
+                    buffer_bytes += (*buffer)[i]->memoryUsage() + sizeof(OGERead *);
+
+                return GenerateSortedRuns(buffer, buffer_bytes);
+            }
+
+            const BamSequenceRecords & sequences = m_header.getSequences();
+            cerr << "Read " << al->getName() << " at ";
+            if(al->getRefID() >= 0 && al->getRefID() < (int)sequences.size())
+                cerr << sequences[al->getRefID()].getName();
+            else
+                cerr << al->getRefID();
+            cerr << ":" << al->getPosition() + 1 << " is out of order by more than the "
+                 << window_bytes / (1024 * 1024) << " MB reorder window, after the first "
+                 << sort_memory / (1024 * 1024) << " MB of input was found to be sorted by coordinate. "
+                 << "Use a larger --reorder-window, or leave it out to sort all input." << endl;
+            exit(-1);
+        }
+
+        window.push(window_item);
+        bytes += window_item.bytes;
+
+        if(read_count % 100000 == 0 && verbose)
+            cerr << "\rRead " << read_count/1000 << "K reads." << flush;
+
+        // once the window is full, the reads that sort first leave it
+        while(bytes > window_bytes) {
+            OGERead * read = window.top().item.read;
+            last.set(read, window.top().item.key);
+            any_left = true;
+            bytes -= window.top().bytes;
+            if(streaming)
+                putOutputAlignment(read);
+            else {
+                held.push_back(read);
+                held_bytes += window.top().bytes;
+            }
+            window.pop();
+        }
+
+        if(!streaming && held_bytes + bytes > sort_memory) {
+            if(isVerbose())
+                cerr << "\rInput is sorted by coordinate; reordering reads within " << window_bytes / (1024 * 1024) << " MB." << endl;
+            streaming = true;
+            for(size_t i = 0; i < held.size(); i++)
+                putOutputAlignment(held[i]);
+            held.clear();
+        }
+    }
+
+    if(!streaming && isVerbose())
+        cerr << "\rInput is sorted by coordinate; reordering reads within " << window_bytes / (1024 * 1024) << " MB." << endl;
+
+    for(size_t i = 0; i < held.size(); i++)
+        putOutputAlignment(held[i]);
+
+    while(!window.empty()) {
+        putOutputAlignment(window.top().item.read);
+        window.pop();
+    }
+
     if(isVerbose())
         cerr << "\rRead " << read_count/1000 << "K reads (done)." << endl;
-    
+
     return true;
 }
 
-ReadSorter::TempFileWriteJob::TempFileWriteJob(ReadSorter * tool, vector<OGERead *> * buffer, string filename) :
-filename(filename), buffer(buffer), tool(tool)
+ReadSorter::TempFileWriteJob::TempFileWriteJob(ReadSorter * tool, vector<OGERead *> * buffer, size_t buffer_bytes, size_t index, string filename) :
+filename(filename), index(index), buffer(buffer), buffer_bytes(buffer_bytes), tool(tool)
 {
 }
 
@@ -112,13 +344,48 @@ void ReadSorter::TempFileWriteJob::runJob()
     for(size_t i = 0; i < buffer->size(); i++)
         OGERead::deallocate((*buffer)[i]);
     delete buffer;
+    tool->run_budget.release(buffer_bytes);
+
+    tool->RunFinished(0, index, filename);
 }
 
-bool ReadSorter::CreateSortedTempFile(vector<OGERead* > * buffer) {
-    //make filename
+ReadSorter::TempFileMergeJob::TempFileMergeJob(ReadSorter * tool, const vector<string> & inputs, int level, size_t index) :
+tool(tool), inputs(inputs), level(level), index(index)
+{
+}
+
+// Total size of temp files, to place a file merged from them.
+static uint64_t TempFilesSize(const vector<string> & filenames) {
+    uint64_t size = 0;
+    for(vector<string>::const_iterator i = filenames.begin(); i != filenames.end(); i++) {
+        struct stat st;
+        if(0 == stat(i->c_str(), &st))
+            size += st.st_size;
+    }
+    return size;
+}
+
+void ReadSorter::TempFileMergeJob::runJob()
+{
+    string filename = tool->TempFilename(level, index, TempFilesSize(inputs));
+    tool->MergeTempFiles(inputs, filename);
+    tool->RunFinished(level, index, filename);
+}
+
+// Temp files are spread over the temp directories as they are created.
+string ReadSorter::TempFilename(int level, size_t index, uint64_t expected_bytes) {
     stringstream filename_ss;
-    filename_ss << m_tempFilenameStub << "_" << m_numberOfRuns << ".bam";
-    string filename = filename_ss.str();
+    filename_ss << TempDirectories::choose(expected_bytes) << m_tempFilenameStub << "_";
+    if(level)
+        filename_ss << "L" << level << "_";
+    filename_ss << index << ".spill";
+    return filename_ss.str();
+}
+
+bool ReadSorter::CreateSortedTempFile(vector<OGERead* > * buffer, size_t buffer_bytes) {
+    //make filename
+    size_t index = m_numberOfRuns;
+    string filename = TempFilename(0, index, buffer_bytes);
     m_tempFilenames.push_back(filename);
 
     ++m_numberOfRuns;
@@ -134,9 +401,11 @@ bool ReadSorter::CreateSortedTempFile(vector<OGERead* > * buffer) {
         for(size_t i = 0; i < buffer->size(); i++)
             OGERead::deallocate((*buffer)[i]);
         delete buffer;
+        run_budget.release(buffer_bytes);
         
+        RunFinished(0, index, filename);
     } else {
-        TempFileWriteJob * job = new TempFileWriteJob(this, buffer, filename);
+        TempFileWriteJob * job = new TempFileWriteJob(this, buffer, buffer_bytes, index, filename);
         thread_pool->addJob(job);
     }
     
@@ -145,21 +414,155 @@ bool ReadSorter::CreateSortedTempFile(vector<OGERead* > * buffer) {
     return success;
 }
 
-// merges sorted temp BAM files into single sorted output BAM file
+// Each reader buffers one compressed and one uncompressed block of its file.
+static const size_t SORT_MERGE_READER_MEMORY = 2 * SPILL_BLOCK_SIZE;
+
+// Leave this many file descriptors for input, output and everything else.
+static const size_t SORT_MERGE_RESERVED_FILES = 32;
+
+// Background merges run on every thread at once, so they share the file and
+// memory limits between them, and with the temp files being written.
+size_t ReadSorter::CalculateMergeFanIn(void) {
+    if(max_merge_fan_in)
+        return max(max_merge_fan_in, (size_t)2);
+
+    const size_t merges = isNothreads() ? 1 : max(OGEParallelismSettings::getNumberThreads(), 1);
+
+    size_t open_files = 1024;
+    rlimit limit;
+    if(0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY)
+        open_files = limit.rlim_cur;
+    size_t by_files = open_files > SORT_MERGE_RESERVED_FILES + 2 * merges ? (open_files - SORT_MERGE_RESERVED_FILES) / merges - 1 : 2;
+
+    // merge buffers may use up to a quarter of the sort memory
+    size_t by_memory = sort_memory / 4 / SORT_MERGE_READER_MEMORY / merges;
+
+    return max(min(by_files, by_memory), (size_t)2);
+}
+
+// Called when temp file (level, index) has been written. Once every file in
+// its group has been written, they are merged into the next level.
+void ReadSorter::RunFinished(int level, size_t index, const string & filename) {
+    vector<string> inputs;
+    size_t first = index / merge_fan_in * merge_fan_in;
+
+    runs_lock.lock();
+    unmerged_runs[make_pair(level, index)] = filename;
+    for(size_t i = first; i < first + merge_fan_in; i++) {
+        map<pair<int, size_t>, string>::iterator run = unmerged_runs.find(make_pair(level, i));
+        if(run == unmerged_runs.end())
+            break;
+        inputs.push_back(run->second);
+    }
+    if(inputs.size() == merge_fan_in) {
+        for(size_t i = first; i < first + merge_fan_in; i++)
+            unmerged_runs.erase(make_pair(level, i));
+    } else
+        inputs.clear();
+    runs_lock.unlock();
+
+    if(inputs.empty())
+        return;
+
+    if(isNothreads()) {
+        string merged = TempFilename(level + 1, index / merge_fan_in, TempFilesSize(inputs));
+        MergeTempFiles(inputs, merged);
+        RunFinished(level + 1, index / merge_fan_in, merged);
+    } else
+        thread_pool->addJob(new TempFileMergeJob(this, inputs, level + 1, index / merge_fan_in));
+}
+
+// Merges temp files into a new temp file, and deletes them. inputs must be
+// in the order their reads were read, so that equal reads keep their order.
+void ReadSorter::MergeTempFiles(const vector<string> & inputs, const string & output) {
+    MultiReader readers;
+    readers.setSortOrder(sort_order);
+    readers.setNameOrder(name_order);
+    readers.setKeyOrder(key_order);
+    if(!readers.open(inputs)) {
+        cerr << "Error opening reader for tempfiles: " << endl;
+        for (vector<string>::const_iterator tempIter = inputs.begin() ; tempIter != inputs.end(); ++tempIter )
+            cerr << "   " << *tempIter << endl;
+        exit(-1);
+    }
+
+    SpillWriter writer;
+    if(compress_temp_files)
+        writer.setCodec(SPILL_CODEC_DEFLATE);
+    if(!writer.open(output)) {
+        cerr << "ReadSorter ERROR: could not open tempfile " << output << " for writing." << endl;
+        exit(-1);
+    }
+
+    while(true) {
+        OGERead * a = readers.read();
+        if(!a)
+            break;
+        writer.write(*a);
+        OGERead::deallocate(a);
+    }
+
+    writer.close();
+    readers.close();
+
+    for (vector<string>::const_iterator tempIter = inputs.begin() ; tempIter != inputs.end(); ++tempIter )
+        remove(tempIter->c_str());
+}
+
+// merges sorted temp files into single sorted output
 bool ReadSorter::MergeSortedRuns(void) {
+    // The files left over from the background merges, in input order. A file
+    // at (level, index) starts with run index * fan_in^level.
+    map<size_t, string> first_run_files;
+    for(map<pair<int, size_t>, string>::const_iterator i = unmerged_runs.begin(); i != unmerged_runs.end(); i++) {
+        size_t first_run = i->first.second;
+        for(int level = 0; level < i->first.first; level++)
+            first_run *= merge_fan_in;
+        first_run_files[first_run] = i->second;
+    }
+    unmerged_runs.clear();
+
+    vector<string> files;
+    for(map<size_t, string>::const_iterator i = first_run_files.begin(); i != first_run_files.end(); i++)
+        files.push_back(i->second);
+
+    // too many files left to merge at once; merge groups of neighbours until there aren't
+    for(int pass = 1; files.size() > merge_fan_in; pass++) {
+        if(verbose)
+            cerr << "Merging " << files.size() << " temp files, " << merge_fan_in << " at a time..." << endl;
+        vector<string> merged;
+        for(size_t first = 0; first < files.size(); first += merge_fan_in) {
+            size_t last = min(first + merge_fan_in, files.size());
+            if(last - first == 1) {
+                merged.push_back(files[first]);
+                continue;
+            }
+            vector<string> inputs(files.begin() + first, files.begin() + last);
+            stringstream filename_ss;
+            filename_ss << TempDirectories::choose(TempFilesSize(inputs)) << m_tempFilenameStub << "_final" << pass << "_" << merged.size() << ".spill";
+            merged.push_back(filename_ss.str());
+            MergeTempFiles(inputs, merged.back());
+        }
+        files.swap(merged);
+    }
+
     if(verbose)
-        cerr << "Combining temp files for final output..." << endl;
+        cerr << "Combining " << files.size() << " temp files for final output..." << endl;
 
     MultiReader readers;
+    readers.setSortOrder(sort_order);
+    readers.setNameOrder(name_order);
+    readers.setKeyOrder(key_order);
     
-    if(!readers.open(m_tempFilenames)) {
+    if(!readers.open(files)) {
         cerr << "Error opening reader for tempfiles: " << endl;
 
-        for (vector<string>::const_iterator tempIter = m_tempFilenames.begin() ; tempIter != m_tempFilenames.end(); ++tempIter )
+        for (vector<string>::const_iterator tempIter = files.begin() ; tempIter != files.end(); ++tempIter )
             cerr << "   " << *tempIter << endl;
         exit(-1);
     }
 
+    size_t combined = 0;
     while(true) {
         OGERead * a = readers.read();
         
@@ -168,17 +571,19 @@ bool ReadSorter::MergeSortedRuns(void) {
         
         putOutputAlignment(a);
 
-        if(write_count % 100000 == 0 && verbose)
-            cerr << "\rCombined " << write_count/1000 << "K reads (" << 100 * write_count / read_count << "%)." << flush;
+        if(++combined % 100000 == 0 && verbose)
+            cerr << "\rCombined " << combined/1000 << "K reads (" << 100 * combined / read_count << "%)." << flush;
     }
     if(verbose && read_count)
-        cerr << "\rCombined " << write_count/1000 << "K reads (" << 100 * write_count / read_count << "%)." << endl;
+        cerr << "\rCombined " << combined/1000 << "K reads (" << 100 * combined / read_count << "%)." << endl;
+
+    readers.close();
 
     if(verbose)
-        cerr << "Clearing " << m_tempFilenames.size() << " temp files...";
+        cerr << "Clearing " << files.size() << " temp files...";
     
     // delete all temp files
-    for (vector<string>::const_iterator tempIter = m_tempFilenames.begin() ; tempIter != m_tempFilenames.end(); ++tempIter ) {
+    for (vector<string>::const_iterator tempIter = files.begin() ; tempIter != files.end(); ++tempIter ) {
         remove(tempIter->c_str());
     }
 
@@ -189,37 +594,202 @@ bool ReadSorter::MergeSortedRuns(void) {
     return true;
 }
 
-//this function is designed to accept either OGERead or OGERead* as T
-template<class T>
-void ReadSorter::SortBuffer(vector<T>& buffer) {
-    if(isNothreads())
-    {
-        if(sort_order == BamHeader::SORT_COORDINATE)
-            std::stable_sort( buffer.begin(), buffer.end(), Sort::ByName() );
-        else
-            std::stable_sort( buffer.begin(), buffer.end(), Sort::ByPosition() );
-    } else {
-        if(sort_order == BamHeader::SORT_QUERYNAME)
-            ogeSortMt( buffer.begin(), buffer.end(), Sort::ByName() );
-        else
-            ogeSortMt( buffer.begin(), buffer.end(), Sort::ByPosition() );
+void ReadSorter::SortBuffer(vector<OGERead *> & buffer) {
+    if(key_order)
+        SortByKey(buffer);
+    else if(sort_order == BamHeader::SORT_COORDINATE)
+        SortByPosition(buffer);
+    else
+        SortByName(buffer);
+}
+
+// Record for radix sorting reads by position. key[0] is the position key and
+// key[1] the name key of the read, so that the key order is the same as
+// Sort::ByPosition for all valid reads whose keys differ.
+struct PositionSortRecord {
+    uint64_t key[2];
+    OGERead * read;
+};
+
+struct PositionSortRecordCompare {
+    bool operator()(const PositionSortRecord & a, const PositionSortRecord & b) const {
+        return ReadPositionLess()(a.read, b.read);
     }
+};
+
+// Sort reads in the same order as Sort::ByPosition. Keys are extracted from
+// each read once and radix sorted; reads are only compared directly when
+// their keys are identical.
+void ReadSorter::SortByPosition(vector<OGERead *> & buffer) {
+    vector<PositionSortRecord> records(buffer.size()), scratch;
+    
+    for(size_t i = 0; i < buffer.size(); i++) {
+        OGERead * read = buffer[i];
+        
+        // Invalid references and positions share position keys, so the name
+        // key can't be used to order them. Sort those with the comparison function.
+        if(read->getRefID() < -1 || (read->getRefID() >= 0 && read->getPosition() < -1)) {
+            ogeSortMt(buffer.begin(), buffer.end(), Sort::ByPosition());
+            return;
+        }
+        
+        PositionSortRecord & r = records[i];
+        r.read = read;
+        r.key[0] = ogeReadPositionKey(*read);
+        
+        // Sort::ByPosition doesn't order unmapped reads
+        r.key[1] = r.key[0] == OGE_POSITION_KEY_UNMAPPED ? 0 : ogeReadNameKey(*read);
+    }
+    
+    ogeRadixSort<PositionSortRecord, 2>(records, scratch);
+    
+    // reads with identical keys are ordered by the rest of their names, and flags
+    for(size_t start = 0; start < records.size(); ) {
+        size_t end = start + 1;
+        while(end < records.size() && records[end].key[0] == records[start].key[0] && records[end].key[1] == records[start].key[1])
+            end++;
+        if(end - start > 1 && records[start].key[0] != OGE_POSITION_KEY_UNMAPPED)
+            std::stable_sort(records.begin() + start, records.begin() + end, PositionSortRecordCompare());
+        start = end;
+    }
+    
+    for(size_t i = 0; i < records.size(); i++)
+        buffer[i] = records[i].read;
+}
+
+// Record for radix sorting reads by name. The keys hold 16 bytes of the
+// name, starting after the prefix that every name in the buffer shares
+// (such as the instrument and run in Illumina names).
+struct NameSortRecord {
+    uint64_t key[2];
+    OGERead * read;
+};
+
+struct NameSortRecordCompare {
+    NameSortRecordCompare(name_order_t order)
+    : less(order)
+    {}
+    bool operator()(const NameSortRecord & a, const NameSortRecord & b) const {
+        return less(a.read, b.read);
+    }
+    ReadNameLess less;
+};
+
+// Sort reads by name, in name_order. Equal reads keep their order.
+void ReadSorter::SortByName(vector<OGERead *> & buffer) {
+    if(buffer.empty())
+        return;
+
+    // byte keys don't follow the natural order of numbers in names
+    if(name_order == NAME_ORDER_NATURAL) {
+        std::stable_sort(buffer.begin(), buffer.end(), ReadNameLess(name_order));
+        return;
+    }
+
+    const char * first = buffer[0]->getBamEncodedStringData().data();
+    size_t prefix = buffer[0]->getNameLength() ? buffer[0]->getNameLength() - 1 : 0;
+    for(size_t i = 1; i < buffer.size() && prefix; i++) {
+        const char * name = buffer[i]->getBamEncodedStringData().data();
+        size_t c = 0;
+        while(c < prefix && name[c] == first[c])
+            c++;
+        prefix = c;
+    }
+
+    vector<NameSortRecord> records(buffer.size()), scratch;
+    for(size_t i = 0; i < buffer.size(); i++) {
+        NameSortRecord & r = records[i];
+        r.read = buffer[i];
+        r.key[0] = ogeReadNameKey(*r.read, prefix);
+        r.key[1] = ogeReadNameKey(*r.read, prefix + 8);
+    }
+
+    ogeRadixSort<NameSortRecord, 2>(records, scratch);
+
+    // reads with identical keys are ordered by the rest of their names (and flags)
+    for(size_t start = 0; start < records.size(); ) {
+        size_t end = start + 1;
+        while(end < records.size() && records[end].key[0] == records[start].key[0] && records[end].key[1] == records[start].key[1])
+            end++;
+        if(end - start > 1)
+            std::stable_sort(records.begin() + start, records.begin() + end, NameSortRecordCompare(name_order));
+        start = end;
+    }
+
+    for(size_t i = 0; i < records.size(); i++)
+        buffer[i] = records[i].read;
+}
+
+// Record for sorting reads by a ReadKeyOrder. The keys hold the first 16
+// bytes of the read's key, which is kept whole in the sort's key arena.
+struct KeySortRecord {
+    uint64_t key[2];
+    size_t offset, length;
+    OGERead * read;
+};
+
+struct KeySortRecordCompare {
+    KeySortRecordCompare(const vector<char> & arena)
+    : arena(&arena[0])
+    {}
+    bool operator()(const KeySortRecord & a, const KeySortRecord & b) const {
+        int cmp = memcmp(arena + a.offset, arena + b.offset, min(a.length, b.length));
+        return cmp != 0 ? cmp < 0 : a.length < b.length;
+    }
+    const char * arena;
+};
+
+// Sort reads by key_order. Each read's key is built once; reads are radix
+// sorted by the start of their keys, and only reads whose keys start the
+// same have the rest of their keys compared.
+void ReadSorter::SortByKey(vector<OGERead *> & buffer) {
+    vector<KeySortRecord> records(buffer.size()), scratch;
+    vector<char> arena;
+    string key;
+
+    for(size_t i = 0; i < buffer.size(); i++) {
+        key.clear();
+        key_order->appendKey(*buffer[i], key);
+
+        KeySortRecord & r = records[i];
+        r.read = buffer[i];
+        r.key[0] = ReadKeyOrder::keyPrefix(key, 0);
+        r.key[1] = ReadKeyOrder::keyPrefix(key, 8);
+        r.offset = arena.size();
+        r.length = key.size();
+        arena.insert(arena.end(), key.begin(), key.end());
+    }
+    if(arena.empty())
+        arena.push_back(0);
+
+    ogeRadixSort<KeySortRecord, 2>(records, scratch);
+
+    for(size_t start = 0; start < records.size(); ) {
+        size_t end = start + 1;
+        while(end < records.size() && records[end].key[0] == records[start].key[0] && records[end].key[1] == records[start].key[1])
+            end++;
+        if(end - start > 1)
+            std::stable_sort(records.begin() + start, records.begin() + end, KeySortRecordCompare(arena));
+        start = end;
+    }
+
+    for(size_t i = 0; i < records.size(); i++)
+        buffer[i] = records[i].read;
 }
 
 bool ReadSorter::WriteTempFile(const vector<OGERead *>& buffer, const string& tempFilename)
 {
     // open temp file for writing
-    BamSerializer<BgzfOutputStream> tempWriter;
+    SpillWriter tempWriter;
     
-    tempWriter.getOutputStream().setCompressionLevel(compress_temp_files ? 6 : 0);
+    if(compress_temp_files)
+        tempWriter.setCodec(SPILL_CODEC_DEFLATE);
     
-    m_header_access.lock();
-    if ( !tempWriter.open(tempFilename, m_header) ) {
+    if ( !tempWriter.open(tempFilename) ) {
         cerr << "ReadSorter ERROR: could not open tempfile " << tempFilename
         << " for writing." << endl;
         exit(-1);
     }
-    m_header_access.unlock();
     
     // write data
     for (vector<OGERead *>::const_iterator buffIter = buffer.begin() ; buffIter != buffer.end(); ++buffIter )  {
@@ -256,18 +826,35 @@ int ReadSorter::runInternal()
     m_header_access.lock();
     m_header = AlgorithmModule::getHeader();
     m_header.setSortOrder( sort_order );
+    m_header.setGroupOrder("");
+    m_header.setSubSort("");
+
+    if(template_coordinate)
+        key_order = new TemplateCoordinateKeyOrder(m_header);
+    else if(!sort_tags.empty())
+        key_order = new TagKeyOrder(sort_tags, sort_order == BamHeader::SORT_QUERYNAME, name_order);
+    if(key_order)
+        key_order->setHeader(m_header);
     
     header_loaded = true;
     m_header_access.unlock();
     
-    bool retval = GenerateSortedRuns();
+    bool retval;
+    if(!key_order && sort_order == BamHeader::SORT_COORDINATE && reorder_window)
+        retval = StreamPresortedReads();
+    else
+        retval = GenerateSortedRuns();
     
-    if(retval)
+    // reads that fit in memory have already been sorted and output
+    if(retval && !m_tempFilenames.empty())
         retval = MergeSortedRuns();
     
     if(!isNothreads()) {
         delete thread_pool;
     }
+
+    delete key_order;
+    key_order = NULL;
     
     return retval;
 }
@@ -25,26 +25,43 @@
 #include "algorithm_module.h"
 #include "../commands/commands.h"
 #include "../util/read_stream_reader.h"
+#include "../util/read_sort_keys.h"
 
 #include <vector>
 #include <string>
+#include <map>
+
+// Default memory (in bytes) for reads held by the sorter.
+const size_t SORT_DEFAULT_MEMORY = (size_t)1024 * 1024 * 1024;
+
+// Default reorder window (in bytes) for input that is already sorted. 0
+// sorts all input.
+const size_t SORT_DEFAULT_REORDER_WINDOW = 0;
 
 class ReadSorter : public AlgorithmModule
 {
 public:
-    ReadSorter(const std::string & temp_directory)
-    : m_tempFilenameStub("/oge_sort_")
+    ReadSorter()
+    : m_tempFilenameStub("oge_sort_")
     , m_numberOfRuns(0)
     , m_numberOfAlignments(0)
     , header_loaded(false)
     , sort_order (BamHeader::SORT_COORDINATE)
     , compress_temp_files (false)
-    , alignments_per_tempfile(200000)
+    , alignments_per_tempfile(0)
+    , sort_memory(SORT_DEFAULT_MEMORY)
+    , max_merge_fan_in(0)
+    , reorder_window(SORT_DEFAULT_REORDER_WINDOW)
+    , name_order(NAME_ORDER_ASCII)
+    , template_coordinate(false)
+    , key_order(NULL)
+    , merge_fan_in(2)
+    , run_budget("ReadSorter runs")
     {
         char buffer[16];
         pid_t pid = getpid();
         sprintf(buffer, "%d", pid);
-        m_tempFilenameStub = temp_directory + m_tempFilenameStub + buffer;
+        m_tempFilenameStub += buffer;
     }
     
     ~ReadSorter(void) { }
@@ -55,11 +72,21 @@ protected:
     bool RunMerge(void);
     
     //from SortTool:
-    bool CreateSortedTempFile(std::vector<OGERead *> * buffer);
-    bool GenerateSortedRuns(void);
+    bool CreateSortedTempFile(std::vector<OGERead *> * buffer, size_t buffer_bytes);
+    void SpillFirstRun(std::vector<OGERead *> * buffer, size_t run_bytes);
+    bool GenerateSortedRuns(std::vector<OGERead *> * buffer = NULL, size_t buffer_bytes = 0);
+    bool StreamPresortedReads(void);
+    bool OutputSortedBuffer(std::vector<OGERead *> * buffer, size_t buffer_bytes);
     bool MergeSortedRuns(void);
+    size_t CalculateMergeFanIn(void);
+    void RunFinished(int level, size_t index, const std::string & filename);
+    void MergeTempFiles(const std::vector<std::string> & inputs, const std::string & output);
+    std::string TempFilename(int level, size_t index, uint64_t expected_bytes);
     bool WriteTempFile(const std::vector<OGERead *> & buffer, const std::string& tempFilename);
-    template<class T> void SortBuffer(std::vector<T>& buffer);
+    void SortBuffer(std::vector<OGERead *> & buffer);
+    static void SortByPosition(std::vector<OGERead *> & buffer);
+    void SortByName(std::vector<OGERead *> & buffer);
+    void SortByKey(std::vector<OGERead *> & buffer);
 
     // data members
 private:
@@ -75,18 +102,55 @@ private:
     //options:
     BamHeader::sort_order_t sort_order;
     bool compress_temp_files;
-    size_t alignments_per_tempfile;
+    size_t alignments_per_tempfile;     // 0 for no limit
+    size_t sort_memory;
+    size_t max_merge_fan_in;            // 0 to calculate from limits
+    size_t reorder_window;              // 0 to always sort
+    name_order_t name_order;
+    std::vector<std::string> sort_tags;
+    bool template_coordinate;
+
+    // Set up from the options above once the header is known, if the sort
+    // order is given by a key rather than sort_order.
+    ReadKeyOrder * key_order;
+
+    // Runs are merged in a tree, merge_fan_in runs at a time. The file
+    // (level, index) holds runs index * fan_in^level up to (index + 1) *
+    // fan_in^level. Files that haven't been merged into the next level yet
+    // are kept here.
+    size_t merge_fan_in;
+    mutex runs_lock;
+    std::map<std::pair<int, size_t>, std::string> unmerged_runs;
+
+    // Memory held by reads in the run being filled, and in runs waiting to be
+    // written to temp files.
+    QueueBudget run_budget;
 
 public:
     class TempFileWriteJob : public ThreadJob
     {
     public:
-        TempFileWriteJob(ReadSorter * tool, std::vector<OGERead *> * buffer, std::string filename);
+        TempFileWriteJob(ReadSorter * tool, std::vector<OGERead *> * buffer, size_t buffer_bytes, size_t index, std::string filename);
         virtual void runJob();
     protected:
         std::string filename;
+        size_t index;
         std::vector<OGERead *> * buffer;
+        size_t buffer_bytes;
+        ReadSorter * tool;
+    };
+
+    // Merges a complete group of temp files in the background.
+    class TempFileMergeJob : public ThreadJob
+    {
+    public:
+        TempFileMergeJob(ReadSorter * tool, const std::vector<std::string> & inputs, int level, size_t index);
+        virtual void runJob();
+    protected:
         ReadSorter * tool;
+        std::vector<std::string> inputs;
+        int level;
+        size_t index;
     };
 
 protected:
@@ -97,10 +161,40 @@ public:
     BamHeader::sort_order_t getSortBy() { return sort_order; }
     void setSortBy(BamHeader::sort_order_t sort_order) { this->sort_order = sort_order; }
 
+    name_order_t getNameOrder() { return name_order; }
+    void setNameOrder(name_order_t name_order) { this->name_order = name_order; }
+
+    // Sort by the values of these tags, before the position (or the name,
+    // when sorting by name).
+    const std::vector<std::string> & getSortTags() { return sort_tags; }
+    void setSortTags(const std::vector<std::string> & sort_tags) { this->sort_tags = sort_tags; }
+
+    // Sort in template-coordinate order, overriding the other orders.
+    bool getTemplateCoordinate() { return template_coordinate; }
+    void setTemplateCoordinate(bool template_coordinate) { this->template_coordinate = template_coordinate; }
+
     bool getCompressTempFiles() { return compress_temp_files; }
     void setCompressTempFiles(bool compress_temp_files) { this->compress_temp_files = compress_temp_files; }
 
     size_t getAlignmentsPerTempfile() { return alignments_per_tempfile; }
     void setAlignmentsPerTempfile(size_t alignments_per_tempfile) { this->alignments_per_tempfile = alignments_per_tempfile; }
+
+    // Reads are sorted in memory, without temp files, if they fit in this
+    // many bytes. Otherwise, runs are sized so that the run being read and
+    // the runs being written to temp files fit in it together.
+    size_t getSortMemory() { return sort_memory; }
+    void setSortMemory(size_t sort_memory) { this->sort_memory = sort_memory; }
+
+    // Most temp files to merge at once. By default, this is limited by the
+    // open file limit and sort memory.
+    size_t getMaxMergeFanIn() { return max_merge_fan_in; }
+    void setMaxMergeFanIn(size_t max_merge_fan_in) { this->max_merge_fan_in = max_merge_fan_in; }
+
+    // Input whose header says it is already sorted by coordinate is passed
+    // through a window of this many bytes, which only fixes the order of
+    // nearby reads, instead of being sorted. Reads further out of order than
+    // that are an error. 0 sorts all input.
+    size_t getReorderWindow() { return reorder_window; }
+    void setReorderWindow(size_t reorder_window) { this->reorder_window = reorder_window; }
 };
 #endif
\ No newline at end of file
@@ -335,6 +335,7 @@ struct RegionStringComparator {
 };
 
 int Repeatseq::runInternal() {
+    ThreadJobGroup repeatseq_jobs;
 
     srand( time(NULL) );
     
@@ -427,7 +428,7 @@ int Repeatseq::runInternal() {
 
         //start the job
         if(OGEParallelismSettings::isMultithreadingEnabled())
-            ThreadPool::sharedPool()->addJob(job);
+            ThreadPool::sharedPool()->addJob(job, &repeatseq_jobs);
         else
             job->runJob();
         jobs.push_back(job);
@@ -435,7 +436,7 @@ int Repeatseq::runInternal() {
 
     //wait for all workers to finish
     if(OGEParallelismSettings::isMultithreadingEnabled())
-        ThreadPool::sharedPool()->waitForJobCompletion();
+        ThreadPool::sharedPool()->waitForJobCompletion(repeatseq_jobs);
     
     flushWrites();
 
@@ -21,7 +21,8 @@
 #include <numeric>
 #include <pthread.h>
 
-#include "../util/bamtools/Sort.h"
+#include "../util/loser_tree.h"
+#include "../util/read_sort_keys.h"
 
 using namespace std;
 
@@ -57,40 +58,34 @@ void SortedMerge::addSource(AlgorithmModule * source)
     source->addSink(proxy);
 }
 
-bool SortedMerge::SortedMergeElement::operator<(const SortedMergeElement & t) const
-{
-    BamTools::Algorithms::Sort::ByPosition cmp = BamTools::Algorithms::Sort::ByPosition();
-    return cmp(this->read, t.read);
-}
-
 int SortedMerge::runInternal()
 {
     ogeNameThread("am_merge_sorted");
 
-    multiset<SortedMergeElement> reads;
+    ReadMergeLess merge_less;
+    LoserTree<ReadMergeItem, ReadMergeLess> reads(input_proxies.size(), merge_less);
     
-    // first, get one read from each queue
-    // make sure and deal with the case where one chain will never have any reads. TODO LCB
-
-    for(int ctr = 0; ctr < input_proxies.size(); ctr++)
+    // first, get one read from each queue. Sources that never have any reads
+    // are left exhausted.
+    for(size_t ctr = 0; ctr < input_proxies.size(); ctr++)
     {
         OGERead * read = input_proxies[ctr]->getInputAlignment();
 
         if(read)
-            reads.insert(SortedMergeElement(read, input_proxies[ctr]));
+            reads.setItem(ctr, merge_less.item(read));
     }
+    reads.build();
 
-    //now handle the steady state situation. When sources are done, We
-    // won't have a read any more in the reads pqueue.
+    //now handle the steady state situation. When sources are done, they
+    // drop out of the tree.
     while(!reads.empty()) {
-        SortedMergeElement el = *reads.begin();
-        reads.erase(reads.begin());
-
-        putOutputAlignment(el.read);
+        putOutputAlignment(reads.top().read);
 
-        el.read = el.source->getInputAlignment();
-        if(el.read)
-            reads.insert(el);
+        OGERead * read = input_proxies[reads.topSource()]->getInputAlignment();
+        if(read)
+            reads.replaceTop(merge_less.item(read));
+        else
+            reads.popTop();
     }
     
     done_signal_mutex.lock();
@@ -42,17 +42,6 @@ class SortedMerge : public AlgorithmModule
         virtual int runInternal();
     };
     
-    class SortedMergeElement{
-    public:
-        OGERead * read;
-        SortedMergeInputProxy * source;
-        bool operator<(const SortedMergeElement & t) const;
-        SortedMergeElement(OGERead * read, SortedMergeInputProxy * source)
-        : read(read)
-        , source(source)
-        {}
-    };
-    
 public:
     ~SortedMerge();
     void addSource(AlgorithmModule * source);
@@ -31,25 +31,34 @@ int SplitByChromosome::runInternal()
 {    
     ogeNameThread("am_split_chromo");
 
-    OGERead * read;
     number_of_splits = sinks.size();
-    while(true) {
-        
-        read = getInputAlignment();
-        
-        if(!read) break;
-
-        //this is essentially a modified implementation of AlgorithmModule::putOutputAlignment()
-        write_count++;
-        
-        int chain = read->getRefID() % number_of_splits;
+    
+    // This is essentially a modified implementation of AlgorithmModule::putOutputAlignment().
+    // Reads are staged for each sink, and sent on as full batches.
+    vector<vector<OGERead *> > sink_batches(number_of_splits);
+    vector<OGERead *> reads;
+    
+    while(getInputBatch(reads)) {
+        for(size_t i = 0; i < reads.size(); i++) {
+            OGERead * read = reads[i];
+            
+            int chain = read->getRefID() % number_of_splits;
 
-        if(read->getRefID() < 0)
-            chain = 0;
+            if(read->getRefID() < 0)
+                chain = 0;
 
-        sinks[chain]->putInputAlignment(read);
+            sink_batches[chain].push_back(read);
+            
+            if(sink_batches[chain].size() >= ALGORITHM_MODULE_BATCH_SIZE)
+                sinks[chain]->putInputBatch(sink_batches[chain]);
+        }
+        
+        write_count += reads.size();
     }
     
+    for(int i = 0; i < number_of_splits; i++)
+        sinks[i]->putInputBatch(sink_batches[i]);
+    
     if(verbose)
         for(int i = 0; i < sinks.size(); i++)
             cerr << "Chain " << i << " wrote " << sinks[i]->getReadCount() << endl;
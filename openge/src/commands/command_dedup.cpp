@@ -21,16 +21,38 @@
 #include "../algorithms/file_reader.h"
 #include "../algorithms/sorted_merge.h"
 #include "../algorithms/split_by_chromosome.h"
+#include "../util/read_stream_reader.h"
+#include <algorithm>
 #include <iostream>
 
 namespace po = boost::program_options;
 using namespace std;
 
+// Whether the input says it is sorted by coordinate. Standard input can't
+// be checked before it is read, so isn't.
+static bool inputSortedByCoordinate(const vector<string> & filenames)
+{
+    if(find(filenames.begin(), filenames.end(), "stdin") != filenames.end())
+        return false;
+
+    MultiReader reader;
+    if(!reader.open(filenames))
+        return false;
+    bool sorted = reader.getHeader().getSortOrder() == BamHeader::SORT_COORDINATE;
+    reader.close();
+    return sorted;
+}
+
 void DedupCommand::getOptions()
 {
     options.add_options()
     ("out,o", po::value<string>()->default_value("stdout"), "Output filename. Omit for stdout.")
     ("remove,r", "Remove duplicates")
+    ("dedup-mem", po::value<unsigned int>()->default_value(DEDUP_DEFAULT_READ_ENDS_MEMORY / (1024 * 1024)), "Memory (in MB) for sorting the positions of reads and pairs when marking duplicates. Beyond it, they are sorted in temp files.")
+    ("dedup-window", po::value<unsigned int>()->default_value(DEDUP_DEFAULT_STREAM_WINDOW / (1024 * 1024)), "Memory (in MB) for reads held back while marking duplicates in coordinate sorted input as it is read. 0 (the default) always writes all reads to a temp file first.")
+    ("dedup-spill-mates", "Set aside pairs whose mates are on a later chromosome of sorted input, in temp files beyond a quarter of --dedup-mem, until that chromosome is read.")
+    ("metrics", po::value<string>(), "Write duplicate counts for each library, including optical duplicates, to this file in the format of Picard's MarkDuplicates metrics.")
+    ("optical-distance", po::value<int>()->default_value(OPTICAL_DEFAULT_DISTANCE), "Maximum distance in x and y, in the read names, between optical duplicates.")
     ;
 }
 
@@ -39,16 +61,35 @@ int DedupCommand::runCommand()
     bool do_remove_duplicates = vm.count("remove") != 0;
     bool no_split = vm.count("nosplit") != 0;
     int compression_level = vm["compression"].as<int>();
+    size_t dedup_window = (size_t)vm["dedup-window"].as<unsigned int>() * 1024 * 1024;
+    size_t dedup_memory = (size_t)vm["dedup-mem"].as<unsigned int>() * 1024 * 1024;
+    bool dedup_spill_mates = vm.count("dedup-spill-mates") != 0;
+    string metrics_filename = vm.count("metrics") ? vm["metrics"].as<string>() : "";
+    int optical_distance = vm["optical-distance"].as<int>();
+    if(optical_distance < 0) {
+        cerr << "Optical duplicate distance (--optical-distance) can't be negative." << endl;
+        exit(-1);
+    }
+    if(dedup_memory == 0) {
+        cerr << "Duplicate marking memory (--dedup-mem) must be at least 1 MB." << endl;
+        exit(-1);
+    }
 
     if(no_split && verbose)
         cerr << "Disabling split-by-chromosome." << endl;
 
     int num_chains = min(12,OGEParallelismSettings::getNumberThreads()/2);
 
-    if(nothreads || no_split || num_chains <= 1)
+    // Sorted input streams through a single chain, which is cheaper than
+    // splitting it by chromosome and writing it all to temp files.
+    bool streaming = dedup_window && inputSortedByCoordinate(input_filenames);
+    if(streaming && verbose && !nothreads && !no_split && num_chains > 1)
+        cerr << "Input is sorted by coordinate. Disabling split-by-chromosome to mark duplicates as it is read." << endl;
+
+    if(nothreads || no_split || num_chains <= 1 || streaming)
     {
         FileReader reader;
-        MarkDuplicates mark_duplicates(tmpdir);
+        MarkDuplicates mark_duplicates;
         FileWriter writer;
 
         reader.setLoadStringData(false);
@@ -59,6 +100,11 @@ int DedupCommand::runCommand()
 
         mark_duplicates.addSink(&writer);
         mark_duplicates.removeDuplicates = do_remove_duplicates;
+        mark_duplicates.setStreamWindow(dedup_window);
+        mark_duplicates.setReadEndsMemory(dedup_memory);
+        mark_duplicates.setSpillUnmatchedEnds(dedup_spill_mates);
+        mark_duplicates.setCollectMetrics(!metrics_filename.empty());
+        mark_duplicates.setOpticalDistance(optical_distance);
 
         reader.addFiles(input_filenames);
         writer.setFilename(vm["out"].as<string>());
@@ -66,7 +112,14 @@ int DedupCommand::runCommand()
             writer.addProgramLine(command_line);
         writer.setCompressionLevel(compression_level);
         
-        return writer.runChain();
+        int ret = writer.runChain();
+
+        if(!metrics_filename.empty() && !mark_duplicates.getMetrics().write(metrics_filename)) {
+            cerr << "Couldn't write duplicate metrics to " << metrics_filename << "." << endl;
+            exit(-1);
+        }
+
+        return ret;
     } else {
         FileReader reader;
         SortedMerge merge;
@@ -86,10 +139,17 @@ int DedupCommand::runCommand()
         // each iteration of this loop forms one chain inside the split
         for(int ctr = 0; ctr < num_chains; ctr++)
         {  
-            MarkDuplicates * mark_duplicates = new MarkDuplicates(tmpdir);
+            MarkDuplicates * mark_duplicates = new MarkDuplicates();
             duplicate_markers.push_back(mark_duplicates);
             merge.addSource(mark_duplicates);
             mark_duplicates->removeDuplicates = do_remove_duplicates;
+            // a chain holding reads back would stall the merge of all chains
+            mark_duplicates->setStreamWindow(0);
+            mark_duplicates->setReadEndsMemory(dedup_memory / num_chains);
+            // mates on other chromosomes go to other chains, and are never read here
+            mark_duplicates->setSpillUnmatchedEnds(false);
+            mark_duplicates->setCollectMetrics(!metrics_filename.empty());
+            mark_duplicates->setOpticalDistance(optical_distance);
 
             split.addSink(mark_duplicates);
         }
@@ -104,6 +164,14 @@ int DedupCommand::runCommand()
             writer.addProgramLine(command_line);
         
         int ret = writer.runChain();
+
+        DuplicationMetrics metrics;
+        for(int ctr = 0; ctr < num_chains; ctr++)
+            metrics.add(duplicate_markers[ctr]->getMetrics());
+        if(!metrics_filename.empty() && !metrics.write(metrics_filename)) {
+            cerr << "Couldn't write duplicate metrics to " << metrics_filename << "." << endl;
+            exit(-1);
+        }
         
         //clean up allocated objects
         for(int ctr = 0; ctr < num_chains; ctr++)
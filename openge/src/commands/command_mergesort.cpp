@@ -40,10 +40,21 @@ void MergeSortCommand::getOptions()
     ("region,r", po::value<string>(), "Genomic region to use.")
     ("mapq,q", po::value<int>(), "Minimum map quality allowed in reads")
     ("byname,b", "Sort by name. Otherwise, sorts by position.")
-    ("n,n", po::value<int>()->default_value(5e5), "Alignments per temp file.")
-    ("compresstempfiles,C", "Compress temp files. By default, uncompressed")
+    ("name-order", po::value<string>()->default_value("ascii"), "Name order for --byname: ascii, picard (ascii, then first of pair before second), or natural (numbers in names by value, as samtools sort -n).")
+    ("sort-tag", po::value<string>(), "Sort by the values of these tags (comma separated), then by position, or by name (in --name-order) with --byname.")
+    ("template-coordinate", "Sort by the unclipped 5' positions of both reads of each template, keeping templates and molecules together.")
+    ("sort-mem", po::value<unsigned int>()->default_value(SORT_DEFAULT_MEMORY / (1024 * 1024)), "Memory (in MB) for reads being sorted. Temp files are only used for inputs that don't fit.")
+    ("n,n", po::value<int>(), "Maximum alignments per temp file. By default, only limited by --sort-mem.")
+    ("reorder-window", po::value<unsigned int>()->default_value(SORT_DEFAULT_REORDER_WINDOW / (1024 * 1024)), "Memory (in MB) for reordering input that turns out to be sorted by coordinate already, instead of sorting it. 0 (the default) always sorts.")
+    ("merge-fanin", po::value<unsigned int>(), "Maximum temp files to merge at once. By default, set from the open file limit and --sort-mem.")
+    ("compresstempfiles,C", "Compress temp files with deflate, overriding --tempcodec. Smaller, but slower.")
     ("markduplicates,M", "Mark duplicates after sorting.")
     ("removeduplicates,R", "Remove duplicates.")
+    ("dedup-mem", po::value<unsigned int>()->default_value(DEDUP_DEFAULT_READ_ENDS_MEMORY / (1024 * 1024)), "Memory (in MB) for sorting the positions of reads and pairs when marking duplicates. Beyond it, they are sorted in temp files.")
+    ("dedup-window", po::value<unsigned int>()->default_value(DEDUP_DEFAULT_STREAM_WINDOW / (1024 * 1024)), "Memory (in MB) for reads held back while marking duplicates as sorted reads are produced. 0 (the default) writes all sorted reads to a temp file first.")
+    ("dedup-spill-mates", "Set aside pairs whose mates are on a later chromosome of sorted input, in temp files beyond a quarter of --dedup-mem, until that chromosome is read.")
+    ("metrics", po::value<string>(), "Write duplicate counts for each library, including optical duplicates, to this file in the format of Picard's MarkDuplicates metrics.")
+    ("optical-distance", po::value<int>()->default_value(OPTICAL_DEFAULT_DISTANCE), "Maximum distance in x and y, in the read names, between optical duplicates.")
     ;
 }
 
@@ -58,14 +69,81 @@ int MergeSortCommand::runCommand()
     bool sort_by_names = vm.count("byname") != 0;
     int compression_level = vm["compression"].as<int>();
     bool compresstempfiles = vm.count("compresstempfiles") != 0;
-    int alignments_per_tempfile = vm["n"].as<int>();
+    int alignments_per_tempfile = vm.count("n") ? vm["n"].as<int>() : 0;
+    size_t sort_memory = (size_t)vm["sort-mem"].as<unsigned int>() * 1024 * 1024;
+    
+    if(sort_memory == 0) {
+        cerr << "Sort memory (--sort-mem) must be at least 1 MB." << endl;
+        exit(-1);
+    }
+    name_order_t name_order;
+    if(!ogeNameOrderFromName(vm["name-order"].as<string>(), name_order)) {
+        cerr << "Unknown name order " << vm["name-order"].as<string>() << ". Use ascii, picard or natural." << endl;
+        exit(-1);
+    }
+    vector<string> sort_tags;
+    if(vm.count("sort-tag")) {
+        string tags = vm["sort-tag"].as<string>();
+        size_t start = 0;
+        while(true) {
+            size_t end = tags.find(',', start);
+            string tag = tags.substr(start, end == string::npos ? string::npos : end - start);
+            if(tag.size() != 2) {
+                cerr << "Invalid sort tag '" << tag << "'. Tags are two characters, separated by commas." << endl;
+                exit(-1);
+            }
+            sort_tags.push_back(tag);
+            if(end == string::npos)
+                break;
+            start = end + 1;
+        }
+    }
+    bool template_coordinate = vm.count("template-coordinate") != 0;
+    if(template_coordinate && (sort_by_names || !sort_tags.empty())) {
+        cerr << "--template-coordinate can't be combined with --byname or --sort-tag." << endl;
+        exit(-1);
+    }
+    if(do_mark_duplicates && (template_coordinate || !sort_tags.empty())) {
+        cerr << "Duplicates can only be marked in coordinate order, not with --sort-tag or --template-coordinate." << endl;
+        exit(-1);
+    }
+    size_t dedup_window = (size_t)vm["dedup-window"].as<unsigned int>() * 1024 * 1024;
+    size_t dedup_memory = (size_t)vm["dedup-mem"].as<unsigned int>() * 1024 * 1024;
+    bool dedup_spill_mates = vm.count("dedup-spill-mates") != 0;
+    string metrics_filename = vm.count("metrics") ? vm["metrics"].as<string>() : "";
+    int optical_distance = vm["optical-distance"].as<int>();
+    if(optical_distance < 0) {
+        cerr << "Optical duplicate distance (--optical-distance) can't be negative." << endl;
+        exit(-1);
+    }
+    if(dedup_memory == 0) {
+        cerr << "Duplicate marking memory (--dedup-mem) must be at least 1 MB." << endl;
+        exit(-1);
+    }
+    if(!metrics_filename.empty() && !do_mark_duplicates) {
+        cerr << "Duplicate metrics (--metrics) can only be written when marking duplicates, with -M or -R." << endl;
+        exit(-1);
+    }
+    size_t reorder_window = (size_t)vm["reorder-window"].as<unsigned int>() * 1024 * 1024;
+    size_t merge_fan_in = vm.count("merge-fanin") ? vm["merge-fanin"].as<unsigned int>() : 0;
+    if(vm.count("merge-fanin") && merge_fan_in < 2) {
+        cerr << "Merge fan-in (--merge-fanin) must be at least 2." << endl;
+        exit(-1);
+    }
+    if(vm.count("n") && alignments_per_tempfile <= 0) {
+        cerr << "Alignments per temp file (-n) must be at least 1." << endl;
+        exit(-1);
+    }
     
     if(no_split && verbose)
         cerr << "Disabling split-by-chromosome." << endl;
     
     int num_chains = min(12,OGEParallelismSettings::getNumberThreads ()/2);
     
-    if(nothreads || no_split || !do_mark_duplicates || num_chains <= 1)
+    // With --dedup-window, sorted reads stream through duplicate marking in a
+    // single chain, instead of being split by chromosome and written to temp
+    // files.
+    if(nothreads || no_split || !do_mark_duplicates || num_chains <= 1 || dedup_window)
     {
         //The chain for this command goes something like this:
         //Reader->Filter->Sort->MarkDuplicates->Writer (->BlackHole)
@@ -76,8 +154,8 @@ int MergeSortCommand::runCommand()
         
         FileReader reader;
         Filter filter;
-        ReadSorter sort_reads(tmpdir);
-        MarkDuplicates mark_duplicates(tmpdir);
+        ReadSorter sort_reads;
+        MarkDuplicates mark_duplicates;
         FileWriter writer;
         
         reader.setLoadStringData(false);
@@ -97,6 +175,11 @@ int MergeSortCommand::runCommand()
             sort_reads.addSink(&mark_duplicates);
             mark_duplicates.addSink(&writer);
             mark_duplicates.removeDuplicates = do_remove_duplicates;
+            mark_duplicates.setStreamWindow(dedup_window);
+            mark_duplicates.setReadEndsMemory(dedup_memory);
+            mark_duplicates.setSpillUnmatchedEnds(dedup_spill_mates);
+            mark_duplicates.setCollectMetrics(!metrics_filename.empty());
+            mark_duplicates.setOpticalDistance(optical_distance);
         }
         else {
             sort_reads.addSink(&writer);
@@ -105,6 +188,12 @@ int MergeSortCommand::runCommand()
         sort_reads.setSortBy(sort_by_names ? BamHeader::SORT_QUERYNAME : BamHeader::SORT_COORDINATE);
         sort_reads.setCompressTempFiles(compresstempfiles);
         sort_reads.setAlignmentsPerTempfile(alignments_per_tempfile);
+        sort_reads.setSortMemory(sort_memory);
+        sort_reads.setMaxMergeFanIn(merge_fan_in);
+        sort_reads.setReorderWindow(reorder_window);
+        sort_reads.setNameOrder(name_order);
+        sort_reads.setSortTags(sort_tags);
+        sort_reads.setTemplateCoordinate(template_coordinate);
 
         reader.addFiles(input_filenames);
         writer.setFilename(vm["out"].as<string>());
@@ -114,7 +203,14 @@ int MergeSortCommand::runCommand()
         if(vm.count("format"))
             writer.setFormat(vm["format"].as<string>());
         
-        return writer.runChain();
+        int ret = writer.runChain();
+
+        if(!metrics_filename.empty() && !mark_duplicates.getMetrics().write(metrics_filename)) {
+            cerr << "Couldn't write duplicate metrics to " << metrics_filename << "." << endl;
+            exit(-1);
+        }
+
+        return ret;
     } else {
         //The chain for this command goes something like this:
         //Reader->Filter->Sort->Split->MarkDuplicates(multiple)->Merge->Writer (->BlackHole)
@@ -127,7 +223,7 @@ int MergeSortCommand::runCommand()
         SortedMerge merge;
         SplitByChromosome split;
         FileWriter writer;
-        ReadSorter sort_reads(tmpdir);
+        ReadSorter sort_reads;
 
         vector<MarkDuplicates *> duplicate_markers;
         
@@ -151,17 +247,30 @@ int MergeSortCommand::runCommand()
         // each iteration of this loop forms one chain inside the split
         for(int ctr = 0; ctr < num_chains; ctr++)
         {  
-            MarkDuplicates * mark_duplicates = new MarkDuplicates(tmpdir);
+            MarkDuplicates * mark_duplicates = new MarkDuplicates();
             duplicate_markers.push_back(mark_duplicates);
             merge.addSource(mark_duplicates);
             split.addSink(mark_duplicates);
 
             mark_duplicates->removeDuplicates = do_remove_duplicates;
+            // a chain holding reads back would stall the merge of all chains
+            mark_duplicates->setStreamWindow(0);
+            mark_duplicates->setReadEndsMemory(dedup_memory / num_chains);
+            // mates on other chromosomes go to other chains, and are never read here
+            mark_duplicates->setSpillUnmatchedEnds(false);
+            mark_duplicates->setCollectMetrics(!metrics_filename.empty());
+            mark_duplicates->setOpticalDistance(optical_distance);
         }
 
         sort_reads.setSortBy(sort_by_names ? BamHeader::SORT_QUERYNAME : BamHeader::SORT_COORDINATE);
         sort_reads.setCompressTempFiles(compresstempfiles);
         sort_reads.setAlignmentsPerTempfile(alignments_per_tempfile);
+        sort_reads.setSortMemory(sort_memory);
+        sort_reads.setMaxMergeFanIn(merge_fan_in);
+        sort_reads.setReorderWindow(reorder_window);
+        sort_reads.setNameOrder(name_order);
+        sort_reads.setSortTags(sort_tags);
+        sort_reads.setTemplateCoordinate(template_coordinate);
         
         reader.addFiles(input_filenames);
         writer.setFilename(vm["out"].as<string>());
@@ -170,6 +279,14 @@ int MergeSortCommand::runCommand()
         writer.setCompressionLevel(compression_level);
         
         int ret = writer.runChain();
+
+        DuplicationMetrics metrics;
+        for(int ctr = 0; ctr < num_chains; ctr++)
+            metrics.add(duplicate_markers[ctr]->getMetrics());
+        if(!metrics_filename.empty() && !metrics.write(metrics_filename)) {
+            cerr << "Couldn't write duplicate metrics to " << metrics_filename << "." << endl;
+            exit(-1);
+        }
         
         //clean up allocated objects
         for(int ctr = 0; ctr < num_chains; ctr++)
@@ -25,6 +25,11 @@
 #include <sys/resource.h>
 
 #include "../util/thread_pool.h"
+#include "../util/bgzf_buffer_pool.h"
+#include "../util/bgzf_codec.h"
+#include "../util/queue_budget.h"
+#include "../util/spill_file.h"
+#include "../util/temp_directories.h"
 
 #include "../algorithms/algorithm_module.h"
 
@@ -57,7 +62,35 @@ int OpenGECommand::runWithParameters(int argc, const char ** argv)
     }
     
     verbose = 0 < vm.count("verbose");
-    tmpdir = vm["tmpdir"].as<string>() + "/";
+    if(!TempDirectories::setDirectories(vm["tmpdir"].as<string>()))
+        return -1;
+    if(verbose && TempDirectories::getDirectories().size() > 1)
+        cerr << "Spreading temp files over " << TempDirectories::getDirectories().size() << " directories." << endl;
+    
+    string codec = vm["codec"].as<string>();
+    if(!BgzfCodec::setDefaultCodec(codec)) {
+        vector<string> codecs = BgzfCodec::availableCodecs();
+        cerr << "Codec " << codec << " is not available. Valid codecs are:";
+        for(size_t i = 0; i < codecs.size(); i++)
+            cerr << " " << codecs[i];
+        cerr << endl;
+        return -1;
+    }
+
+    string temp_codec_name = vm["tempcodec"].as<string>();
+    spill_codec_t temp_codec;
+    if(!SpillWriter::codecFromName(temp_codec_name, temp_codec)) {
+        cerr << "Temp file codec " << temp_codec_name << " is not available. Valid codecs are: none lz4 deflate" << endl;
+        return -1;
+    }
+    SpillWriter::setDefaultCodec(temp_codec);
+
+    unsigned int queue_mem = vm["queue-mem"].as<unsigned int>();
+    if(queue_mem == 0) {
+        cerr << "Queue memory (--queue-mem) must be at least 1 MB." << endl;
+        return -1;
+    }
+    QueueBudget::setDefaultLimit((size_t)queue_mem * 1024 * 1024);
 
     if(vm.count("in") == 0)
         input_filenames.push_back("stdin");
@@ -105,9 +138,12 @@ int OpenGECommand::runWithParameters(int argc, const char ** argv)
         r.ru_maxrss /= 1024;
 #endif
         fprintf(stderr, "Max mem: %6ld MB\n", r.ru_maxrss /1024);
+        BgzfBufferPool::printStatistics(cerr);
+        QueueBudget::printStatistics(cerr);
     }
     
     OGERead::clearCachedAllocations();
+    BgzfBufferPool::clear();
     
     ThreadPool::closeSharedPool();
     
@@ -126,8 +162,11 @@ OpenGECommand::OpenGECommand()
     ("verbose,v" ,"Display detailed messages while processing")
     ("threads,t", po::value<unsigned int>()->default_value(ThreadPool::availableCores()), "Select the number of threads to be used in each threadpool")
     ("nothreads,d", "Disable use of thread pools for parallel processing.")
-    ("tmpdir,T", po::value<string>()->default_value("/tmp"), "Directory to use for temporary files")
+    ("tmpdir,T", po::value<string>()->default_value("/tmp"), "Directories to use for temporary files, separated by commas. Files are spread over them.")
     ("nosplit","Do not split by chromosome (for speed) when processing")
+    ("codec", po::value<string>()->default_value("zlib"), "Compression library used for BAM files (zlib, or libdeflate if built with it)")
+    ("tempcodec", po::value<string>()->default_value("lz4"), "Compression for temporary files (none, lz4 or deflate)")
+    ("queue-mem", po::value<unsigned int>()->default_value(QUEUE_DEFAULT_MEMORY / (1024 * 1024)), "Memory (in MB) each queue between processing stages may hold")
     ;
 }
 
@@ -56,9 +56,6 @@ protected:
     std::vector<std::string> input_filenames;
     std::string output_filename;
     
-    // Directory in which to put temporary files. Recommended to be fast storage.
-    std::string tmpdir;
-    
     // Command line options, reconstructed from argc/argv
     std::string command_line;
     
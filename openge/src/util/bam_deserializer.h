@@ -18,11 +18,26 @@
  *********************************************************************/
 
 #include "read_stream_reader.h"
+#include "bgzf_input_stream.h"
 #include "bamtools/BamAux.h"
 
+#include <cstring>
+#include <deque>
+#include <vector>
+
+// When multithreading is enabled, records are read from the stream in batches,
+// and each batch is parsed into reads on the thread pool. Reads are still
+// returned in file order.
+const size_t BAM_BATCH_RECORDS = 1000;
+const size_t BAM_BATCH_MAX_BYTES = 1024 * 1024;
+
 template <class input_stream_t>
 class BamDeserializer : public ReadStreamReader {
 public:
+    BamDeserializer()
+    : current_batch(NULL)
+    , input_exhausted(false)
+    {}
     virtual bool open(const std::string & filename);
     virtual const BamHeader & getHeader() const { return header; };
     virtual void close();
@@ -31,7 +46,54 @@ public:
 protected:
     input_stream_t input_stream;
     BamHeader header;
-    Spinlock read_lock;
+    mutex read_lock;        // may be held while waiting for a batch to be parsed
+    
+    static void parseRecord(OGERead * al, const char * buffer, uint32_t BlockLength);
+    OGERead * readRecord();
+    
+    // Raw record data (each record still preceded by its length) for a run of
+    // consecutive records, and the reads parsed from it.
+    class RecordBatch {
+    public:
+        std::vector<char> data;
+        std::vector<size_t> record_offsets;
+        std::vector<OGERead *> reads;
+        size_t next_read;
+        int parse_started;
+        bool parsed;        // protected by batch_mutex
+        int references;     // held by the reader and the parse job
+        
+        RecordBatch()
+        : next_read(0)
+        , parse_started(0)
+        , parsed(false)
+        , references(1)
+        {}
+        void retain() { __sync_add_and_fetch(&references, 1); }
+        void release() { if(0 == __sync_sub_and_fetch(&references, 1)) delete this; }
+    };
+    
+    class ParseJob : public ThreadJob {
+        BamDeserializer * deserializer;
+        RecordBatch * batch;
+    public:
+        ParseJob(BamDeserializer * deserializer, RecordBatch * batch) : deserializer(deserializer), batch(batch) { batch->retain(); }
+        virtual void runJob() { deserializer->parseBatch(batch); batch->release(); }
+        virtual bool deleteOnCompletion() { return true; }
+        virtual ThreadJobPriority getPriority() { return JOB_PRIORITY_HIGH; }
+    };
+    
+    OGERead * readBatched();
+    bool readBatch(RecordBatch * batch);
+    void queueBatches();
+    void parseBatch(RecordBatch * batch);
+    void waitForBatch(RecordBatch * batch);
+    
+    RecordBatch * current_batch;
+    std::deque<RecordBatch *> pending_batches;
+    bool input_exhausted;
+    mutex batch_mutex;
+    condition_variable batch_cv;
 };
 
 template <class input_stream_t>
@@ -136,14 +198,53 @@ bool BamDeserializer<input_stream_t>::open(const std::string & filename) {
 template <class input_stream_t>
 void BamDeserializer<input_stream_t>::close() {
     read_lock.lock();
+    
+    // parse jobs may still be running against batches that haven't been read
+    if(current_batch)
+        pending_batches.push_front(current_batch);
+    current_batch = NULL;
+    
+    while(!pending_batches.empty()) {
+        RecordBatch * batch = pending_batches.front();
+        pending_batches.pop_front();
+        waitForBatch(batch);
+        for(size_t i = batch->next_read; i < batch->reads.size(); i++)
+            OGERead::deallocate(batch->reads[i]);
+        batch->release();
+    }
+    
     input_stream.close();
     read_lock.unlock();
 }
 
+template <class input_stream_t>
+void BamDeserializer<input_stream_t>::parseRecord(OGERead * al, const char * buffer, uint32_t BlockLength) {
+    // set BamAlignment core data
+    al->setRefID(BamTools::UnpackSignedInt(&buffer[0]));
+    al->setPosition(BamTools::UnpackSignedInt(&buffer[4]));
+    uint32_t QueryNameLength = ((unsigned char *)buffer)[8];
+    al->setMapQuality(((unsigned char *)buffer)[9]);
+    al->setBin(BamTools::UnpackUnsignedShort(&buffer[10]));
+    uint32_t NumCigarOperations = BamTools::UnpackUnsignedShort(&buffer[12]);
+    al->setAlignmentFlag(BamTools::UnpackUnsignedShort(&buffer[14]));
+    uint32_t QuerySequenceLength = BamTools::UnpackUnsignedInt(&buffer[16]);
+    al->setMateRefID(BamTools::UnpackSignedInt(&buffer[20]));
+    al->setMatePosition(BamTools::UnpackSignedInt(&buffer[24]));
+    al->setInsertSize(BamTools::UnpackSignedInt(&buffer[28]));
+
+    // set string data
+    al->setBamStringData(&(buffer[32]), BlockLength - 32, NumCigarOperations, QuerySequenceLength, QueryNameLength);
+}
+
 template <class input_stream_t>
 OGERead * BamDeserializer<input_stream_t>::read() {
-    OGERead * al = OGERead::allocate();
+    if(OGEParallelismSettings::isMultithreadingEnabled())
+        return readBatched();
+    return readRecord();
+}
 
+template <class input_stream_t>
+OGERead * BamDeserializer<input_stream_t>::readRecord() {
     read_lock.lock();
     uint32_t BlockLength = 0;
     input_stream.read((char *)&BlockLength, sizeof(BlockLength));
@@ -172,25 +273,215 @@ OGERead * BamDeserializer<input_stream_t>::read() {
     
     read_lock.unlock();
 
-    // set BamAlignment core data
-    al->setRefID(BamTools::UnpackSignedInt(&buffer[0]));
-    al->setPosition(BamTools::UnpackSignedInt(&buffer[4]));
-    uint32_t QueryNameLength = ((unsigned char *)buffer)[8];
-    al->setMapQuality(((unsigned char *)buffer)[9]);
-    al->setBin(BamTools::UnpackUnsignedShort(&buffer[10]));
-    uint32_t NumCigarOperations = BamTools::UnpackUnsignedShort(&buffer[12]);
-    al->setAlignmentFlag(BamTools::UnpackUnsignedShort(&buffer[14]));
-    uint32_t QuerySequenceLength = BamTools::UnpackUnsignedInt(&buffer[16]);
-    al->setMateRefID(BamTools::UnpackSignedInt(&buffer[20]));
-    al->setMatePosition(BamTools::UnpackSignedInt(&buffer[24]));
-    al->setInsertSize(BamTools::UnpackSignedInt(&buffer[28]));
+    OGERead * al = OGERead::allocate();
+    parseRecord(al, buffer, BlockLength);
 
-    // set string data
-    al->setBamStringData(&(buffer[32]), BlockLength - 32, NumCigarOperations, QuerySequenceLength, QueryNameLength);
+    return al;
+}
+
+// BGZF streams expose their decompressed blocks directly, so records are parsed
+// in place rather than first being copied out to a temporary buffer. Only
+// records that straddle a block boundary are copied (inside the stream).
+template <>
+inline OGERead * BamDeserializer<BgzfInputStream>::readRecord() {
+    read_lock.lock();
+    const char * data = input_stream.peek(sizeof(uint32_t));
+    if(!data) {
+        read_lock.unlock();
+        return NULL;
+    }
+    
+    uint32_t BlockLength = BamTools::UnpackUnsignedInt(data);
+
+    if ( BlockLength < 32  || BlockLength > 10000) {
+        std::cerr << "Invalid BAM block size(" << BlockLength << "). Aborting." << std::endl;
+        exit(-1);
+    }
+    
+    data = input_stream.peek(sizeof(uint32_t) + BlockLength);
+    if ( !data ) {
+        std::cerr << "Expected more bytes reading BAM core. Is this file truncated or corrupted? Aborting." << std::endl;
+        exit(-1);
+    }
+    
+    // the block data is only valid until the stream is next touched, so the
+    // record has to be parsed before releasing the lock.
+    OGERead * al = OGERead::allocate();
+    parseRecord(al, data + sizeof(uint32_t), BlockLength);
+    input_stream.consume(sizeof(uint32_t) + BlockLength);
+    
+    read_lock.unlock();
 
-    // return success/failure
     return al;
 }
 
 
+template <class input_stream_t>
+OGERead * BamDeserializer<input_stream_t>::readBatched() {
+    read_lock.lock();
+    while(true) {
+        if(current_batch && current_batch->next_read < current_batch->reads.size()) {
+            OGERead * al = current_batch->reads[current_batch->next_read++];
+            read_lock.unlock();
+            return al;
+        }
+        
+        if(current_batch)
+            current_batch->release();
+        current_batch = NULL;
+        
+        queueBatches();
+        
+        if(pending_batches.empty()) {
+            read_lock.unlock();
+            return NULL;
+        }
+        
+        current_batch = pending_batches.front();
+        pending_batches.pop_front();
+        waitForBatch(current_batch);
+    }
+}
+
+// Read raw records until the batch is full. Returns false if there were no
+// records left in the stream.
+template <class input_stream_t>
+bool BamDeserializer<input_stream_t>::readBatch(RecordBatch * batch) {
+    while(batch->record_offsets.size() < BAM_BATCH_RECORDS && batch->data.size() < BAM_BATCH_MAX_BYTES) {
+        uint32_t BlockLength = 0;
+        input_stream.read((char *)&BlockLength, sizeof(BlockLength));
+        if(input_stream.eof())
+            break;
+        
+        if ( input_stream.fail() ) {
+            std::cerr << "Expected more bytes reading BAM core. Is this file truncated or corrupted? Aborting." << std::endl;
+            exit(-1);
+        }
+        
+        if ( BlockLength < 32  || BlockLength > 10000) {
+            std::cerr << "Invalid BAM block size(" << BlockLength << "). Aborting." << std::endl;
+            exit(-1);
+        }
+        
+        size_t offset = batch->data.size();
+        size_t record_size = sizeof(BlockLength) + BlockLength;
+        if(batch->data.capacity() < offset + record_size)
+            batch->data.reserve(std::max(2 * batch->data.capacity(), offset + record_size));
+        batch->data.resize(offset + record_size);
+        memcpy(&batch->data[offset], &BlockLength, sizeof(BlockLength));
+        input_stream.read(&batch->data[offset + sizeof(BlockLength)], BlockLength);
+        if ( input_stream.fail() ) {
+            std::cerr << "Expected more bytes reading BAM core. Is this file truncated or corrupted? Aborting." << std::endl;
+            exit(-1);
+        }
+        
+        batch->record_offsets.push_back(offset);
+    }
+    
+    return !batch->record_offsets.empty();
+}
+
+// BGZF streams hand over the records in each decompressed block in place, so
+// every complete record in a block is copied into the batch at once. Only a
+// record that straddles a block boundary is stitched together by peek().
+template <>
+inline bool BamDeserializer<BgzfInputStream>::readBatch(RecordBatch * batch) {
+    while(batch->record_offsets.size() < BAM_BATCH_RECORDS && batch->data.size() < BAM_BATCH_MAX_BYTES) {
+        size_t available = 0;
+        const char * data = input_stream.peekContiguous(available);
+        if(!data)
+            break;
+        
+        size_t offset = batch->data.size();
+        size_t run_size = 0;
+        while(batch->record_offsets.size() < BAM_BATCH_RECORDS && offset + run_size < BAM_BATCH_MAX_BYTES && run_size + sizeof(uint32_t) <= available) {
+            uint32_t BlockLength = BamTools::UnpackUnsignedInt(data + run_size);
+            if ( BlockLength < 32  || BlockLength > 10000) {
+                std::cerr << "Invalid BAM block size(" << BlockLength << "). Aborting." << std::endl;
+                exit(-1);
+            }
+            if(run_size + sizeof(uint32_t) + BlockLength > available)
+                break;
+            
+            batch->record_offsets.push_back(offset + run_size);
+            run_size += sizeof(uint32_t) + BlockLength;
+        }
+        
+        if(!run_size) {
+            data = input_stream.peek(sizeof(uint32_t));
+            if(!data)
+                break;
+            
+            uint32_t BlockLength = BamTools::UnpackUnsignedInt(data);
+            if ( BlockLength < 32  || BlockLength > 10000) {
+                std::cerr << "Invalid BAM block size(" << BlockLength << "). Aborting." << std::endl;
+                exit(-1);
+            }
+            
+            run_size = sizeof(uint32_t) + BlockLength;
+            data = input_stream.peek(run_size);
+            if ( !data ) {
+                std::cerr << "Expected more bytes reading BAM core. Is this file truncated or corrupted? Aborting." << std::endl;
+                exit(-1);
+            }
+            batch->record_offsets.push_back(offset);
+        }
+        
+        batch->data.insert(batch->data.end(), data, data + run_size);
+        input_stream.consume(run_size);
+    }
+    
+    return !batch->record_offsets.empty();
+}
+
+// Read ahead and start parsing batches, up to a couple per pool thread.
+template <class input_stream_t>
+void BamDeserializer<input_stream_t>::queueBatches() {
+    size_t batches_in_flight = 2 * OGEParallelismSettings::getNumberThreads();
+    
+    while(!input_exhausted && pending_batches.size() < batches_in_flight) {
+        RecordBatch * batch = new RecordBatch;
+        
+        if(!readBatch(batch)) {
+            input_exhausted = true;
+            batch->release();
+            break;
+        }
+        
+        pending_batches.push_back(batch);
+        ThreadPool::sharedPool()->addJob(new ParseJob(this, batch));
+    }
+}
+
+template <class input_stream_t>
+void BamDeserializer<input_stream_t>::parseBatch(RecordBatch * batch) {
+    // the batch may be parsed by either a pool thread or the reading thread, whichever gets there first
+    if(!__sync_bool_compare_and_swap(&batch->parse_started, 0, 1))
+        return;
+    
+    size_t count = batch->record_offsets.size();
+    batch->reads.resize(count);
+    for(size_t i = 0; i < count; i++) {
+        const char * record = &batch->data[batch->record_offsets[i]];
+        batch->reads[i] = OGERead::allocate();
+        parseRecord(batch->reads[i], record + sizeof(uint32_t), BamTools::UnpackUnsignedInt(record));
+    }
+    
+    batch_mutex.lock();
+    batch->parsed = true;
+    batch_cv.notify_all();
+    batch_mutex.unlock();
+}
+
+template <class input_stream_t>
+void BamDeserializer<input_stream_t>::waitForBatch(RecordBatch * batch) {
+    // don't wait for the pool to get to this batch; parse it here if it hasn't been started
+    parseBatch(batch);
+    
+    batch_mutex.lock();
+    while(!batch->parsed)
+        batch_cv.wait(batch_mutex);
+    batch_mutex.unlock();
+}
+
 #endif
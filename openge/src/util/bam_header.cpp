@@ -147,6 +147,8 @@ BamHeader::BamHeader (const string & text){
                 
                 if(tag == "VN") format_version = data;
                 else if(tag == "SO") sort_str = data;
+                else if(tag == "GO") group_order = data;
+                else if(tag == "SS") sub_sort = data;
             }
             
             if(sort_str.empty() || format_version.empty()) {
@@ -192,6 +194,10 @@ const string BamHeader::toString() const {
 		case SORT_QUERYNAME: s << "queryname"; break;
 		case SORT_COORDINATE: s << "coordinate"; break;
 	}
+	if(!group_order.empty())
+		s << "\tGO:" << group_order;
+	if(!sub_sort.empty())
+		s << "\tSS:" << sub_sort;
 	s << "\n";
 
 	//print SQ
@@ -256,6 +256,8 @@ public:
 protected:
 	std::string format_version;
 	sort_order_t sort_order;
+	std::string group_order;	// GO, empty if not given
+	std::string sub_sort;		// SS, empty if not given
 
 public:
 	BamHeader()
@@ -269,6 +271,8 @@ public:
 	, co(h.co)
 	, format_version(h.format_version)
 	, sort_order(h.sort_order)
+	, group_order(h.group_order)
+	, sub_sort(h.sub_sort)
 	{}
 
 	BamHeader (const std::string & text);
@@ -284,6 +288,10 @@ public:
 
 	const sort_order_t getSortOrder()  const { return sort_order; }
 	void setSortOrder(const sort_order_t s) { sort_order = s; }
+	const std::string & getGroupOrder() const { return group_order; }
+	void setGroupOrder(const std::string & g) { group_order = g; }
+	const std::string & getSubSort() const { return sub_sort; }
+	void setSubSort(const std::string & s) { sub_sort = s; }
 
 	const std::string toString() const;	//TODO
 };
@@ -0,0 +1,96 @@
+/*********************************************************************
+ *
+ * bgzf_buffer_pool.cpp: Recycled buffers for BGZF blocks.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "bgzf_buffer_pool.h"
+
+using namespace std;
+
+Spinlock BgzfBufferPool::pool_lock;
+vector<BgzfBuffer *> BgzfBufferPool::free_buffers;
+size_t BgzfBufferPool::max_free_buffers = BGZF_DEFAULT_POOL_SIZE;
+uint64_t BgzfBufferPool::hits = 0;
+uint64_t BgzfBufferPool::misses = 0;
+uint64_t BgzfBufferPool::discards = 0;
+
+BgzfBuffer * BgzfBufferPool::allocate() {
+    BgzfBuffer * buffer = NULL;
+    
+    pool_lock.lock();
+    if(!free_buffers.empty()) {
+        buffer = free_buffers.back();
+        free_buffers.pop_back();
+        hits++;
+    } else
+        misses++;
+    pool_lock.unlock();
+    
+    // allocate outside of the lock so other threads aren't held up by malloc
+    if(!buffer)
+        buffer = new BgzfBuffer;
+    
+    return buffer;
+}
+
+void BgzfBufferPool::deallocate(BgzfBuffer * buffer) {
+    pool_lock.lock();
+    if(free_buffers.size() < max_free_buffers) {
+        free_buffers.push_back(buffer);
+        buffer = NULL;
+    } else
+        discards++;
+    pool_lock.unlock();
+    
+    if(buffer)
+        delete buffer;
+}
+
+void BgzfBufferPool::clear() {
+    pool_lock.lock();
+    vector<BgzfBuffer *> buffers;
+    buffers.swap(free_buffers);
+    pool_lock.unlock();
+    
+    for(size_t i = 0; i < buffers.size(); i++)
+        delete buffers[i];
+}
+
+void BgzfBufferPool::setMaxFreeBuffers(size_t count) {
+    pool_lock.lock();
+    max_free_buffers = count;
+    pool_lock.unlock();
+    
+    // trim any buffers that no longer fit under the limit
+    while(true) {
+        BgzfBuffer * buffer = NULL;
+        pool_lock.lock();
+        if(free_buffers.size() > max_free_buffers) {
+            buffer = free_buffers.back();
+            free_buffers.pop_back();
+        }
+        pool_lock.unlock();
+        
+        if(!buffer)
+            break;
+        delete buffer;
+    }
+}
+
+void BgzfBufferPool::printStatistics(ostream & out) {
+    pool_lock.lock();
+    uint64_t requests = hits + misses;
+    out << "BGZF buffer pool: " << requests << " requests, " << hits << " reused";
+    if(requests)
+        out << " (" << (100 * hits / requests) << "%)";
+    out << ", " << misses << " allocated, " << discards << " freed over limit." << endl;
+    pool_lock.unlock();
+}
@@ -0,0 +1,66 @@
+#ifndef OGE_BGZF_BUFFER_POOL_H
+#define OGE_BGZF_BUFFER_POOL_H
+
+/*********************************************************************
+ *
+ * bgzf_buffer_pool.h: Recycled buffers for BGZF blocks.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Every BGZF block needs a compressed and an uncompressed 64KB
+ * buffer. Rather than allocating and freeing these for every block,
+ * the input and output streams share a pool of buffers. Buffers
+ * released to the pool are kept on a free list (up to a limit), and
+ * handed back out on the next allocation.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <vector>
+#include <iostream>
+
+#include "thread_pool.h"
+
+const uint32_t BGZF_BLOCK_SIZE = 65536;
+
+// Default number of free buffers held by the pool. Each buffer is 128KB.
+const size_t BGZF_DEFAULT_POOL_SIZE = 256;
+
+struct BgzfBuffer {
+    char compressed_data[BGZF_BLOCK_SIZE];
+    char uncompressed_data[BGZF_BLOCK_SIZE];
+};
+
+class BgzfBufferPool {
+public:
+    static BgzfBuffer * allocate();
+    static void deallocate(BgzfBuffer * buffer);
+    
+    // Free all buffers currently held by the pool.
+    static void clear();
+    
+    // Maximum number of free buffers to keep. Buffers released beyond this
+    // limit are freed immediately.
+    static void setMaxFreeBuffers(size_t count);
+    static size_t getMaxFreeBuffers() { return max_free_buffers; }
+    
+    static uint64_t getHits() { return hits; }
+    static uint64_t getMisses() { return misses; }
+    static uint64_t getDiscards() { return discards; }
+    static void printStatistics(std::ostream & out);
+    
+protected:
+    static Spinlock pool_lock;
+    static std::vector<BgzfBuffer *> free_buffers;
+    static size_t max_free_buffers;
+    static uint64_t hits, misses, discards;
+};
+
+#endif
@@ -0,0 +1,255 @@
+/*********************************************************************
+ *
+ * bgzf_codec.cpp: Deflate/inflate backends for BGZF blocks.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "bgzf_codec.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
+#include <zlib.h>
+
+#ifdef OPENGE_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+using namespace std;
+
+std::string BgzfCodec::default_codec = "zlib";
+
+//////////////
+// zlib codec
+
+// Keeps one deflate and one inflate stream open, and resets them between
+// blocks instead of allocating and initializing zlib's state every time.
+class ZlibCodec : public BgzfCodec {
+    z_stream deflate_stream;
+    z_stream inflate_stream;
+    int deflate_level;          // level the deflate stream was initialized with
+    bool deflate_initialized;
+    bool inflate_initialized;
+public:
+    ZlibCodec()
+    : deflate_level(0)
+    , deflate_initialized(false)
+    , inflate_initialized(false)
+    {}
+    virtual ~ZlibCodec();
+    virtual const char * name() const { return "zlib"; }
+    virtual size_t compress(const char * in, size_t in_len, char * out, size_t out_len, int level);
+    virtual bool decompress(const char * in, size_t in_len, char * out, size_t out_len);
+    virtual uint32_t crc32(const char * data, size_t len);
+};
+
+ZlibCodec::~ZlibCodec() {
+    if(deflate_initialized)
+        deflateEnd(&deflate_stream);
+    if(inflate_initialized)
+        inflateEnd(&inflate_stream);
+}
+
+size_t ZlibCodec::compress(const char * in, size_t in_len, char * out, size_t out_len, int level) {
+    if(!deflate_initialized || deflate_level != level) {
+        if(deflate_initialized)
+            deflateEnd(&deflate_stream);
+        
+        memset(&deflate_stream, 0, sizeof(deflate_stream));
+        int init_status = deflateInit2(&deflate_stream,
+                                       level,
+                                       Z_DEFLATED,
+                                       -15,  //window
+                                       8,    //memory level
+                                       Z_DEFAULT_STRATEGY);
+        if ( init_status != Z_OK ) {
+            cerr << "BGZF writer: zlib deflateInit2 failed" << endl;
+            exit(-1);
+        }
+        deflate_level = level;
+        deflate_initialized = true;
+    } else if( deflateReset(&deflate_stream) != Z_OK ) {
+        cerr << "BGZF writer: zlib deflateReset failed. Aborting." << endl;
+        exit(-1);
+    }
+    
+    deflate_stream.next_in   = (Bytef*)in;
+    deflate_stream.avail_in  = in_len;
+    deflate_stream.next_out  = (Bytef*)out;
+    deflate_stream.avail_out = out_len;
+    
+    int deflate_status = deflate(&deflate_stream, Z_FINISH);
+    
+    if(deflate_status == Z_STREAM_END)
+        return deflate_stream.total_out;
+    
+    // there was not enough space available in the output buffer
+    if(deflate_status == Z_OK || deflate_status == Z_BUF_ERROR)
+        return 0;
+    
+    cerr << "BGZF writer: zlib deflate failed. Aborting." << endl;
+    exit(-1);
+}
+
+bool ZlibCodec::decompress(const char * in, size_t in_len, char * out, size_t out_len) {
+    if(!inflate_initialized) {
+        memset(&inflate_stream, 0, sizeof(inflate_stream));
+        if ( inflateInit2(&inflate_stream, -15) != Z_OK ) {
+            cerr << "Error- Zlib initialization failed. Aborting." << endl;
+            exit(-1);
+        }
+        inflate_initialized = true;
+    } else if( inflateReset(&inflate_stream) != Z_OK ) {
+        cerr << "Error- Zlib inflateReset failed. Aborting." << endl;
+        exit(-1);
+    }
+    
+    inflate_stream.next_in   = (Bytef *)in;
+    inflate_stream.avail_in  = in_len;
+    inflate_stream.next_out  = (Bytef *)out;
+    inflate_stream.avail_out = out_len;
+    
+    int status = inflate(&inflate_stream, Z_FINISH);
+    
+    return status == Z_STREAM_END && inflate_stream.total_out == out_len;
+}
+
+uint32_t ZlibCodec::crc32(const char * data, size_t len) {
+    return ::crc32(::crc32(0, NULL, 0), (const Bytef *)data, len);
+}
+
+//////////////
+// libdeflate codec
+
+#ifdef OPENGE_USE_LIBDEFLATE
+
+class LibdeflateCodec : public BgzfCodec {
+    static const int MAX_LEVEL = 12;
+    static const int DEFAULT_LEVEL = 6;     //used for zlib's Z_DEFAULT_COMPRESSION (-1)
+    struct libdeflate_compressor * compressors[MAX_LEVEL + 1];     //created on demand, one per level
+    struct libdeflate_decompressor * decompressor;
+public:
+    LibdeflateCodec()
+    : decompressor(NULL)
+    {
+        for(int i = 0; i <= MAX_LEVEL; i++)
+            compressors[i] = NULL;
+    }
+    virtual ~LibdeflateCodec();
+    virtual const char * name() const { return "libdeflate"; }
+    virtual size_t compress(const char * in, size_t in_len, char * out, size_t out_len, int level);
+    virtual bool decompress(const char * in, size_t in_len, char * out, size_t out_len);
+    virtual uint32_t crc32(const char * data, size_t len);
+};
+
+LibdeflateCodec::~LibdeflateCodec() {
+    for(int i = 0; i <= MAX_LEVEL; i++)
+        if(compressors[i])
+            libdeflate_free_compressor(compressors[i]);
+    if(decompressor)
+        libdeflate_free_decompressor(decompressor);
+}
+
+size_t LibdeflateCodec::compress(const char * in, size_t in_len, char * out, size_t out_len, int level) {
+    if(level == -1)
+        level = DEFAULT_LEVEL;
+    
+    if(level < 0 || level > MAX_LEVEL) {
+        cerr << "BGZF writer: invalid libdeflate compression level (" << level << "). Aborting." << endl;
+        exit(-1);
+    }
+    
+    if(!compressors[level]) {
+        compressors[level] = libdeflate_alloc_compressor(level);
+        if(!compressors[level]) {
+            cerr << "BGZF writer: libdeflate compressor allocation failed. Aborting." << endl;
+            exit(-1);
+        }
+    }
+    
+    // returns 0 if the output didn't fit
+    return libdeflate_deflate_compress(compressors[level], in, in_len, out, out_len);
+}
+
+bool LibdeflateCodec::decompress(const char * in, size_t in_len, char * out, size_t out_len) {
+    if(!decompressor) {
+        decompressor = libdeflate_alloc_decompressor();
+        if(!decompressor) {
+            cerr << "Error- libdeflate decompressor allocation failed. Aborting." << endl;
+            exit(-1);
+        }
+    }
+    
+    return LIBDEFLATE_SUCCESS == libdeflate_deflate_decompress(decompressor, in, in_len, out, out_len, NULL);
+}
+
+uint32_t LibdeflateCodec::crc32(const char * data, size_t len) {
+    return libdeflate_crc32(0, data, len);
+}
+
+#endif
+
+//////////////
+// codec selection
+
+static pthread_key_t codec_key;
+static pthread_once_t codec_key_once = PTHREAD_ONCE_INIT;
+
+static void deleteThreadCodec(void * codec) {
+    delete (BgzfCodec *) codec;
+}
+
+static void createCodecKey() {
+    pthread_key_create(&codec_key, deleteThreadCodec);
+}
+
+BgzfCodec * BgzfCodec::threadCodec() {
+    pthread_once(&codec_key_once, createCodecKey);
+    
+    BgzfCodec * codec = (BgzfCodec *) pthread_getspecific(codec_key);
+    
+    if(!codec || default_codec != codec->name()) {
+        delete codec;
+        codec = create(default_codec);
+        pthread_setspecific(codec_key, codec);
+    }
+    
+    return codec;
+}
+
+BgzfCodec * BgzfCodec::create(const std::string & name) {
+    if(name == "zlib")
+        return new ZlibCodec();
+#ifdef OPENGE_USE_LIBDEFLATE
+    if(name == "libdeflate")
+        return new LibdeflateCodec();
+#endif
+    return NULL;
+}
+
+bool BgzfCodec::setDefaultCodec(const std::string & name) {
+    BgzfCodec * codec = create(name);
+    if(!codec)
+        return false;
+    delete codec;
+    
+    default_codec = name;
+    return true;
+}
+
+vector<string> BgzfCodec::availableCodecs() {
+    vector<string> codecs;
+    codecs.push_back("zlib");
+#ifdef OPENGE_USE_LIBDEFLATE
+    codecs.push_back("libdeflate");
+#endif
+    return codecs;
+}
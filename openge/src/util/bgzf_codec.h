@@ -0,0 +1,63 @@
+#ifndef OGE_BGZF_CODEC_H
+#define OGE_BGZF_CODEC_H
+
+/*********************************************************************
+ *
+ * bgzf_codec.h: Deflate/inflate backends for BGZF blocks.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * A codec compresses or decompresses the raw deflate payload of a
+ * single BGZF block. Codecs keep their compression state between
+ * blocks, so each thread gets its own instance through
+ * BgzfCodec::threadCodec(), which is created the first time the
+ * thread touches a BGZF block and reused from then on.
+ *
+ * zlib is always available. libdeflate, which implements one-shot
+ * block compression considerably faster than zlib, is available if
+ * OpenGE was built with OPENGE_USE_LIBDEFLATE.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class BgzfCodec {
+public:
+    virtual ~BgzfCodec() {}
+    virtual const char * name() const = 0;
+    
+    // Compress in_len bytes into out, which can hold out_len bytes. Returns
+    // the compressed size, or 0 if the compressed data did not fit.
+    virtual size_t compress(const char * in, size_t in_len, char * out, size_t out_len, int level) = 0;
+    
+    // Decompress a complete deflate stream, which must decompress to exactly
+    // out_len bytes. Returns false on failure.
+    virtual bool decompress(const char * in, size_t in_len, char * out, size_t out_len) = 0;
+    
+    virtual uint32_t crc32(const char * data, size_t len) = 0;
+    
+    // The codec instance for the calling thread, using the selected backend.
+    static BgzfCodec * threadCodec();
+    
+    // Select the backend used by all BGZF streams. Returns false if the
+    // backend is unknown or not compiled in.
+    static bool setDefaultCodec(const std::string & name);
+    static const std::string & getDefaultCodec() { return default_codec; }
+    static std::vector<std::string> availableCodecs();
+    
+    // Create a new codec instance, or return NULL if the backend isn't available.
+    static BgzfCodec * create(const std::string & name);
+protected:
+    static std::string default_codec;
+};
+
+#endif
@@ -15,24 +15,30 @@
  *********************************************************************/
 
 #include "bgzf_input_stream.h"
-#include <zlib.h>
+#include "bgzf_codec.h"
 
 #include <iostream>
 #include <cassert>
 #include <cstring>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
 ///////////////////////////
 // BgzfBlock implementation
 
-void BgzfInputStream::BgzfBlock::runJob() {
-    decompress();
+void BgzfInputStream::DecompressJob::runJob() {
+    block->decompress();
+    block->release();
 }
 
 unsigned int BgzfInputStream::BgzfBlock::read() {
-    stream->input_stream->read(compressed_data, 18);
+    char * data = buffer->compressed_data;
+    stream->input_stream->read(data, 18);
     
     if(stream->input_stream->eof()) {
         stream->eof_seen.set();
@@ -43,9 +49,9 @@ unsigned int BgzfInputStream::BgzfBlock::read() {
         cerr << "Error reading BGZF block header. Aborting." << endl;
         exit(-1);
     }
-    uint16_t length = *((uint16_t *)&compressed_data[16]) + 1;
+    uint16_t length = *((uint16_t *)&data[16]) + 1;
 
-    stream->input_stream->read(&compressed_data[18], length - 18);
+    stream->input_stream->read(&data[18], length - 18);
     
     if(stream->input_stream->eof())
         stream->eof_seen.set();
@@ -57,7 +63,7 @@ unsigned int BgzfInputStream::BgzfBlock::read() {
     
     compressed_size = stream->input_stream->gcount();
     
-    assert(compressed_data[0] == 31 && compressed_data[1] == (char)139);
+    assert(data[0] == 31 && data[1] == (char)139);
     
     return compressed_size;
 }
@@ -97,52 +103,33 @@ bool BgzfInputStream::BgzfBlock::decompress() {
         exit(-1);
     }
     
-    char * data = &compressed_data[18];
+    const char * data = &compressed_data[18];
     
     size_t uncompressed_position = bsize - 4;
     uncompressed_size = *((uint32_t *) &compressed_data[uncompressed_position]);
     
-    {
-        // setup zlib stream object
-        z_stream zs;
-        zs.zalloc    = NULL;
-        zs.zfree     = NULL;
-        zs.next_in   = (unsigned char *)data;
-        zs.avail_in  = bsize - 16;
-        zs.next_out  =  (unsigned char *) &uncompressed_data[0];
-        zs.avail_out = 65536;
-        
-        // initialize
-        int status = inflateInit2(&zs, -15);
-        if ( status != Z_OK ) {
-            cerr << "Error- Zlib initialization failed. Aborting." << endl;
-            exit(-1);
-        }
-        
-        // decompress
-        status = inflate(&zs, Z_FINISH);
-        if ( status != Z_STREAM_END ) {
-            inflateEnd(&zs);
-            cerr << "Error- Zlib inflate failed. Aborting." << endl;
-            exit(-1);
-        }
-        
-        // finalize
-        status = inflateEnd(&zs);
-        if ( status != Z_OK ) {
-            inflateEnd(&zs);
-            cerr << "Error- Zlib inflateEnd failed. Aborting." << endl;
-            exit(-1);
-        }
-
-        assert(zs.total_out == uncompressed_size);
+    if(uncompressed_size > BGZF_BLOCK_SIZE || bsize < 18 + 8) {
+        cerr << "Error- BGZF block has invalid size. Is this file corrupted?" << endl;
+        exit(-1);
+    }
+    
+    if(!BgzfCodec::threadCodec()->decompress(data, bsize - 18 - 8, &uncompressed_data[0], uncompressed_size)) {
+        cerr << "Error- BGZF block decompression failed. Is this file corrupted?" << endl;
+        exit(-1);
     }
     
+    // The flag is set while holding the stream lock so that a consumer
+    // checking it under the same lock can never miss the wakeup.
+    stream->read_signal_lock.lock();
+    decompressed.set();
+    stream->block_ready_cv.notify_all();
+    stream->read_signal_lock.unlock();
+    
     return true;
 }
 
 unsigned int BgzfInputStream::BgzfBlock::readData(void * dest, unsigned int max_size) {
-    assert(isDone());
+    assert(isDecompressed());
     
     unsigned int actual_read_len = min(max_size, uncompressed_size - read_size);
     
@@ -156,6 +143,13 @@ unsigned int BgzfInputStream::BgzfBlock::readData(void * dest, unsigned int max_
 // BgzfInputStream implementation
 
 bool BgzfInputStream::open(string filename) {
+    block_budget.setName("BGZF " + filename);
+    if(!read_ahead_memory)
+        block_budget.setLimit(max(BGZF_DEFAULT_READ_AHEAD_BLOCKS * sizeof(BgzfBuffer), QueueBudget::getDefaultLimit()));
+    
+    if(filename != "stdin" && use_memory_map && openMapped(filename))
+        return true;
+    
     if(filename == "stdin") {
         input_stream = &cin;
     } else {
@@ -177,78 +171,347 @@ bool BgzfInputStream::open(string filename) {
     return true;
 }
 
+bool BgzfInputStream::use_memory_map = true;
+
+bool BgzfInputStream::openMapped(const string & filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    
+    // pipes and other special files are read through the stream path
+    struct stat st;
+    if(0 != fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(MAP_FAILED == data) {
+        ::close(fd);
+        return false;
+    }
+    
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    
+    input_stream = &input_stream_real;
+    mapped_file = fd;
+    mapped_data = (const char *) data;
+    mapped_size = st.st_size;
+    mapped_offset = 0;
+    mapped_released = 0;
+    
+    scheduleMappedBlocks();
+    
+    return true;
+}
+
+// Walk the BGZF headers in the mapped file, queueing blocks for decompression
+// until the read-ahead limit is reached. Only called by the consuming thread.
+void BgzfInputStream::scheduleMappedBlocks() {
+    if(read_finished.isSet())
+        return;
+    
+    size_t schedule_start = mapped_offset;
+    
+    while(true) {
+        if(mapped_offset == mapped_size) {
+            read_signal_lock.lock();
+            read_finished.set();
+            block_ready_cv.notify_all();
+            read_signal_lock.unlock();
+            break;
+        }
+        
+        const char * header = mapped_data + mapped_offset;
+        size_t remaining = mapped_size - mapped_offset;
+        
+        if(remaining < 18) {
+            cerr << "Error- BGZF block header is truncated. Is this file truncated or corrupted? Aborting." << endl;
+            exit(-1);
+        }
+        
+        if(header[0] != 31 || header[1] != (char)139) {
+            cerr << "Error- BGZF block has invalid start block. Is this file corrupted?" << endl;
+            exit(-1);
+        }
+        
+        size_t block_size = *((uint16_t *)&header[16]) + 1;
+        if(block_size < 18 + 8 || block_size > remaining) {
+            cerr << "Error- BGZF block is truncated. Is this file truncated or corrupted? Aborting." << endl;
+            exit(-1);
+        }
+        
+        if(!block_budget.tryAcquire(sizeof(BgzfBuffer)))
+            break;
+        
+        BgzfBlock * block = new BgzfBlock(this, header, block_size);
+        mapped_offset += block_size;
+        
+        // Without threads, blocks are decompressed by the consumer as it reaches them.
+        if(OGEParallelismSettings::isMultithreadingEnabled()) {
+            DecompressJob * job = new DecompressJob(block);
+            block_queue.push(block);
+            ThreadPool::sharedPool()->addJob(job);
+        } else
+            block_queue.push(block);
+    }
+    
+    // ask the kernel to start reading the blocks we just queued
+    if(mapped_offset > schedule_start) {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t start = schedule_start - schedule_start % page_size;
+        madvise((void *)(mapped_data + start), mapped_offset - start, MADV_WILLNEED);
+    }
+}
+
+// Drop pages of the mapped file that have been completely consumed, so that
+// reading a large file doesn't pull all of it into our resident set.
+void BgzfInputStream::releaseMappedData() {
+    const size_t release_granularity = 4 * 1024 * 1024;
+    
+    size_t consumed = block_queue.empty() ? mapped_offset : block_queue.front()->mappedOffset();
+    if(consumed - mapped_released < release_granularity)
+        return;
+    
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    consumed -= consumed % page_size;
+    madvise((void *)(mapped_data + mapped_released), consumed - mapped_released, MADV_DONTNEED);
+    mapped_released = consumed;
+}
+
 void * BgzfInputStream::block_readproc(void * data) {
     BgzfInputStream * stream = (BgzfInputStream *) data;
     
-    while(!stream->eof_seen.isSet()) {
-        stream->read_signal_lock.lock();
-        while(stream->block_queue.size() >= 100) {
-            if(stream->eof_seen.isSet())
-                return NULL;
-            stream->read_signal_cv.wait(stream->read_signal_lock);
+    while(true) {
+        // wait for the consumer to free up space in the read-ahead budget
+        if(!stream->block_budget.acquire(sizeof(BgzfBuffer)))
+            break;
+        
+        if(stream->closing.isSet() || stream->eof_seen.isSet()) {
+            stream->block_budget.release(sizeof(BgzfBuffer));
+            break;
         }
-        stream->read_signal_lock.unlock();
         
-        while(stream->block_queue.size() < 100 && !stream->eof_seen.isSet()) {
-            BgzfBlock * block = new BgzfBlock(stream);
-            int read = block->read();
-            if(read) {
-                stream->block_queue.push(block);
-                if(OGEParallelismSettings::isMultithreadingEnabled())
-                    ThreadPool::sharedPool()->addJob(block);
-                else
-                    block->runJob();
-            }
+        BgzfBlock * block = new BgzfBlock(stream);
+        if(!block->read()) {
+            block->release();
+            stream->block_budget.release(sizeof(BgzfBuffer));
+            continue;
+        }
+        
+        // The job takes its own reference before the block becomes visible
+        // to the consumer, which may decompress and release it right away.
+        if(OGEParallelismSettings::isMultithreadingEnabled()) {
+            DecompressJob * job = new DecompressJob(block);
+            stream->block_queue.push(block);
+            ThreadPool::sharedPool()->addJob(job);
+        } else {
+            block->decompress();
+            stream->block_queue.push(block);
         }
+        
+        // wake the consumer if it is waiting for the queue to fill
+        stream->signalBlockReady();
     }
     
+    stream->read_signal_lock.lock();
+    stream->read_finished.set();
+    stream->block_ready_cv.notify_all();
+    stream->read_signal_lock.unlock();
+    
     return NULL;
 }
 
-bool BgzfInputStream::read(char * data, size_t len) {
-    unsigned int read_len = 0;
-    while(read_len != len) {
-        while(block_queue.empty() || !block_queue.front()->isDecompressed()) {
-            if(block_queue.empty() && eof_seen.isSet()) {
-                return false;
+void BgzfInputStream::signalBlockReady() {
+    read_signal_lock.lock();
+    block_ready_cv.notify_all();
+    read_signal_lock.unlock();
+}
+
+BgzfInputStream::BgzfBlock * BgzfInputStream::waitForFrontBlock() {
+    // fast path; no locking beyond the queue's own spinlock
+    if(!block_queue.empty() && block_queue.front()->isDecompressed())
+        return block_queue.front();
+    
+    BgzfBlock * block = NULL;
+    read_signal_lock.lock();
+    while(true) {
+        if(!block_queue.empty()) {
+            block = block_queue.front();
+            if(block->isDecompressed())
+                break;
+            
+            // If no worker has started on this block yet, do it ourselves
+            // rather than waiting for the pool to get around to it.
+            if(!block->isDecompressionStarted()) {
+                read_signal_lock.unlock();
+                block->decompress();
+                read_signal_lock.lock();
+                continue;
             }
-            if (!block_queue.empty() && !block_queue.front()->isDecompressed())
-                block_queue.front()->decompress();
-            usleep(50000);
+        } else if(read_finished.isSet()) {
+            block = NULL;
+            break;
         }
-        
-        BgzfBlock * block = block_queue.front();
-        assert(block->isDecompressed());
+        block_ready_cv.wait(read_signal_lock);
+    }
+    read_signal_lock.unlock();
+    
+    return block;
+}
+
+void BgzfInputStream::popFrontBlock() {
+    BgzfBlock * block = block_queue.pop();
+    block->release();
+    
+    // wakes the reader thread if it is waiting for space
+    block_budget.release(sizeof(BgzfBuffer));
+    
+    if(mapped_data) {
+        scheduleMappedBlocks();
+        releaseMappedData();
+    }
+}
+
+bool BgzfInputStream::read(char * data, size_t len) {
+    size_t read_len = 0;
+    
+    //data that was previously stitched together by peek() comes first
+    if(stitch_offset != stitch_buffer.size()) {
+        read_len = min(len, stitch_buffer.size() - stitch_offset);
+        memcpy(data, &stitch_buffer[stitch_offset], read_len);
+        consume(read_len);
+    }
+    
+    while(read_len != len) {
+        BgzfBlock * block = waitForFrontBlock();
+        if(!block)
+            return false;
         
         unsigned int actual_read_length = block->readData(&((char *)data)[read_len], len - read_len);
         
         read_len += actual_read_length;
         
-        if(!block->dataRemaining()) {
-            delete block;
-            block_queue.pop();
-            if(!eof_seen.isSet()) {
-                //request another block
-                read_signal_lock.lock();
-                read_signal_cv.notify_one();
-                read_signal_lock.unlock();
-            }
-        }
+        if(!block->dataRemaining())
+            popFrontBlock();
     }
     
     return true;
 }
-void BgzfInputStream::close() {
+
+const char * BgzfInputStream::peek(size_t len) {
+    if(stitch_offset == stitch_buffer.size()) {
+        BgzfBlock * block = waitForFrontBlock();
+        if(!block)
+            return NULL;
+        if(block->dataAvailable() >= len)
+            return block->data();
+    }
     
-    eof_seen.set();
+    // The requested data crosses a block boundary, so gather it into the
+    // stitch buffer, releasing blocks as they are emptied.
+    if(stitch_offset) {
+        stitch_buffer.erase(stitch_buffer.begin(), stitch_buffer.begin() + stitch_offset);
+        stitch_offset = 0;
+    }
+    
+    while(stitch_buffer.size() < len) {
+        BgzfBlock * block = waitForFrontBlock();
+        if(!block)
+            return NULL;
+        
+        unsigned int copy_len = min(len - stitch_buffer.size(), (size_t)block->dataAvailable());
+        stitch_buffer.insert(stitch_buffer.end(), block->data(), block->data() + copy_len);
+        block->skip(copy_len);
+        
+        if(!block->dataRemaining())
+            popFrontBlock();
+    }
+    
+    return &stitch_buffer[0];
+}
+
+const char * BgzfInputStream::peekContiguous(size_t & len) {
+    if(stitch_offset != stitch_buffer.size()) {
+        len = stitch_buffer.size() - stitch_offset;
+        return &stitch_buffer[stitch_offset];
+    }
+    
+    while(true) {
+        BgzfBlock * block = waitForFrontBlock();
+        if(!block) {
+            len = 0;
+            return NULL;
+        }
+        
+        // skip empty blocks, such as the EOF marker
+        if(block->dataRemaining()) {
+            len = block->dataAvailable();
+            return block->data();
+        }
+        popFrontBlock();
+    }
+}
+
+void BgzfInputStream::consume(size_t len) {
+    if(stitch_offset != stitch_buffer.size()) {
+        size_t stitched_len = min(len, stitch_buffer.size() - stitch_offset);
+        stitch_offset += stitched_len;
+        len -= stitched_len;
+        
+        if(stitch_offset == stitch_buffer.size()) {
+            stitch_buffer.clear();
+            stitch_offset = 0;
+        }
+    }
+    
+    while(len) {
+        BgzfBlock * block = waitForFrontBlock();
+        assert(block);  // consume() must only be used on data that has been peek()ed
+        
+        unsigned int skip_len = min(len, (size_t)block->dataAvailable());
+        block->skip(skip_len);
+        len -= skip_len;
+        
+        if(!block->dataRemaining())
+            popFrontBlock();
+    }
+}
+
+void BgzfInputStream::close() {
     
     read_signal_lock.lock();
-    read_signal_cv.notify_one();
+    closing.set();
+    block_budget.close();
+    if(mapped_data)
+        read_finished.set();    // no more blocks will be scheduled
     read_signal_lock.unlock();
     
-    int ret = pthread_join(read_thread, NULL);
-    if(0 != ret) {
-        cerr << "Error joining BGZF read thread (error " << ret << ")." << endl;
+    if(!mapped_data) {
+        int ret = pthread_join(read_thread, NULL);
+        if(0 != ret) {
+            cerr << "Error joining BGZF read thread (error " << ret << ")." << endl;
+        }
+    }
+    
+    // Any blocks still queued may have decompression jobs in flight that
+    // reference this stream, so let them finish before releasing the blocks.
+    while(true) {
+        BgzfBlock * block = waitForFrontBlock();
+        if(!block)
+            break;
+        block_queue.pop();
+        block->release();
+    }
+    block_budget.reset();
+    stitch_buffer.clear();
+    stitch_offset = 0;
+    
+    if(mapped_data) {
+        munmap((void *)mapped_data, mapped_size);
+        ::close(mapped_file);
+        mapped_data = NULL;
+        mapped_file = -1;
     }
     
     if(input_stream_real.is_open())
@@ -20,55 +20,157 @@
 #include <map>
 #include <vector>
 #include "thread_pool.h"
+#include "bgzf_buffer_pool.h"
+#include "queue_budget.h"
 
 #include <iostream>
 
+// Blocks read ahead of the consumer by default, unless --queue-mem allows more.
+const size_t BGZF_DEFAULT_READ_AHEAD_BLOCKS = 100;
+
 class BgzfInputStream
 {
-    class BgzfBlock : public ThreadJob {
-        char compressed_data[65536];
-        char uncompressed_data[65536];
+    class BgzfBlock {
+        BgzfBuffer * buffer;
+        const char * compressed_data;   // either in buffer, or in the memory mapped file
+        char * uncompressed_data;
         unsigned int compressed_size;
         unsigned int uncompressed_size;
         unsigned int read_size;
         
         SynchronizedFlag decompression_started;
+        SynchronizedFlag decompressed;
         Spinlock decompression_start;
+        int references;     // held by the block queue and the decompression job
         BgzfInputStream * stream;
     public:
         BgzfBlock(BgzfInputStream * stream)
-        : read_size(0)
+        : buffer(BgzfBufferPool::allocate())
+        , compressed_data(buffer->compressed_data)
+        , uncompressed_data(buffer->uncompressed_data)
+        , read_size(0)
+        , decompression_started(false)
+        , decompressed(false)
+        , references(1)
+        , stream(stream)
+        { }
+        BgzfBlock(BgzfInputStream * stream, const char * mapped_data, unsigned int size)
+        : buffer(BgzfBufferPool::allocate())
+        , compressed_data(mapped_data)
+        , uncompressed_data(buffer->uncompressed_data)
+        , compressed_size(size)
+        , read_size(0)
         , decompression_started(false)
+        , decompressed(false)
+        , references(1)
         , stream(stream)
         { }
+        ~BgzfBlock() { BgzfBufferPool::deallocate(buffer); }
         unsigned int read();
         bool decompress();
-        bool isDecompressed() { return isDone(); }
+        bool isDecompressed() { return decompressed.isSet(); }
+        bool isDecompressionStarted() { return decompression_started.isSet(); }
         unsigned int readData(void * dest, unsigned int max_size);
-        virtual void runJob();
         bool dataRemaining() { return read_size != uncompressed_size; }
+        const char * data() const { return &uncompressed_data[read_size]; }
+        unsigned int dataAvailable() const { return uncompressed_size - read_size; }
+        void skip(unsigned int len) { read_size += len; }
+        size_t mappedOffset() const { return compressed_data - stream->mapped_data; }
+        void retain() { __sync_add_and_fetch(&references, 1); }
+        void release() { if(0 == __sync_sub_and_fetch(&references, 1)) delete this; }
+    };
+    
+    // Decompression jobs are separate from the blocks themselves so that the
+    // thread pool never touches a block after the consumer has released it.
+    class DecompressJob : public ThreadJob {
+        BgzfBlock * block;
+    public:
+        DecompressJob(BgzfBlock * block) : block(block) { block->retain(); }
+        virtual void runJob();
+        virtual bool deleteOnCompletion() { return true; }
+        virtual ThreadJobPriority getPriority() { return JOB_PRIORITY_HIGH; }
     };
 public:
     BgzfInputStream()
+    : block_budget("BGZF read-ahead")
+    , read_ahead_memory(0)
+    , mapped_file(-1)
+    , mapped_data(NULL)
+    , mapped_size(0)
+    , mapped_offset(0)
+    , mapped_released(0)
+    , stitch_offset(0)
     {
         eof_seen.clear();
         fail_seen.clear();
+        closing.clear();
+        read_finished.clear();
     }
     bool open(std::string filename);
     bool read(char * data, size_t len);
+    
+    // Zero-copy access to the stream. peek() returns a pointer to the next len
+    // bytes without consuming them, or NULL if fewer than len bytes remain.
+    // The data is returned in place from the decompressed block, and is only
+    // copied (into a stitch buffer) when it straddles a block boundary. The
+    // pointer is valid until the next call to peek(), peekContiguous(),
+    // consume() or read().
+    const char * peek(size_t len);
+    void consume(size_t len);
+    
+    // All of the data that peek() can return without copying: the rest of the
+    // current block (or stitch buffer). Its length is returned in len. Returns
+    // NULL at the end of the stream.
+    const char * peekContiguous(size_t & len);
     void close();
-    bool is_open() { return *input_stream == std::cin || input_stream_real.is_open(); }
-    bool eof() { return block_queue.empty() && eof_seen.isSet(); }
+    bool is_open() { return mapped_data || *input_stream == std::cin || input_stream_real.is_open(); }
+    bool eof() { return block_queue.empty() && read_finished.isSet(); }
     bool fail() { return fail_seen.isSet(); }   //all errors are treated as fatal
+    
+    // Maximum memory used by blocks read ahead of the consumer. Each block
+    // holds a whole BgzfBuffer (~128KB). Defaults to the larger of
+    // BGZF_DEFAULT_READ_AHEAD_BLOCKS blocks and QueueBudget's limit.
+    void setReadAheadMemory(size_t bytes) { read_ahead_memory = bytes; block_budget.setLimit(bytes); }
+    size_t getReadAheadMemory() const { return block_budget.getLimit(); }
+    
+    // Files (but not stdin) are memory mapped when possible. Block boundaries
+    // are then found by walking the BGZF headers in the mapping, and blocks are
+    // handed straight to the thread pool without a separate reader thread.
+    static void setUseMemoryMap(bool use) { use_memory_map = use; }
+    static bool getUseMemoryMap() { return use_memory_map; }
 protected:
     std::istream * input_stream;
     std::ifstream input_stream_real;
-    SynchronizedFlag eof_seen, fail_seen;
+    SynchronizedFlag eof_seen, fail_seen, closing, read_finished;
     SynchronizedQueue<BgzfBlock *> block_queue;
+    QueueBudget block_budget;               // memory held by blocks in block_queue
+    size_t read_ahead_memory;               // 0 for the default
+    
+    // Wait until the block at the front of the queue has been decompressed,
+    // decompressing it on this thread if no worker has picked it up yet.
+    // Returns NULL when the stream is exhausted.
+    BgzfBlock * waitForFrontBlock();
+    void popFrontBlock();
+    void signalBlockReady();
+    
+    // memory mapped input
+    static bool use_memory_map;
+    int mapped_file;
+    const char * mapped_data;
+    size_t mapped_size;
+    size_t mapped_offset;       // start of the next block to be queued
+    size_t mapped_released;     // everything before this has been dropped from memory
+    bool openMapped(const std::string & filename);
+    void scheduleMappedBlocks();
+    void releaseMappedData();
+    
+    // holds data from the start of the stream that spans more than one block
+    std::vector<char> stitch_buffer;
+    size_t stitch_offset;
     
     //multithreading:
     mutex read_signal_lock;
-    condition_variable read_signal_cv;
+    condition_variable block_ready_cv;      // consumer waits for a decompressed block
     pthread_t read_thread;
     bool use_threads;
     
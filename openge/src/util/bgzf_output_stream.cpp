@@ -25,10 +25,10 @@
 
 #include "bgzf_output_stream.h"
 #include "thread_pool.h"
+#include "bgzf_codec.h"
 #include <zlib.h>
 #include <iostream>
 #include <cstring>
-#include <zlib.h>
 using namespace std;
 
 #ifndef UINT64_MAX
@@ -38,79 +38,32 @@ using namespace std;
 //////////////////
 // BgzfBlock class
 
-void BgzfOutputStream::BgzfBlock::runJob() {
-    //keep a local copy of this variable in case
-    // this job object is destroyed under us.
-    // This object can theoretically be deleted any time
-    // after the notify_one() block;
-    BgzfOutputStream * stream = this->stream;
-
-    if(!compress()) {
+void BgzfOutputStream::CompressJob::runJob() {
+    if(!block->compress()) {
         cerr << "Bgzf block compression failed. Aborting." << endl;
         exit(-1);
     }
-
-    //tell the write thread to check for new data.
-    stream->write_thread_mutex.lock();
-    stream->write_thread_signal.notify_one();
-    stream->write_thread_mutex.unlock();
 }
 
 bool BgzfOutputStream::BgzfBlock::compress() {
     int current_compression_level = stream->compression_level;
     
+    BgzfCodec * codec = BgzfCodec::threadCodec();
+    
     data_access_lock.lock();
     while(true) {
-        // compress
-        z_stream zs = {0};
-        zs.zalloc    = NULL;
-        zs.zfree     = NULL;
-        zs.next_in   = (Bytef*)&uncompressed_data[0];
-        zs.avail_in  = uncompressed_size;
-        zs.next_out  = (Bytef*)&compressed_data[18];
-        zs.avail_out = BGZF_BLOCK_SIZE - 18 - 8;
-        
-        // initialize the zlib compression algorithm
-        int init_status = deflateInit2(&zs,
-                                  current_compression_level,
-                                  Z_DEFLATED,
-                                  -15,  //window
-                                  8,    //memory level
-                                  Z_DEFAULT_STRATEGY);
-        
-        if ( init_status != Z_OK ) {
-            cerr << "BGZF writer: zlib deflateInit2 failed" << endl;
-            exit(-1);
-        }
-        // compress the data
-        int deflate_status = deflate(&zs, Z_FINISH);
-        
+        size_t deflated_size = codec->compress(&uncompressed_data[0], uncompressed_size, &compressed_data[18], BGZF_BLOCK_SIZE - 18 - 8, current_compression_level);
         
-        // finalize the compression routine
-        int end_status = deflateEnd(&zs);
-        if ( end_status != Z_OK ){
-            cerr << "BGZF writer: zlib deflateEnd failed. Aborting." << endl;
-            exit(-1);
+        if(deflated_size) {
+            compressed_size = deflated_size + 18 + 8;
+            break;
         }
         
-        if(deflate_status == Z_STREAM_END) {
-            compressed_size = zs.total_out + 18 + 8;
-
-            break;
-        } else {
-            
-            // there was not enough space available in buffer
-            // try to reduce the input length & re-start loop
-            if ( deflate_status == Z_OK ) {
-                current_compression_level++;
-                if ( current_compression_level > Z_BEST_COMPRESSION ){
-                    cerr << "BGZF writer: input reduction failed" << endl;
-                    exit(-1);
-                }
-                
-                continue;
-            }
-            cerr << "BGZF writer: zlib deflate failed. Aborting." << endl;
+        // there was not enough space available in buffer
+        // try to reduce the input length & re-start loop
+        current_compression_level++;
+        if ( current_compression_level > Z_BEST_COMPRESSION ){
+            cerr << "BGZF writer: input reduction failed" << endl;
             exit(-1);
         }
     }
@@ -136,10 +89,18 @@ bool BgzfOutputStream::BgzfBlock::compress() {
     
     //now GZ footer..
     unsigned int data_end = compressed_size - 8;
-    *((uint32_t *)&compressed_data[data_end]) = crc32(crc32(0, NULL, 0), (Bytef *)&uncompressed_data[0], uncompressed_size);
+    *((uint32_t *)&compressed_data[data_end]) = codec->crc32(&uncompressed_data[0], uncompressed_size);
     *((uint32_t *)&compressed_data[data_end+4]) = uncompressed_size;
     data_access_lock.unlock();
     
+    // Mark the block complete while holding the write thread's lock, so the
+    // write thread can't check the flag and go to sleep between the two steps.
+    // Once the lock is released, this block may be deleted at any time.
+    stream->write_thread_mutex.lock();
+    compressed.set();
+    stream->write_thread_signal.notify_one();
+    stream->write_thread_mutex.unlock();
+    
     return true;
 }
 
@@ -162,7 +123,7 @@ unsigned int BgzfOutputStream::BgzfBlock::addData(const char * data, unsigned in
 
 bool BgzfOutputStream::BgzfBlock::write() {
     data_access_lock.lock();
-    assert(true == isDone() || stream->closing.isSet());
+    assert(true == isCompressed() || stream->closing.isSet());
     size_t position = stream->output_stream->tellp();
     stream->output_stream->write(compressed_data, compressed_size);
     stream->write_position_map[write_offset] = position;
@@ -210,7 +171,7 @@ void BgzfOutputStream::write(const char * data, size_t len) {
                     usleep(80e3);  //80ms
                 }
                 write_queue.push(current_block);
-                ThreadPool::sharedPool()->addJob(current_block);
+                ThreadPool::sharedPool()->addJob(new CompressJob(current_block));
             } else {
                 current_block->compress();
                 current_block->write();
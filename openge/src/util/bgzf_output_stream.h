@@ -22,8 +22,7 @@
 #include <map>
 #include <stdint.h>
 #include "thread_pool.h"
-
-const uint32_t BGZF_BLOCK_SIZE = 65536;
+#include "bgzf_buffer_pool.h"
 
 class BgzfOutputStream {
     int compression_level;
@@ -31,27 +30,44 @@ class BgzfOutputStream {
     std::ofstream output_stream_real;
     bool use_threads;
 
-    class BgzfBlock : public ThreadJob {
+    class BgzfBlock {
         BgzfOutputStream * stream;
-        char uncompressed_data[BGZF_BLOCK_SIZE];
-        char compressed_data[BGZF_BLOCK_SIZE];
+        BgzfBuffer * buffer;
+        char * uncompressed_data;
+        char * compressed_data;
         unsigned int uncompressed_size, compressed_size;
         Spinlock data_access_lock;
+        SynchronizedFlag compressed;
     public:
         size_t write_offset;
         BgzfBlock(BgzfOutputStream * stream, size_t write_offset)
         : stream(stream)
+        , buffer(BgzfBufferPool::allocate())
+        , uncompressed_data(buffer->uncompressed_data)
+        , compressed_data(buffer->compressed_data)
         , uncompressed_size(0)
+        , compressed(false)
         , write_offset(write_offset)
         { }
+        ~BgzfBlock() { BgzfBufferPool::deallocate(buffer); }
         
         unsigned int addData(const char * data, unsigned int length);
         bool isFull();
-        bool isCompressed() { return isDone(); }
-        void runJob();  //calls compress when run in thread pool
+        bool isCompressed() { return compressed.isSet(); }
         bool compress();
         bool write();
     };
+    
+    // Compression jobs are separate from the blocks, since the write thread
+    // may delete a block as soon as it has been marked as compressed.
+    class CompressJob : public ThreadJob {
+        BgzfBlock * block;
+    public:
+        CompressJob(BgzfBlock * block) : block(block) {}
+        virtual void runJob();
+        virtual bool deleteOnCompletion() { return true; }
+        virtual ThreadJobPriority getPriority() { return JOB_PRIORITY_HIGH; }
+    };
 
     BgzfBlock * current_block;
     
@@ -0,0 +1,119 @@
+/*********************************************************************
+ *
+ * duplication_metrics.cpp: Per library duplicate counts.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "duplication_metrics.h"
+
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+LibraryDuplicationMetrics::LibraryDuplicationMetrics()
+: unpaired_reads_examined(0)
+, read_pair_reads_examined(0)
+, secondary_or_supplementary_reads(0)
+, unmapped_reads(0)
+, unpaired_read_duplicates(0)
+, read_pair_read_duplicates(0)
+, read_pair_optical_duplicates(0)
+{ }
+
+void LibraryDuplicationMetrics::add(const LibraryDuplicationMetrics & other)
+{
+    unpaired_reads_examined += other.unpaired_reads_examined;
+    read_pair_reads_examined += other.read_pair_reads_examined;
+    secondary_or_supplementary_reads += other.secondary_or_supplementary_reads;
+    unmapped_reads += other.unmapped_reads;
+    unpaired_read_duplicates += other.unpaired_read_duplicates;
+    read_pair_read_duplicates += other.read_pair_read_duplicates;
+    read_pair_optical_duplicates += other.read_pair_optical_duplicates;
+}
+
+double LibraryDuplicationMetrics::percentDuplication() const
+{
+    uint64_t examined = unpaired_reads_examined + read_pair_reads_examined;
+    if(examined == 0)
+        return 0;
+    return (double)(unpaired_read_duplicates + read_pair_read_duplicates) / examined;
+}
+
+int64_t LibraryDuplicationMetrics::estimatedLibrarySize() const
+{
+    uint64_t pairs = read_pair_reads_examined / 2;
+    uint64_t duplicate_pairs = read_pair_read_duplicates / 2;
+    if(read_pair_optical_duplicates > pairs || duplicate_pairs > pairs)
+        return -1;
+    return DuplicationMetrics::estimateLibrarySize(pairs - read_pair_optical_duplicates, pairs - duplicate_pairs);
+}
+
+// The equation that the library size x solves, for c distinct pairs of n.
+static double librarySizeFunction(double x, double c, double n)
+{
+    return c / x - 1 + exp(-n / x);
+}
+
+int64_t DuplicationMetrics::estimateLibrarySize(uint64_t read_pairs, uint64_t unique_read_pairs)
+{
+    if(read_pairs == 0 || unique_read_pairs == 0 || unique_read_pairs >= read_pairs)
+        return -1;
+
+    // bisect on the size as a multiple of the distinct pairs
+    double m = 1.0, M = 100.0;
+    if(librarySizeFunction(m * unique_read_pairs, unique_read_pairs, read_pairs) < 0)
+        return -1;
+    while(librarySizeFunction(M * unique_read_pairs, unique_read_pairs, read_pairs) >= 0)
+        M *= 10.0;
+
+    for(int i = 0; i < 40; i++) {
+        double r = (m + M) / 2.0;
+        double u = librarySizeFunction(r * unique_read_pairs, unique_read_pairs, read_pairs);
+        if(u == 0)
+            break;
+        else if(u > 0)
+            m = r;
+        else
+            M = r;
+    }
+
+    return (int64_t)(unique_read_pairs * (m + M) / 2.0);
+}
+
+void DuplicationMetrics::add(const DuplicationMetrics & other)
+{
+    for(map<string, LibraryDuplicationMetrics>::const_iterator i = other.libraries.begin(); i != other.libraries.end(); i++)
+        libraries[i->first].add(i->second);
+}
+
+bool DuplicationMetrics::write(const string & filename) const
+{
+    FILE * fp = fopen(filename.c_str(), "w");
+    if(!fp)
+        return false;
+
+    fprintf(fp, "## METRICS CLASS\tpicard.sam.DuplicationMetrics\n");
+    fprintf(fp, "LIBRARY\tUNPAIRED_READS_EXAMINED\tREAD_PAIRS_EXAMINED\tSECONDARY_OR_SUPPLEMENTARY_RDS\tUNMAPPED_READS\tUNPAIRED_READ_DUPLICATES\tREAD_PAIR_DUPLICATES\tREAD_PAIR_OPTICAL_DUPLICATES\tPERCENT_DUPLICATION\tESTIMATED_LIBRARY_SIZE\n");
+    for(map<string, LibraryDuplicationMetrics>::const_iterator i = libraries.begin(); i != libraries.end(); i++) {
+        const LibraryDuplicationMetrics & m = i->second;
+        fprintf(fp, "%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%.6f\t", i->first.c_str(),
+                (unsigned long long)m.unpaired_reads_examined, (unsigned long long)m.read_pair_reads_examined / 2,
+                (unsigned long long)m.secondary_or_supplementary_reads, (unsigned long long)m.unmapped_reads,
+                (unsigned long long)m.unpaired_read_duplicates, (unsigned long long)m.read_pair_read_duplicates / 2,
+                (unsigned long long)m.read_pair_optical_duplicates, m.percentDuplication());
+        int64_t library_size = m.estimatedLibrarySize();
+        if(library_size >= 0)
+            fprintf(fp, "%lld", (long long)library_size);
+        fprintf(fp, "\n");
+    }
+
+    return 0 == fclose(fp);
+}
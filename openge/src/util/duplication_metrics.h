@@ -0,0 +1,60 @@
+#ifndef OGE_DUPLICATION_METRICS_H
+#define OGE_DUPLICATION_METRICS_H
+
+/*********************************************************************
+ *
+ * duplication_metrics.h: Per library duplicate counts.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * The counts of Picard's DuplicationMetrics, written in the same
+ * format as Picard's metrics files, so that QC tools reading those
+ * can read ours.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+struct LibraryDuplicationMetrics {
+    uint64_t unpaired_reads_examined;
+    uint64_t read_pair_reads_examined;      // reads, not pairs
+    uint64_t secondary_or_supplementary_reads;
+    uint64_t unmapped_reads;
+    uint64_t unpaired_read_duplicates;
+    uint64_t read_pair_read_duplicates;     // reads, not pairs
+    uint64_t read_pair_optical_duplicates;
+
+    LibraryDuplicationMetrics();
+    void add(const LibraryDuplicationMetrics & other);
+
+    double percentDuplication() const;
+    // Returns -1 if there are no duplicate pairs to estimate it from.
+    int64_t estimatedLibrarySize() const;
+};
+
+class DuplicationMetrics {
+public:
+    LibraryDuplicationMetrics & operator[](const std::string & library) { return libraries[library]; }
+    void add(const DuplicationMetrics & other);
+
+    // Returns false if the file couldn't be written.
+    bool write(const std::string & filename) const;
+
+    // Picard's estimate of the number of distinct molecules in a library,
+    // from the Lander-Waterman equation.
+    static int64_t estimateLibrarySize(uint64_t read_pairs, uint64_t unique_read_pairs);
+
+protected:
+    std::map<std::string, LibraryDuplicationMetrics> libraries;
+};
+
+#endif
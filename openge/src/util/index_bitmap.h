@@ -0,0 +1,85 @@
+#ifndef OGE_INDEX_BITMAP_H
+#define OGE_INDEX_BITMAP_H
+
+/*********************************************************************
+ *
+ * index_bitmap.h: Set of read indices, one bit per read.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Indices are set in any order, and are usually read back in order
+ * with a Cursor, which loads each word of the bitmap once.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+class IndexBitmap {
+public:
+    IndexBitmap() : bits(0) {}
+
+    // Makes room for indices [0, size), all unset.
+    void assign(uint64_t size) {
+        bits = size;
+        words.assign((size + 63) / 64, 0);
+    }
+
+    uint64_t size() const { return bits; }
+
+    // Indices past size() make the bitmap grow.
+    void set(uint64_t index) {
+        if(index >= bits)
+            grow(index + 1);
+        words[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+
+    bool test(uint64_t index) const {
+        return index < bits && (words[index / 64] >> (index % 64)) & 1;
+    }
+
+    void clear() {
+        std::vector<uint64_t>().swap(words);
+        bits = 0;
+    }
+
+    // Reads the bits of indices 0, 1, 2... in turn.
+    class Cursor {
+    public:
+        Cursor(const IndexBitmap & bitmap) : bitmap(bitmap), index(0), word(0) {}
+
+        bool next() {
+            if(index % 64 == 0)
+                word = index < bitmap.bits ? bitmap.words[index / 64] : 0;
+            index++;
+            bool bit = word & 1;
+            word >>= 1;
+            return bit;
+        }
+
+    protected:
+        const IndexBitmap & bitmap;
+        uint64_t index;
+        uint64_t word;
+    };
+
+protected:
+    void grow(uint64_t size) {
+        bits = size;
+        if(words.size() < (size + 63) / 64)
+            words.resize(std::max((size + 63) / 64, (uint64_t)words.size() * 2), 0);
+    }
+
+    std::vector<uint64_t> words;
+    uint64_t bits;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef OGE_LOSER_TREE_H
+#define OGE_LOSER_TREE_H
+
+/*********************************************************************
+ *
+ * loser_tree.h: Tournament tree for k-way merges.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Holds the current item from each of k sorted sources. Each internal
+ * node of the tree remembers the source that lost the match played
+ * there, so replacing the winning item only replays the matches on
+ * the path from its leaf to the root: log2(k) comparisons, and no
+ * memory allocation, per item merged.
+ *
+ * To merge, call setItem() (or setExhausted()) for every source, then
+ * build(). While !empty(), take top(), and call replaceTop() with the
+ * next item from topSource(), or popTop() once that source has run
+ * out. Items that compare equal are taken from the lowest numbered
+ * source first.
+ *
+ *********************************************************************/
+
+#include <vector>
+#include <cstddef>
+
+template <class item_t, class compare_t>
+class LoserTree
+{
+public:
+    LoserTree(size_t sources = 0, compare_t comp = compare_t())
+    : comp(comp)
+    , winner(0)
+    { reset(sources); }
+
+    void reset(size_t sources) {
+        items.assign(sources, item_t());
+        exhausted.assign(sources, 1);
+        losers.assign(sources, 0);
+        winner = 0;
+    }
+
+    size_t size() const { return items.size(); }
+
+    void setItem(size_t source, const item_t & item) { items[source] = item; exhausted[source] = 0; }
+    void setExhausted(size_t source) { exhausted[source] = 1; }
+
+    void build() {
+        if(!items.empty())
+            winner = buildNode(1);
+    }
+
+    bool empty() const { return items.empty() || exhausted[winner]; }
+    size_t topSource() const { return winner; }
+    const item_t & top() const { return items[winner]; }
+
+    void replaceTop(const item_t & item) {
+        items[winner] = item;
+        replay();
+    }
+
+    void popTop() {
+        exhausted[winner] = 1;
+        replay();
+    }
+
+protected:
+    // true if source a should be taken before source b
+    bool beats(size_t a, size_t b) const {
+        if(exhausted[a] != exhausted[b])
+            return exhausted[b];
+        if(exhausted[a])
+            return a < b;
+        if(comp(items[a], items[b]))
+            return true;
+        if(comp(items[b], items[a]))
+            return false;
+        return a < b;
+    }
+
+    // Leaves are nodes size()..2*size()-1. Returns the winner of the subtree.
+    size_t buildNode(size_t node) {
+        if(node >= items.size())
+            return node - items.size();
+
+        size_t left = buildNode(2 * node);
+        size_t right = buildNode(2 * node + 1);
+        if(beats(left, right)) {
+            losers[node] = right;
+            return left;
+        }
+        losers[node] = left;
+        return right;
+    }
+
+    void replay() {
+        size_t w = winner;
+        for(size_t node = (w + items.size()) / 2; node > 0; node /= 2) {
+            if(beats(losers[node], w))
+                std::swap(losers[node], w);
+        }
+        winner = w;
+    }
+
+    compare_t comp;
+    std::vector<item_t> items;
+    std::vector<char> exhausted;    // not vector<bool>, which is slow to index
+    std::vector<size_t> losers;     // indexed by internal node, 1..size()-1
+    size_t winner;
+};
+
+#endif
@@ -0,0 +1,188 @@
+/*********************************************************************
+ *
+ * lz4_block.cpp: Fast compression in the LZ4 block format.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "lz4_block.h"
+
+#include <stdint.h>
+#include <cstring>
+
+// Format limits: matches are at least 4 bytes long, the last 5 bytes are
+// always literals, and the last match starts at least 12 bytes before the end.
+static const size_t LZ4_MIN_MATCH = 4;
+static const size_t LZ4_LAST_LITERALS = 5;
+static const size_t LZ4_MATCH_FIND_LIMIT = 12;
+static const size_t LZ4_MAX_DISTANCE = 65535;
+static const int LZ4_HASH_BITS = 14;
+
+static inline uint32_t read32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write the part of a length that doesn't fit in the token.
+static inline uint8_t * writeLength(uint8_t * op, size_t len) {
+    for(; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Write literals [anchor, anchor+lit_len), followed by a match unless
+// match_len is zero. Returns NULL if out of space.
+static inline uint8_t * writeSequence(uint8_t * op, uint8_t * op_end, const uint8_t * anchor, size_t lit_len, size_t offset, size_t match_len) {
+    size_t needed = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if((size_t)(op_end - op) < needed)
+        return NULL;
+
+    uint8_t * token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if(lit_len >= 15)
+        op = writeLength(op, lit_len - 15);
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    if(match_len) {
+        *op++ = (uint8_t)(offset & 0xff);
+        *op++ = (uint8_t)(offset >> 8);
+        size_t ml = match_len - LZ4_MIN_MATCH;
+        *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+        if(ml >= 15)
+            op = writeLength(op, ml - 15);
+    }
+    return op;
+}
+
+size_t ogeLz4Compress(const char * in, size_t in_len, char * out, size_t out_len)
+{
+    const uint8_t * const base = (const uint8_t *) in;
+    const uint8_t * const end = base + in_len;
+    const uint8_t * anchor = base;
+    uint8_t * op = (uint8_t *) out;
+    uint8_t * const op_end = op + out_len;
+
+    if(in_len > LZ4_MATCH_FIND_LIMIT) {
+        const uint8_t * const find_limit = end - LZ4_MATCH_FIND_LIMIT;
+        const uint8_t * const match_limit = end - LZ4_LAST_LITERALS;
+        uint32_t table[1 << LZ4_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const uint8_t * ip = base + 1;
+        while(ip < find_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            const uint8_t * ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if((size_t)(ip - ref) > LZ4_MAX_DISTANCE || read32(ref) != seq) {
+                // skip faster through data that doesn't compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while(ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            size_t match_len = LZ4_MIN_MATCH;
+            while(ip + match_len < match_limit && ip[match_len] == ref[match_len])
+                match_len++;
+
+            op = writeSequence(op, op_end, anchor, ip - anchor, ip - ref, match_len);
+            if(!op)
+                return 0;
+
+            ip += match_len;
+            anchor = ip;
+            if(ip < find_limit)
+                table[hash32(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    op = writeSequence(op, op_end, anchor, end - anchor, 0, 0);
+    if(!op)
+        return 0;
+    return op - (uint8_t *) out;
+}
+
+bool ogeLz4Decompress(const char * in, size_t in_len, char * out, size_t out_len)
+{
+    const uint8_t * ip = (const uint8_t *) in;
+    const uint8_t * const ip_end = ip + in_len;
+    uint8_t * op = (uint8_t *) out;
+    uint8_t * const op_end = op + out_len;
+
+    while(true) {
+        if(ip >= ip_end)
+            return false;
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if(lit_len == 15) {
+            uint8_t b;
+            do {
+                if(ip >= ip_end)
+                    return false;
+                b = *ip++;
+                lit_len += b;
+            } while(b == 255);
+        }
+        if(lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op))
+            return false;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the last sequence has no match
+        if(ip == ip_end)
+            break;
+
+        if(ip_end - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - (uint8_t *) out))
+            return false;
+
+        size_t match_len = token & 15;
+        if(match_len == 15) {
+            uint8_t b;
+            do {
+                if(ip >= ip_end)
+                    return false;
+                b = *ip++;
+                match_len += b;
+            } while(b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if(match_len > (size_t)(op_end - op))
+            return false;
+
+        const uint8_t * match = op - offset;
+        if(offset >= match_len)
+            memcpy(op, match, match_len);
+        else {
+            // overlapping copy repeats the last offset bytes
+            for(size_t i = 0; i < match_len; i++)
+                op[i] = match[i];
+        }
+        op += match_len;
+    }
+
+    return op == op_end;
+}
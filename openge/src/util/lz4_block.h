@@ -0,0 +1,37 @@
+#ifndef OGE_LZ4_BLOCK_H
+#define OGE_LZ4_BLOCK_H
+
+/*********************************************************************
+ *
+ * lz4_block.h: Fast compression in the LZ4 block format.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * A small, greedy LZ77 compressor writing the LZ4 block format (see
+ * lz4_Block_format.md in the LZ4 distribution), used for temporary
+ * files where compression speed matters far more than ratio. Blocks
+ * can be decompressed by any LZ4 implementation, and vice versa.
+ *
+ *********************************************************************/
+
+#include <stddef.h>
+
+// Largest compressed size of in_len bytes.
+inline size_t ogeLz4CompressBound(size_t in_len) { return in_len + in_len / 255 + 16; }
+
+// Compress in_len bytes into out, which can hold out_len bytes. Returns the
+// compressed size, or 0 if the compressed data did not fit.
+size_t ogeLz4Compress(const char * in, size_t in_len, char * out, size_t out_len);
+
+// Decompress a block, which must decompress to exactly out_len bytes.
+// Returns false if the block is corrupt.
+bool ogeLz4Decompress(const char * in, size_t in_len, char * out, size_t out_len);
+
+#endif
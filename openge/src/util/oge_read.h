@@ -34,6 +34,10 @@ public:
     static void deallocate(OGERead * al);
     static void clearCachedAllocations();
     static Spinlock allocate_lock;
+    
+    // Approximate number of bytes of memory held by this read, used to
+    // account for reads waiting in queues.
+    size_t memoryUsage() const { return sizeof(OGERead) + getBamEncodedStringData().capacity(); }
 protected:
     static SynchronizedQueue<OGERead *> cached_allocations;
     static SynchronizedQueue<OGERead *> cached_allocations_cleared;
@@ -0,0 +1,187 @@
+/*********************************************************************
+ *
+ * optical_duplicate_finder.cpp: Counting of optical duplicates.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "optical_duplicate_finder.h"
+
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+// Locations counted by each job, and jobs submitted before waiting for them.
+static const size_t OPTICAL_BATCH_LOCATIONS = 16 * 1024;
+static const size_t OPTICAL_JOBS_PER_THREAD = 4;
+
+// Parses an integer at the start of a field, stopping at the first
+// character that isn't a digit. Fails if it doesn't fit in an int.
+static bool parseField(const char * p, const char * end, int & value)
+{
+    bool negative = p < end && *p == '-';
+    if(negative)
+        p++;
+    if(p == end || *p < '0' || *p > '9')
+        return false;
+
+    int64_t parsed = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) {
+        parsed = parsed * 10 + (*p - '0');
+        if(parsed > INT_MAX)
+            return false;
+    }
+    value = negative ? -(int)parsed : (int)parsed;
+    return true;
+}
+
+bool OpticalDuplicateFinder::parseReadName(const char * name, size_t length, int & tile, int & x, int & y)
+{
+    const char * end = name + length;
+    const char * fields[3] = {NULL, NULL, name};
+    int colons = 0;
+
+    for(const char * p = name; p < end; p++) {
+        if(*p != ':')
+            continue;
+        if(++colons > 6)
+            return false;
+        fields[0] = fields[1];
+        fields[1] = fields[2];
+        fields[2] = p + 1;
+    }
+
+    if(colons != 4 && colons != 6)
+        return false;
+    return parseField(fields[0], end, tile) && parseField(fields[1], end, x) && parseField(fields[2], end, y);
+}
+
+OpticalLocation OpticalDuplicateFinder::location(int read_group, const char * name, size_t length)
+{
+    int tile, x, y;
+    if(!parseReadName(name, length, tile, x, y))
+        return OpticalLocation();
+
+    // fields that don't fit in the packing would match unrelated clusters
+    if(tile < 0 || tile > 0xffff || x < 0 || y < 0)
+        return OpticalLocation();
+    return OpticalLocation(((uint64_t)(uint16_t)read_group << 16) | (uint16_t)tile, ((uint64_t)x << 32) | (uint32_t)y);
+}
+
+size_t OpticalDuplicateFinder::countOpticalDuplicates(vector<OpticalLocation>::iterator begin, vector<OpticalLocation>::iterator end, int max_distance)
+{
+    sort(begin, end);
+    size_t length = end - begin;
+    vector<bool> optical(length, false);
+    size_t count = 0;
+
+    // Each location flags the later locations near it, as Picard does. Those
+    // are in the same read group and tile, and within max_distance in x.
+    for(size_t i = 0; i < length && begin[i].isLocated(); i++) {
+        const OpticalLocation & lhs = begin[i];
+        for(size_t j = i + 1; j < length; j++) {
+            if(optical[j])
+                continue;
+            const OpticalLocation & rhs = begin[j];
+            if(rhs.tile != lhs.tile || (int64_t)rhs.x() > (int64_t)lhs.x() + max_distance)
+                break;
+            int64_t dy = (int64_t)rhs.y() - lhs.y();
+            if(dy <= max_distance && -dy <= max_distance) {
+                optical[j] = true;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+void OpticalDuplicateFinder::CountJob::runJob()
+{
+    size_t start = 0;
+    for(size_t i = 0; i < set_ends.size(); i++) {
+        counts[libraries[i]] += countOpticalDuplicates(locations.begin() + start, locations.begin() + set_ends[i], max_distance);
+        start = set_ends[i];
+    }
+}
+
+OpticalDuplicateFinder::OpticalDuplicateFinder()
+: max_distance(OPTICAL_DEFAULT_DISTANCE)
+, batch(NULL)
+{ }
+
+OpticalDuplicateFinder::~OpticalDuplicateFinder()
+{
+    finish();
+}
+
+void OpticalDuplicateFinder::addSet(int library, const OpticalLocation * locations, size_t count)
+{
+    // a set needs two locations in the same tile to have optical duplicates
+    size_t located = 0;
+    for(size_t i = 0; i < count && located < 2; i++)
+        if(locations[i].isLocated())
+            located++;
+    if(located < 2)
+        return;
+
+    if(!batch)
+        batch = new CountJob(max_distance);
+    batch->locations.insert(batch->locations.end(), locations, locations + count);
+    batch->set_ends.push_back(batch->locations.size());
+    batch->libraries.push_back(library);
+
+    if(batch->locations.size() >= OPTICAL_BATCH_LOCATIONS)
+        submit();
+}
+
+void OpticalDuplicateFinder::submit()
+{
+    if(!batch)
+        return;
+
+    if(!OGEParallelismSettings::isMultithreadingEnabled()) {
+        batch->runJob();
+        jobs.push_back(batch);
+        batch = NULL;
+        collect();
+        return;
+    }
+
+    ThreadPool::sharedPool()->addJob(batch, &job_group);
+    jobs.push_back(batch);
+    batch = NULL;
+
+    if(jobs.size() >= OPTICAL_JOBS_PER_THREAD * OGEParallelismSettings::getNumberThreads())
+        collect();
+}
+
+// Waits for the submitted jobs, and adds up their counts.
+void OpticalDuplicateFinder::collect()
+{
+    if(jobs.empty())
+        return;
+
+    if(OGEParallelismSettings::isMultithreadingEnabled())
+        ThreadPool::sharedPool()->waitForJobCompletion(job_group);
+
+    for(size_t i = 0; i < jobs.size(); i++) {
+        for(map<int, uint64_t>::const_iterator count = jobs[i]->counts.begin(); count != jobs[i]->counts.end(); count++)
+            counts[count->first] += count->second;
+        delete jobs[i];
+    }
+    jobs.clear();
+}
+
+const map<int, uint64_t> & OpticalDuplicateFinder::finish()
+{
+    submit();
+    collect();
+    return counts;
+}
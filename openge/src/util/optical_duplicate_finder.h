@@ -0,0 +1,106 @@
+#ifndef OGE_OPTICAL_DUPLICATE_FINDER_H
+#define OGE_OPTICAL_DUPLICATE_FINDER_H
+
+/*********************************************************************
+ *
+ * optical_duplicate_finder.h: Counting of optical duplicates.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * As in Picard, a duplicate pair is optical (one cluster read twice,
+ * rather than two copies of a molecule) if it comes from the same
+ * read group and tile as another pair of its duplicate set, within a
+ * small distance of it in x and y. The tile, x and y are taken from
+ * Illumina read names.
+ *
+ * A read's location is kept in two 64 bit words: the read group and
+ * tile, 16 bits each, then x and y, 32 bits each, so that sorting
+ * locations sorts by each in turn. As in Picard, the tile is a short and
+ * x and y are ints: reads whose tile is negative or above 65535, or whose
+ * x or y is negative or above 2^31 - 1, aren't given a location, rather
+ * than letting the fields wrap around.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "thread_pool.h"
+
+const int OPTICAL_DEFAULT_DISTANCE = 100;
+
+// Read group and tile of a read whose name doesn't have a location. Sorts
+// last, and fits in the 40 bits ReadEnds keeps it in.
+const uint64_t OPTICAL_NO_TILE = (uint64_t)1 << 32;
+
+struct OpticalLocation {
+    uint64_t tile;      // read group and tile
+    uint64_t xy;        // x and y
+
+    OpticalLocation(uint64_t tile = OPTICAL_NO_TILE, uint64_t xy = 0) : tile(tile), xy(xy) {}
+
+    bool isLocated() const { return tile != OPTICAL_NO_TILE; }
+    int x() const { return (int)(xy >> 32); }
+    int y() const { return (int)(xy & 0xffffffff); }
+
+    bool operator<(const OpticalLocation & rhs) const { return tile < rhs.tile || (tile == rhs.tile && xy < rhs.xy); }
+};
+
+class OpticalDuplicateFinder {
+public:
+    OpticalDuplicateFinder();
+    ~OpticalDuplicateFinder();
+
+    // Maximum distance in x and y between optical duplicates.
+    int getMaxDistance() const { return max_distance; }
+    void setMaxDistance(int distance) { max_distance = distance; }
+
+    // Parses the tile, x and y from the last three fields of a read name
+    // with 5 or 7 colon separated fields, as Picard does by default. Anything
+    // after the digits of a field (such as "#0/1") is ignored.
+    static bool parseReadName(const char * name, size_t length, int & tile, int & x, int & y);
+    static OpticalLocation location(int read_group, const char * name, size_t length);
+
+    // Counts the optical duplicates in a duplicate set of pairs. Sets are
+    // counted in batches on the thread pool.
+    void addSet(int library, const OpticalLocation * locations, size_t count);
+
+    // Waits for all sets to be counted, and returns the number of optical
+    // duplicates in each library's sets.
+    const std::map<int, uint64_t> & finish();
+
+    // Sorts locations and counts the optical duplicates among them.
+    static size_t countOpticalDuplicates(std::vector<OpticalLocation>::iterator begin, std::vector<OpticalLocation>::iterator end, int max_distance);
+
+protected:
+    class CountJob : public ThreadJob {
+    public:
+        CountJob(int max_distance) : max_distance(max_distance) {}
+        virtual void runJob();
+
+        int max_distance;
+        std::vector<OpticalLocation> locations;
+        std::vector<size_t> set_ends;
+        std::vector<int> libraries;
+        std::map<int, uint64_t> counts;
+    };
+
+    void submit();
+    void collect();
+
+    int max_distance;
+    CountJob * batch;
+    std::vector<CountJob *> jobs;
+    ThreadJobGroup job_group;
+    std::map<int, uint64_t> counts;
+};
+
+#endif
@@ -15,14 +15,460 @@
  *********************************************************************/
 
 #include "picard_structures.h"
+#include "radix_sort.h"
+#include "temp_directories.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <unistd.h>
+
+using namespace std;
+
+// Ends read from each temporary file at a time.
+static const size_t SPILL_BUFFER_ENDS = 4096;
 
 std::ostream& operator<< (std::ostream& out, const ReadEnds & re )
 {
-    out << "ReadEnds (LID " << re.libraryId << ")" << std::endl;
-    out << " Seq: " << re.read1Sequence << "/" << re.read2Sequence << std::endl;
-    out << " Coord: " << re.read1Coordinate << "/" << re.read2Coordinate << std::endl;
-    out << " Orientation: " << re.orientation << std::endl;
-    out << " Score: " << re.score << std::endl;
+    out << "ReadEnds (LID " << re.getLibraryId() << ")" << std::endl;
+    out << " Seq: " << re.getRead1Sequence() << "/" << re.getRead2Sequence() << std::endl;
+    out << " Coord: " << re.getRead1Coordinate() << "/" << re.getRead2Coordinate() << std::endl;
+    out << " Orientation: " << re.getOrientation() << std::endl;
+    out << " Score: " << re.getScore() << std::endl;
     
     return out;
-}
\ No newline at end of file
+}
+
+ReadEndsSortingCollection::ReadEndsSortingCollection(size_t memory_limit)
+: memory_limit(memory_limit)
+, count(0)
+, memory_position(0)
+, merging(false)
+{ }
+
+ReadEndsSortingCollection::~ReadEndsSortingCollection()
+{
+    clear();
+}
+
+void ReadEndsSortingCollection::spill()
+{
+    vector<ReadEnds> scratch;
+    ogeRadixSort<ReadEnds, 3>(ends_in_memory, scratch);
+
+    char filename[64];
+    sprintf(filename, "oge_ends_%d_%lx_%d.tmp", getpid(), (uintptr_t)this, (int)spill_files.size());
+
+    SpillFile file;
+    file.filename = TempDirectories::choose(ends_in_memory.size() * sizeof(ReadEnds)) + filename;
+    file.fp = fopen(file.filename.c_str(), "wb");
+    file.position = 0;
+    if(!file.fp || ends_in_memory.size() != fwrite(&ends_in_memory[0], sizeof(ReadEnds), ends_in_memory.size(), file.fp) || 0 != fclose(file.fp)) {
+        perror("Read ends temporary file write failed");
+        cerr << "Couldn't write to temporary file " << file.filename << ". Aborting." << endl;
+        exit(-1);
+    }
+    file.fp = NULL;
+    spill_files.push_back(file);
+
+    ends_in_memory.clear();
+}
+
+bool ReadEndsSortingCollection::SpillFile::fill()
+{
+    buffer.resize(SPILL_BUFFER_ENDS);
+    size_t read = fread(&buffer[0], sizeof(ReadEnds), SPILL_BUFFER_ENDS, fp);
+    buffer.resize(read);
+    position = 0;
+    return read > 0;
+}
+
+void ReadEndsSortingCollection::sort()
+{
+    vector<ReadEnds> scratch;
+    ogeRadixSort<ReadEnds, 3>(ends_in_memory, scratch);
+    memory_position = 0;
+
+    merging = !spill_files.empty();
+    if(!merging)
+        return;
+
+    // the ends in memory are the last source of the merge
+    merge.reset(spill_files.size() + 1);
+    for(size_t i = 0; i < spill_files.size(); i++) {
+        SpillFile & file = spill_files[i];
+        file.fp = fopen(file.filename.c_str(), "rb");
+        if(!file.fp) {
+            cerr << "Couldn't open temporary file " << file.filename << ". Aborting." << endl;
+            exit(-1);
+        }
+        if(file.fill())
+            merge.setItem(i, file.buffer[file.position++]);
+    }
+    if(!ends_in_memory.empty())
+        merge.setItem(spill_files.size(), ends_in_memory[memory_position++]);
+    merge.build();
+}
+
+bool ReadEndsSortingCollection::next(ReadEnds & ends)
+{
+    if(!merging) {
+        if(memory_position == ends_in_memory.size())
+            return false;
+        ends = ends_in_memory[memory_position++];
+        return true;
+    }
+
+    if(merge.empty())
+        return false;
+    ends = merge.top();
+
+    size_t source = merge.topSource();
+    if(source == spill_files.size()) {
+        if(memory_position < ends_in_memory.size())
+            merge.replaceTop(ends_in_memory[memory_position++]);
+        else
+            merge.popTop();
+    } else {
+        SpillFile & file = spill_files[source];
+        if(file.position < file.buffer.size() || file.fill())
+            merge.replaceTop(file.buffer[file.position++]);
+        else
+            merge.popTop();
+    }
+    return true;
+}
+
+void ReadEndsSortingCollection::clear()
+{
+    for(size_t i = 0; i < spill_files.size(); i++) {
+        if(spill_files[i].fp)
+            fclose(spill_files[i].fp);
+        remove(spill_files[i].filename.c_str());
+    }
+    spill_files.clear();
+    vector<ReadEnds>().swap(ends_in_memory);
+    merge.reset(0);
+    memory_position = 0;
+    count = 0;
+    merging = false;
+}
+
+// Slots in an empty table; it grows when more than 70% full.
+static const size_t MAP_INITIAL_SLOTS = 1024;
+
+static inline uint64_t mixHash(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hashKey(const char * key, size_t length)
+{
+    uint64_t h = length * 0x9e3779b97f4a7c15ULL;
+    for(; length >= 8; key += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, key, 8);
+        h = (h ^ mixHash(word)) * 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t word = 0;
+    memcpy(&word, key, length);
+    h = mixHash(h ^ word);
+
+    // zero marks empty slots
+    return h ? h : 1;
+}
+
+ReadEndsMap::ReadEndsMap()
+: used(0)
+, dead_key_bytes(0)
+, key_hash(0)
+, spill_by_sequence(false)
+, spill_memory(0)
+, spill_buffered(0)
+, current_sequence(-1)
+, spill_files(0)
+, spilled(0)
+, abandoned(0)
+{
+    slots.resize(MAP_INITIAL_SLOTS);
+}
+
+ReadEndsMap::~ReadEndsMap()
+{
+    clear();
+}
+
+void ReadEndsMap::setSpillBySequence(bool spill, size_t memory_limit)
+{
+    spill_by_sequence = spill;
+    spill_memory = memory_limit;
+}
+
+void ReadEndsMap::setKey(const char * read_group, size_t read_group_length, const char * name, size_t name_length)
+{
+    key.assign(read_group, read_group_length);
+    key.push_back(0);
+    key.append(name, name_length);
+    key_hash = hashKey(key.data(), key.size());
+}
+
+ReadEndsMap::Slot * ReadEndsMap::find(uint64_t hash)
+{
+    size_t mask = slots.size() - 1;
+    for(size_t i = hash & mask; slots[i].hash; i = (i + 1) & mask) {
+        Slot & slot = slots[i];
+        if(slot.hash == hash && slot.key_length == key.size() && !memcmp(&keys[slot.key_offset], key.data(), key.size()))
+            return &slot;
+    }
+    return NULL;
+}
+
+// Ends for a key that is already in the table replace the ones there.
+void ReadEndsMap::insert(uint64_t hash, const char * key, size_t key_length, const ReadEnds & ends)
+{
+    if((used + 1) * 10 > slots.size() * 7)
+        grow();
+
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    for(; slots[i].hash; i = (i + 1) & mask) {
+        Slot & slot = slots[i];
+        if(slot.hash == hash && slot.key_length == key_length && !memcmp(&keys[slot.key_offset], key, key_length)) {
+            slot.ends = ends;
+            return;
+        }
+    }
+
+    Slot & slot = slots[i];
+    slot.hash = hash;
+    slot.key_offset = keys.size();
+    slot.key_length = key_length;
+    slot.ends = ends;
+    keys.insert(keys.end(), key, key + key_length);
+    used++;
+}
+
+// Removes the slot, moving later slots of the same run back so that
+// lookups never need to skip deleted slots.
+void ReadEndsMap::erase(Slot * slot)
+{
+    size_t mask = slots.size() - 1;
+    size_t hole = slot - &slots[0];
+    dead_key_bytes += slot->key_length;
+    used--;
+
+    for(size_t i = (hole + 1) & mask; slots[i].hash; i = (i + 1) & mask) {
+        size_t home = slots[i].hash & mask;
+        // move the slot if its home isn't between the hole and it
+        bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if(!stays) {
+            slots[hole] = slots[i];
+            hole = i;
+        }
+    }
+    slots[hole].hash = 0;
+
+    if(used == 0) {
+        keys.clear();
+        dead_key_bytes = 0;
+    } else if(dead_key_bytes > keys.size() / 2 && dead_key_bytes > 1024 * 1024)
+        compactKeys();
+}
+
+void ReadEndsMap::grow()
+{
+    vector<Slot> old_slots(slots.size() * 2);
+    old_slots.swap(slots);
+
+    size_t mask = slots.size() - 1;
+    for(size_t j = 0; j < old_slots.size(); j++) {
+        if(!old_slots[j].hash)
+            continue;
+        size_t i = old_slots[j].hash & mask;
+        while(slots[i].hash)
+            i = (i + 1) & mask;
+        slots[i] = old_slots[j];
+    }
+}
+
+void ReadEndsMap::compactKeys()
+{
+    vector<char> live;
+    live.reserve(keys.size() - dead_key_bytes);
+    for(size_t i = 0; i < slots.size(); i++) {
+        if(!slots[i].hash)
+            continue;
+        const char * key = &keys[slots[i].key_offset];
+        slots[i].key_offset = live.size();
+        live.insert(live.end(), key, key + slots[i].key_length);
+    }
+    keys.swap(live);
+    dead_key_bytes = 0;
+}
+
+void ReadEndsMap::put(int sequence, const char * read_group, size_t read_group_length, const char * name, size_t name_length, const ReadEnds & ends)
+{
+    setKey(read_group, read_group_length, name, name_length);
+
+    if(spill_by_sequence && sequence != current_sequence) {
+        // the mate was on a sequence that has already been read
+        if(sequence < current_sequence)
+            abandoned++;
+        else
+            spill(sequence, ends);
+        return;
+    }
+
+    insert(key_hash, key.data(), key.size(), ends);
+}
+
+bool ReadEndsMap::remove(int sequence, const char * read_group, size_t read_group_length, const char * name, size_t name_length, ReadEnds & ends)
+{
+    if(spill_by_sequence && sequence != current_sequence)
+        startSequence(sequence);
+
+    setKey(read_group, read_group_length, name, name_length);
+    Slot * slot = find(key_hash);
+    if(!slot)
+        return false;
+    ends = slot->ends;
+    erase(slot);
+    return true;
+}
+
+void ReadEndsMap::spill(int sequence, const ReadEnds & ends)
+{
+    SequenceSpill & s = spills[sequence];
+    uint32_t key_length = key.size();
+    const char * length_bytes = (const char *) &key_length;
+    s.buffer.insert(s.buffer.end(), length_bytes, length_bytes + sizeof(key_length));
+    s.buffer.insert(s.buffer.end(), key.begin(), key.end());
+    s.buffer.insert(s.buffer.end(), (const char *) &ends, (const char *) &ends + sizeof(ReadEnds));
+    s.count++;
+    spilled++;
+
+    spill_buffered += sizeof(key_length) + key.size() + sizeof(ReadEnds);
+    if(spill_buffered > spill_memory)
+        writeSpills();
+}
+
+// Appends each sequence's buffered ends to its file. Files are closed in
+// between, so that there is never more than one open.
+void ReadEndsMap::writeSpills()
+{
+    for(map<int, SequenceSpill>::iterator i = spills.begin(); i != spills.end(); i++) {
+        SequenceSpill & s = i->second;
+        if(s.buffer.empty())
+            continue;
+
+        if(s.filename.empty()) {
+            char filename[64];
+            sprintf(filename, "oge_mates_%d_%lx_%d.tmp", getpid(), (uintptr_t)this, i->first);
+            s.filename = TempDirectories::choose(s.buffer.size()) + filename;
+            spill_files++;
+        }
+
+        FILE * fp = fopen(s.filename.c_str(), "ab");
+        if(!fp || 1 != fwrite(&s.buffer[0], s.buffer.size(), 1, fp) || 0 != fclose(fp)) {
+            perror("Unmatched ends temporary file write failed");
+            cerr << "Couldn't write to temporary file " << s.filename << ". Aborting." << endl;
+            exit(-1);
+        }
+        vector<char>().swap(s.buffer);
+    }
+    spill_buffered = 0;
+}
+
+// Moves on to reading sequence. Ends still in the table can't be matched any
+// more; ends whose mates are on it are loaded.
+void ReadEndsMap::startSequence(int sequence)
+{
+    if(sequence < current_sequence) {
+        cerr << "Reads are not sorted by coordinate (sequence " << sequence << " after " << current_sequence << "). Aborting." << endl;
+        exit(-1);
+    }
+
+    abandoned += used;
+    for(size_t i = 0; i < slots.size(); i++)
+        slots[i].hash = 0;
+    used = 0;
+    keys.clear();
+    dead_key_bytes = 0;
+    current_sequence = sequence;
+
+    while(!spills.empty() && spills.begin()->first <= sequence) {
+        SequenceSpill & s = spills.begin()->second;
+        spilled -= s.count;
+        spill_buffered -= s.buffer.size();
+
+        if(spills.begin()->first < sequence)
+            abandoned += s.count;
+        else {
+            if(!s.filename.empty()) {
+                FILE * fp = fopen(s.filename.c_str(), "rb");
+                if(!fp) {
+                    cerr << "Couldn't open temporary file " << s.filename << ". Aborting." << endl;
+                    exit(-1);
+                }
+                vector<char> data;
+                char block[64 * 1024];
+                size_t read;
+                while((read = fread(block, 1, sizeof(block), fp)) > 0)
+                    data.insert(data.end(), block, block + read);
+                fclose(fp);
+                loadSpill(&data[0], data.size(), s.filename);
+            }
+            loadSpill(s.buffer.empty() ? NULL : &s.buffer[0], s.buffer.size(), "memory");
+        }
+
+        if(!s.filename.empty())
+            ::remove(s.filename.c_str());
+        spills.erase(spills.begin());
+    }
+}
+
+void ReadEndsMap::loadSpill(const char * data, size_t length, const string & source)
+{
+    const char * end = data + length;
+    while(data < end) {
+        uint32_t key_length;
+        if(end - data < (ptrdiff_t) sizeof(key_length)) {
+            cerr << "Temporary file " << source << " is corrupt. Aborting." << endl;
+            exit(-1);
+        }
+        memcpy(&key_length, data, sizeof(key_length));
+        data += sizeof(key_length);
+        if((size_t)(end - data) < key_length + sizeof(ReadEnds)) {
+            cerr << "Temporary file " << source << " is corrupt. Aborting." << endl;
+            exit(-1);
+        }
+
+        ReadEnds ends;
+        memcpy(&ends, data + key_length, sizeof(ReadEnds));
+        insert(hashKey(data, key_length), data, key_length, ends);
+        data += key_length + sizeof(ReadEnds);
+    }
+}
+
+void ReadEndsMap::clear()
+{
+    for(map<int, SequenceSpill>::iterator i = spills.begin(); i != spills.end(); i++)
+        if(!i->second.filename.empty())
+            ::remove(i->second.filename.c_str());
+    spills.clear();
+
+    vector<Slot>(MAP_INITIAL_SLOTS).swap(slots);
+    vector<char>().swap(keys);
+    used = 0;
+    dead_key_bytes = 0;
+    spill_buffered = 0;
+    current_sequence = -1;
+    spill_files = 0;
+    spilled = 0;
+    abandoned = 0;
+}
@@ -17,95 +17,262 @@
  *
  *********************************************************************/
 
+#include <stdint.h>
+#include <stdio.h>
 #include <map>
+#include <string>
 #include <vector>
 #include <iostream>
 
+#include "loser_tree.h"
+
 typedef enum
 {
     RE_NONE, RE_F, RE_R, RE_FF, RE_RR, RE_FR, RE_RF
 } readends_orientation_t;
 
+// Picard's ReadEnds, packed into 32 bytes so that millions of them can be
+// stored and sorted by value. The fields are stored in three 64 bit words in
+// the order they are compared, with the sign bits of signed fields flipped,
+// so the words are also the sort key:
+//
+//     key[0]  libraryId:16 read1Sequence:32 read1Coordinate:16 (high bits)
+//     key[1]  read1Coordinate:16 orientation:8 read2Sequence:32 read2Coordinate:8 (high bits)
+//     key[2]  read2Coordinate:24 read1IndexInFile:40
+//     extra   score:16 unused:8 read2IndexInFile:40
+//
+// Indices in the file are limited to 40 bits (about 10^12 reads).
 class ReadEnds{
 public:
-    
-    short libraryId;
-    short score;
-    readends_orientation_t orientation;
-    int read1Sequence;
-    int read1Coordinate;
-    long read1IndexInFile;
-    int read2Sequence;
-    int read2Coordinate;
-    long read2IndexInFile;
-    
+    uint64_t key[3];
+    uint64_t extra;
+
     ReadEnds()
-    : libraryId(-1)
-    , score(-1)
-    , orientation(RE_NONE)
-    , read1Sequence(-1)
-    , read1Coordinate(-1)
-    , read1IndexInFile(-1)
-    , read2Sequence(-1)
-    , read2Coordinate(-1)
-    , read2IndexInFile(-1)
-    {}
-    
-    bool isPaired() { return read2Sequence != -1; }
+    {
+        key[0] = key[1] = key[2] = extra = 0;
+        setLibraryId(-1);
+        setScore(-1);
+        setOrientation(RE_NONE);
+        setRead1Sequence(-1);
+        setRead1Coordinate(-1);
+        setRead1IndexInFile(-1);
+        setRead2Sequence(-1);
+        setRead2Coordinate(-1);
+        setRead2IndexInFile(-1);
+    }
+
+    short getLibraryId() const { return (short)(getBits(key[0], 48, 16) ^ 0x8000); }
+    void setLibraryId(short id) { setBits(key[0], 48, 16, (uint16_t)id ^ 0x8000); }
+
+    short getScore() const { return (short)getBits(extra, 48, 16); }
+    void setScore(short score) { setBits(extra, 48, 16, (uint16_t)score); }
+
+    readends_orientation_t getOrientation() const { return (readends_orientation_t)getBits(key[1], 40, 8); }
+    void setOrientation(readends_orientation_t orientation) { setBits(key[1], 40, 8, orientation); }
+
+    int getRead1Sequence() const { return (int)(getBits(key[0], 16, 32) ^ 0x80000000U); }
+    void setRead1Sequence(int sequence) { setBits(key[0], 16, 32, (uint32_t)sequence ^ 0x80000000U); }
+
+    int getRead1Coordinate() const { return (int)(((getBits(key[0], 0, 16) << 16) | getBits(key[1], 48, 16)) ^ 0x80000000U); }
+    void setRead1Coordinate(int coordinate) {
+        uint32_t flipped = (uint32_t)coordinate ^ 0x80000000U;
+        setBits(key[0], 0, 16, flipped >> 16);
+        setBits(key[1], 48, 16, flipped & 0xffff);
+    }
+
+    int getRead2Sequence() const { return (int)(getBits(key[1], 8, 32) ^ 0x80000000U); }
+    void setRead2Sequence(int sequence) { setBits(key[1], 8, 32, (uint32_t)sequence ^ 0x80000000U); }
+
+    int getRead2Coordinate() const { return (int)(((getBits(key[1], 0, 8) << 24) | getBits(key[2], 40, 24)) ^ 0x80000000U); }
+    void setRead2Coordinate(int coordinate) {
+        uint32_t flipped = (uint32_t)coordinate ^ 0x80000000U;
+        setBits(key[1], 0, 8, flipped >> 24);
+        setBits(key[2], 40, 24, flipped & 0xffffff);
+    }
+
+    int64_t getRead1IndexInFile() const { return getIndex(key[2]); }
+    void setRead1IndexInFile(int64_t index) { setIndex(key[2], index); }
+
+    int64_t getRead2IndexInFile() const { return getIndex(extra); }
+    void setRead2IndexInFile(int64_t index) { setIndex(extra, index); }
+
+    bool isPaired() const { return getRead2Sequence() != -1; }
+
+    // Pairs kept for counting optical duplicates hold the read group and tile
+    // of their location in place of read 1's index, and x and y in extra.
+    uint64_t getLocationTile() const { return key[2] & INDEX_MASK; }
+    uint64_t getLocationXY() const { return extra; }
+    void setLocation(uint64_t tile, uint64_t xy) {
+        key[2] = (key[2] & ~INDEX_MASK) | (tile & INDEX_MASK);
+        extra = xy;
+    }
     
     static int compare(const ReadEnds & lhs, const ReadEnds & rhs) {
-        int retval = 0;
-        if (retval == 0) retval = lhs.libraryId - rhs.libraryId;
-        if (retval == 0) retval = lhs.read1Sequence - rhs.read1Sequence;
-        if (retval == 0) retval = lhs.read1Coordinate - rhs.read1Coordinate;
-        if (retval == 0) retval = lhs.orientation - rhs.orientation;
-        if (retval == 0) retval = lhs.read2Sequence   - rhs.read2Sequence;
-        if (retval == 0) retval = lhs.read2Coordinate - rhs.read2Coordinate;
-        if (retval == 0) retval = (int) (lhs.read1IndexInFile - rhs.read1IndexInFile);
-        if (retval == 0) retval = (int) (lhs.read2IndexInFile - rhs.read2IndexInFile);
-        
-        return retval;
+        for(int w = 0; w < 3; w++)
+            if(lhs.key[w] != rhs.key[w])
+                return lhs.key[w] < rhs.key[w] ? -1 : 1;
+        return 0;
     }
     
     bool operator<(const ReadEnds & a) const
     {
         return 0 > compare(*this, a);
     }
+
+protected:
+    static const uint64_t INDEX_MASK = (((uint64_t)1) << 40) - 1;
+
+    static uint64_t getBits(uint64_t word, int shift, int bits) { return (word >> shift) & ((((uint64_t)1) << bits) - 1); }
+    static void setBits(uint64_t & word, int shift, int bits, uint64_t value) {
+        uint64_t mask = ((((uint64_t)1) << bits) - 1) << shift;
+        word = (word & ~mask) | ((value << shift) & mask);
+    }
+
+    static int64_t getIndex(uint64_t word) {
+        uint64_t index = word & INDEX_MASK;
+        return index == INDEX_MASK ? -1 : (int64_t)index;
+    }
+    static void setIndex(uint64_t & word, int64_t index) { word = (word & ~INDEX_MASK) | ((uint64_t)index & INDEX_MASK); }
 };
 std::ostream& operator<< (std::ostream& out, const ReadEnds & re );
 
 struct compareReadEnds {
-    bool operator ()(const ReadEnds *lhs, const ReadEnds *rhs) { return *lhs < *rhs; }
-    bool operator ()(const ReadEnds & lhs, const ReadEnds & rhs) { return lhs < rhs; }
+    bool operator ()(const ReadEnds *lhs, const ReadEnds *rhs) const { return *lhs < *rhs; }
+    bool operator ()(const ReadEnds & lhs, const ReadEnds & rhs) const { return lhs < rhs; }
 };
 
-class ReadEndsMap
+// Picard's SortingCollection for ReadEnds. Ends are added until they fill
+// the memory limit, then sorted and written to a temporary file, so that
+// the ends of any number of reads can be sorted in bounded memory. Once
+// all ends have been added, sort() sorts the ends still in memory, and
+// next() returns all the ends in order, merging the temporary files.
+class ReadEndsSortingCollection
 {
-protected:
-    std::map<std::string, ReadEnds *> m;
 public:
-    void put(int index, std::string key, ReadEnds * val) {
-        m[key] = val;
-    }
-    
-    ReadEnds * remove(int index, std::string key)
-    {
-        ReadEnds * ret = m[key];
-        m.erase(key);
-        return ret;
+    ReadEndsSortingCollection(size_t memory_limit = 0);
+    ~ReadEndsSortingCollection();
+
+    void setMemoryLimit(size_t memory_limit) { this->memory_limit = memory_limit; }
+
+    void add(const ReadEnds & ends) {
+        if(memory_limit && !ends_in_memory.empty() && (ends_in_memory.size() + 1) * sizeof(ReadEnds) > memory_limit)
+            spill();
+        ends_in_memory.push_back(ends);
+        count++;
     }
+
+    uint64_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t spilledFiles() const { return spill_files.size(); }
+
+    // Ends the adding of ends, and prepares for next().
+    void sort();
+    bool next(ReadEnds & ends);
+
+    // Frees memory and removes temporary files.
+    void clear();
+
+protected:
+    // A sorted temporary file being merged.
+    struct SpillFile {
+        std::string filename;
+        FILE * fp;
+        std::vector<ReadEnds> buffer;
+        size_t position;
+
+        bool fill();
+    };
+
+    void spill();
+
+    size_t memory_limit;
+    uint64_t count;
+    std::vector<ReadEnds> ends_in_memory;
+    size_t memory_position;
+    std::vector<SpillFile> spill_files;
+    LoserTree<ReadEnds, compareReadEnds> merge;
+    bool merging;
+};
+
+// Ends of pairs whose first read has been seen, waiting for the mate. Keyed
+// by read group and name, in an open addressing hash table: each lookup
+// hashes the key once, and only compares keys whose 64 bit hashes match.
+// Keys are stored in one buffer, so an entry doesn't allocate memory.
+//
+// For coordinate sorted input, ends can be spilled by the sequence their
+// mate is on, as Picard does: only ends whose mate is on the sequence
+// being read are kept in the table, and ends for later sequences are
+// buffered, then written to a temporary file per sequence, and loaded
+// when that sequence is reached.
+class ReadEndsMap
+{
+public:
+    ReadEndsMap();
+    ~ReadEndsMap();
+
+    // Spill ends for other sequences, keeping up to memory_limit bytes of
+    // them in memory. Only for coordinate sorted input.
+    void setSpillBySequence(bool spill, size_t memory_limit);
+
+    // sequence is the one the mate will be read from.
+    void put(int sequence, const char * read_group, size_t read_group_length, const char * name, size_t name_length, const ReadEnds & ends);
     
-    size_t size() { return m.size();};
+    // Returns false if there are no ends for the key. sequence is the one
+    // being read.
+    bool remove(int sequence, const char * read_group, size_t read_group_length, const char * name, size_t name_length, ReadEnds & ends);
     
-    std::vector<ReadEnds *> allReadEnds()
-    {
-        std::vector<ReadEnds *> ret;
-        ret.reserve(m.size());
-        for(std::map<std::string, ReadEnds *>::iterator i = m.begin(); i != m.end(); i++)
-            ret.push_back(i->second);
-        return ret;
-    }
+    // Ends that haven't been matched, including those that can no longer be.
+    uint64_t size() const { return used + spilled + abandoned; }
+    size_t spilledFiles() const { return spill_files; }
     
+    void clear();
+
+protected:
+    struct Slot {
+        uint64_t hash;          // 0 if empty
+        uint64_t key_offset;
+        uint32_t key_length;
+        ReadEnds ends;
+
+        Slot() : hash(0), key_offset(0), key_length(0) {}
+    };
+
+    // Ends for one sequence, waiting for it to be read.
+    struct SequenceSpill {
+        std::vector<char> buffer;   // records not yet written to the file
+        std::string filename;
+        uint64_t count;
+
+        SequenceSpill() : count(0) {}
+    };
+
+    void setKey(const char * read_group, size_t read_group_length, const char * name, size_t name_length);
+    Slot * find(uint64_t hash);
+    void insert(uint64_t hash, const char * key, size_t key_length, const ReadEnds & ends);
+    void erase(Slot * slot);
+    void grow();
+    void compactKeys();
+
+    void spill(int sequence, const ReadEnds & ends);
+    void writeSpills();
+    void startSequence(int sequence);
+    void loadSpill(const char * data, size_t length, const std::string & source);
+
+    std::vector<Slot> slots;
+    size_t used;
+    std::vector<char> keys;
+    size_t dead_key_bytes;
+    std::string key;            // the key being looked up
+    uint64_t key_hash;
+
+    bool spill_by_sequence;
+    size_t spill_memory;
+    size_t spill_buffered;
+    int current_sequence;
+    std::map<int, SequenceSpill> spills;
+    size_t spill_files;
+    uint64_t spilled;
+    uint64_t abandoned;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,160 @@
+/*********************************************************************
+ *
+ * queue_budget.cpp: Memory limits for queues between processing stages.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "queue_budget.h"
+
+#include <sys/time.h>
+#include <cstdio>
+
+using namespace std;
+
+size_t QueueBudget::default_limit = QUEUE_DEFAULT_MEMORY;
+Spinlock QueueBudget::registry_lock;
+vector<QueueBudget *> QueueBudget::live_budgets;
+vector<QueueBudget::Statistics> QueueBudget::retired_statistics;
+
+QueueBudget::QueueBudget(const string & name)
+: used(0)
+, limit(0)
+, closed(false)
+, producer_waiting(0)
+{
+    stats.name = name;
+
+    registry_lock.lock();
+    live_budgets.push_back(this);
+    registry_lock.unlock();
+}
+
+QueueBudget::~QueueBudget()
+{
+    stats.limit = getLimit();
+
+    registry_lock.lock();
+    live_budgets.erase(std::remove(live_budgets.begin(), live_budgets.end(), this), live_budgets.end());
+    if(stats.items)
+        retired_statistics.push_back(stats);
+    registry_lock.unlock();
+}
+
+bool QueueBudget::acquire(size_t bytes, size_t items)
+{
+    if(!fits(bytes) && !closed) {
+        timeval start, end;
+        gettimeofday(&start, NULL);
+
+        // Same handshake as SpscRing: either release() sees producer_waiting,
+        // or we see the space it freed before going to sleep.
+        wait_lock.lock();
+        producer_waiting = 1;
+        __sync_synchronize();
+        while(!fits(bytes) && !closed)
+            wait_cv.wait(wait_lock);
+        producer_waiting = 0;
+        wait_lock.unlock();
+
+        gettimeofday(&end, NULL);
+        stats.stalls++;
+        stats.stall_usec += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+    }
+
+    if(closed)
+        return false;
+
+    charge(bytes, items);
+    return true;
+}
+
+bool QueueBudget::tryAcquire(size_t bytes, size_t items)
+{
+    if(closed || !fits(bytes))
+        return false;
+
+    charge(bytes, items);
+    return true;
+}
+
+void QueueBudget::charge(size_t bytes, size_t items)
+{
+    size_t now = __sync_add_and_fetch(&used, bytes);
+
+    stats.items += items;
+    stats.bytes += bytes;
+    stats.samples++;
+    stats.occupancy_sum += now;
+    if(now > stats.peak)
+        stats.peak = now;
+}
+
+void QueueBudget::release(size_t bytes)
+{
+    __sync_sub_and_fetch(&used, bytes);
+
+    __sync_synchronize();
+    if(producer_waiting) {
+        wait_lock.lock();
+        wait_cv.notify_all();
+        wait_lock.unlock();
+    }
+}
+
+void QueueBudget::close()
+{
+    wait_lock.lock();
+    closed = true;
+    wait_cv.notify_all();
+    wait_lock.unlock();
+}
+
+void QueueBudget::reset()
+{
+    wait_lock.lock();
+    closed = false;
+    used = 0;
+    wait_lock.unlock();
+}
+
+void QueueBudget::printStatistics(ostream & out, const Statistics & s)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "  %-40s %10llu items, %8.1f MB, peak %6zu KB, mean %6llu KB of %zu KB, %llu stalls (%.3fs)",
+             s.name.c_str(),
+             (unsigned long long) s.items,
+             s.bytes / (1024. * 1024.),
+             s.peak / 1024,
+             (unsigned long long) (s.samples ? s.occupancy_sum / s.samples / 1024 : 0),
+             s.limit / 1024,
+             (unsigned long long) s.stalls,
+             s.stall_usec * 1.e-6);
+    out << line << endl;
+}
+
+void QueueBudget::printStatistics(ostream & out)
+{
+    registry_lock.lock();
+    vector<Statistics> all = retired_statistics;
+    for(size_t i = 0; i < live_budgets.size(); i++) {
+        if(!live_budgets[i]->stats.items)
+            continue;
+        all.push_back(live_budgets[i]->stats);
+        all.back().limit = live_budgets[i]->getLimit();
+    }
+    registry_lock.unlock();
+
+    if(all.empty())
+        return;
+
+    out << "Queue memory (" << default_limit / 1024 << " KB per queue):" << endl;
+    for(size_t i = 0; i < all.size(); i++)
+        printStatistics(out, all[i]);
+}
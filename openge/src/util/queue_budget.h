@@ -0,0 +1,103 @@
+#ifndef OGE_QUEUE_BUDGET_H
+#define OGE_QUEUE_BUDGET_H
+
+/*********************************************************************
+ *
+ * queue_budget.h: Memory limits for queues between processing stages.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Each queue between two stages (BGZF read-ahead, read caches, and
+ * the edges between algorithm modules) has a budget counting the
+ * bytes currently held in it. Producers charge the budget for every
+ * item they queue, and block (or stop reading ahead) once the budget
+ * is spent. Consumers release the bytes as they take items off the
+ * queue. An empty queue always accepts an item, so items larger than
+ * the budget can't deadlock a chain.
+ *
+ * All budgets share a default limit, set with --queue-mem. Usage of
+ * each budget is recorded, and reported by printStatistics().
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "thread_pool.h"
+
+// Default number of bytes each queue may hold.
+const size_t QUEUE_DEFAULT_MEMORY = 4 * 1024 * 1024;
+
+class QueueBudget {
+public:
+    QueueBudget(const std::string & name = "queue");
+    ~QueueBudget();
+
+    void setName(const std::string & name) { stats.name = name; }
+    const std::string & getName() const { return stats.name; }
+
+    // A limit of zero follows the global default.
+    void setLimit(size_t bytes) { limit = bytes; }
+    size_t getLimit() const { return limit ? limit : default_limit; }
+
+    size_t bytesQueued() const { return used; }
+    bool isFull() const { return used >= getLimit(); }
+
+    // Producer side. acquire() blocks until the bytes fit in the budget, and
+    // returns false if the budget was closed while waiting. tryAcquire() never
+    // blocks. charge() accounts for an item that is queued regardless.
+    bool acquire(size_t bytes, size_t items = 1);
+    bool tryAcquire(size_t bytes, size_t items = 1);
+    void charge(size_t bytes, size_t items = 1);
+
+    // Consumer side.
+    void release(size_t bytes);
+
+    // Wake and fail any blocked producer. reset() empties and reopens the budget.
+    void close();
+    void reset();
+
+    static void setDefaultLimit(size_t bytes) { default_limit = std::max(bytes, (size_t)1); }
+    static size_t getDefaultLimit() { return default_limit; }
+
+    // Report the usage of every budget that has had any traffic.
+    static void printStatistics(std::ostream & out);
+
+protected:
+    bool fits(size_t bytes) const { return used == 0 || used + bytes <= getLimit(); }
+
+    struct Statistics {
+        Statistics() : items(0), bytes(0), samples(0), occupancy_sum(0), peak(0), limit(0), stalls(0), stall_usec(0) {}
+        std::string name;
+        uint64_t items, bytes;
+        uint64_t samples, occupancy_sum;    // queue size seen by each charge
+        size_t peak, limit;
+        uint64_t stalls, stall_usec;        // time producers spent blocked
+    };
+    static void printStatistics(std::ostream & out, const Statistics & s);
+
+    Statistics stats;
+    volatile size_t used;
+    size_t limit;
+    volatile bool closed;
+    volatile int producer_waiting;
+    mutex wait_lock;
+    condition_variable wait_cv;
+
+    static size_t default_limit;
+    static Spinlock registry_lock;
+    static std::vector<QueueBudget *> live_budgets;
+    static std::vector<Statistics> retired_statistics;
+};
+
+#endif
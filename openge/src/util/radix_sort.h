@@ -0,0 +1,86 @@
+#ifndef OGE_RADIX_SORT_H
+#define OGE_RADIX_SORT_H
+
+/*********************************************************************
+ *
+ * radix_sort.h: LSD radix sort on fixed size integer keys.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Sorting pointers to reads with a comparison function is dominated by
+ * cache misses, as every comparison dereferences two reads scattered
+ * around the heap. Instead, a key can be extracted from each read
+ * once into a contiguous array of records, and the records sorted by
+ * key with a radix sort, which never calls a comparison function.
+ *
+ * Records must contain a member "uint64_t key[key_words]", most
+ * significant word first. The sort is stable, so records with equal
+ * keys keep their order.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+template <class record_t, int key_words>
+void ogeRadixSort(std::vector<record_t> & records, std::vector<record_t> & scratch)
+{
+    const size_t n = records.size();
+    const int digits = key_words * 8;
+
+    if(n < 2)
+        return;
+
+    // Count every byte of every key in a single pass. Bytes that are the
+    // same in every key (high bits of small numbers, shared name prefixes)
+    // don't need a pass of their own.
+    std::vector<size_t> counts(digits * 256, 0);
+    for(size_t i = 0; i < n; i++) {
+        for(int w = 0; w < key_words; w++) {
+            uint64_t k = records[i].key[w];
+            size_t * word_counts = &counts[w * 8 * 256];
+            for(int b = 0; b < 8; b++, k >>= 8)
+                word_counts[b * 256 + (k & 0xff)]++;
+        }
+    }
+
+    scratch.resize(n);
+    record_t * src = &records[0];
+    record_t * dst = &scratch[0];
+
+    // least significant byte of the least significant word first
+    for(int w = key_words - 1; w >= 0; w--) {
+        for(int b = 0; b < 8; b++) {
+            size_t * digit_counts = &counts[(w * 8 + b) * 256];
+            const int shift = b * 8;
+
+            if(digit_counts[(src[0].key[w] >> shift) & 0xff] == n)
+                continue;
+
+            size_t offsets[256];
+            size_t total = 0;
+            for(int d = 0; d < 256; d++) {
+                offsets[d] = total;
+                total += digit_counts[d];
+            }
+
+            for(size_t i = 0; i < n; i++)
+                dst[offsets[(src[i].key[w] >> shift) & 0xff]++] = src[i];
+
+            std::swap(src, dst);
+        }
+    }
+
+    if(src != &records[0])
+        records.swap(scratch);
+}
+
+#endif
@@ -0,0 +1,341 @@
+/*********************************************************************
+ *
+ * read_key_order.cpp: Sort orders defined by keys extracted from reads.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "read_key_order.h"
+#include "read_sort_keys.h"
+
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+
+using namespace std;
+
+uint64_t ReadKeyOrder::keyPrefix(const string & key, size_t offset)
+{
+    uint64_t prefix = 0;
+    for(size_t c = offset; c < offset + 8; c++)
+        prefix = (prefix << 8) | (c < key.size() ? (uint8_t)key[c] : 0);
+    return prefix;
+}
+
+void ReadKeyOrder::appendUInt32(string & key, uint32_t value)
+{
+    char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+    key.append(bytes, 4);
+}
+
+void ReadKeyOrder::appendDouble(string & key, double value)
+{
+    if(value == 0)
+        value = 0;  // -0 equals 0
+    // flip all bits of negative numbers, and the sign of positive ones
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = (bits >> 63) ? ~bits : bits | ((uint64_t)1 << 63);
+    appendUInt32(key, (uint32_t)(bits >> 32));
+    appendUInt32(key, (uint32_t)bits);
+}
+
+void ReadKeyOrder::appendString(string & key, const char * value, size_t length)
+{
+    key.append(value, length);
+    key.push_back(0);
+}
+
+void ReadKeyOrder::appendName(string & key, const OGERead & read, name_order_t order)
+{
+    const char * name = read.getBamEncodedStringData().c_str();
+    uint16_t flag = read.getAlignmentFlag();
+
+    if(order != NAME_ORDER_NATURAL) {
+        appendString(key, name, strlen(name));
+        if(order == NAME_ORDER_PICARD) {
+            // same flags as ReadNameLess; paired and first mate come first when set
+            static const uint16_t picard_flags[] = {0x1, 0x40, 0x80, 0x10, 0x100, 0x800};
+            for(size_t i = 0; i < sizeof(picard_flags) / sizeof(picard_flags[0]); i++) {
+                uint16_t bit = picard_flags[i];
+                bool set = (flag & bit) != 0;
+                key.push_back((bit == 0x1 || bit == 0x40) ? !set : set);
+            }
+        }
+        return;
+    }
+
+    // As ogeNaturalNameCompare: a run of digits sorts among other characters
+    // as a digit would, then by its length without leading zeros, its digits,
+    // and then more leading zeros first. No byte of the key is 0 until the
+    // end, as names are at most 254 characters.
+    const unsigned char * p = (const unsigned char *) name;
+    while(*p) {
+        if(!isdigit(*p)) {
+            key.push_back(*p++);
+            continue;
+        }
+        const unsigned char * run = p;
+        while(*p == '0') ++p;
+        const unsigned char * digits = p;
+        while(isdigit(*p)) ++p;
+        key.push_back('0');
+        key.push_back((char)(p - digits + 1));
+        key.append((const char *) digits, p - digits);
+        key.push_back((char)(0xff - (digits - run)));
+    }
+    key.push_back(0);
+    key.push_back((char)((flag & 0xc0) >> 6));
+}
+
+const char * ReadKeyOrder::findTag(const OGERead & read, const char * tag)
+{
+    const string & data = read.getBamEncodedStringData();
+    size_t offset = read.getNameLength() + 4 * read.getNumCigarOps() + (read.getLength() + 1) / 2 + read.getLength();
+    const char * p = data.data() + offset;
+    const char * end = data.data() + data.size();
+
+    while(p + 3 <= end) {
+        if(p[0] == tag[0] && p[1] == tag[1])
+            return p + 2;
+
+        char type = p[2];
+        p += 3;
+        switch(type) {
+            case 'A': case 'c': case 'C': p += 1; break;
+            case 's': case 'S': p += 2; break;
+            case 'i': case 'I': case 'f': p += 4; break;
+            case 'Z': case 'H': {
+                const char * value_end = (const char *) memchr(p, 0, end - p);
+                if(!value_end)
+                    return NULL;
+                p = value_end + 1;
+                break;
+            }
+            case 'B': {
+                if(p + 5 > end)
+                    return NULL;
+                uint32_t count;
+                memcpy(&count, p + 1, 4);
+                size_t element = (p[0] == 'c' || p[0] == 'C') ? 1 : (p[0] == 's' || p[0] == 'S') ? 2 : 4;
+                p += 5 + element * count;
+                break;
+            }
+            default:
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Tag values as integers, if they are integers.
+static bool tagInteger(const char * value, int64_t & out)
+{
+    const char * p = value + 1;
+    switch(*value) {
+        case 'c': out = *(const int8_t *) p; return true;
+        case 'C': out = *(const uint8_t *) p; return true;
+        case 's': { int16_t v; memcpy(&v, p, 2); out = v; return true; }
+        case 'S': { uint16_t v; memcpy(&v, p, 2); out = v; return true; }
+        case 'i': { int32_t v; memcpy(&v, p, 4); out = v; return true; }
+        case 'I': { uint32_t v; memcpy(&v, p, 4); out = v; return true; }
+        default: return false;
+    }
+}
+
+static size_t tagLength(const char * value)
+{
+    switch(*value) {
+        case 'A': return 1;
+        case 'Z': case 'H': return strlen(value + 1);
+        case 'B': {
+            uint32_t count;
+            memcpy(&count, value + 2, 4);
+            size_t element = (value[1] == 'c' || value[1] == 'C') ? 1 : (value[1] == 's' || value[1] == 'S') ? 2 : 4;
+            return 5 + element * count;
+        }
+        default: return 0;
+    }
+}
+
+TagKeyOrder::TagKeyOrder(const vector<string> & tags, bool then_by_name, name_order_t name_order)
+: tags(tags)
+, then_by_name(then_by_name)
+, name_order(name_order)
+{ }
+
+void TagKeyOrder::appendKey(const OGERead & read, string & key) const
+{
+    for(vector<string>::const_iterator tag = tags.begin(); tag != tags.end(); tag++) {
+        const char * value = findTag(read, tag->c_str());
+        int64_t integer;
+        if(!value)
+            key.push_back(0);
+        else if(tagInteger(value, integer)) {
+            // every 32 bit integer is exact as a double
+            key.push_back(1);
+            appendDouble(key, (double)integer);
+        } else if(*value == 'f') {
+            float f;
+            memcpy(&f, value + 1, 4);
+            key.push_back(1);
+            appendDouble(key, f);
+        } else {
+            key.push_back(2);
+            appendString(key, value + 1, tagLength(value));
+        }
+    }
+
+    if(then_by_name) {
+        appendName(key, read, name_order);
+        return;
+    }
+
+    const char * name = read.getBamEncodedStringData().c_str();
+
+    uint64_t position = ogeReadPositionKey(read);
+    appendUInt32(key, (uint32_t)(position >> 32));
+    appendUInt32(key, (uint32_t)position);
+    if(position != OGE_POSITION_KEY_UNMAPPED) {
+        appendString(key, name, strlen(name));
+        key.push_back((char)(read.getAlignmentFlag() >> 8));
+        key.push_back((char)read.getAlignmentFlag());
+    }
+}
+
+void TagKeyOrder::setHeader(BamHeader & header) const
+{
+    header.setSortOrder(BamHeader::SORT_UNSORTED);
+    header.setGroupOrder("");
+    string sub_sort = "unsorted";
+    for(vector<string>::const_iterator tag = tags.begin(); tag != tags.end(); tag++)
+        sub_sort += ":" + *tag;
+    header.setSubSort(sub_sort);
+}
+
+TemplateCoordinateKeyOrder::TemplateCoordinateKeyOrder(const BamHeader & header)
+{
+    const BamReadGroupRecords & read_groups = header.getReadGroups();
+    for(BamReadGroupRecords::const_iterator i = read_groups.begin(); i != read_groups.end(); i++)
+        libraries[i->getId()] = i->getLibrary();
+}
+
+// Clips at the start and end of a CIGAR, and the reference bases it covers.
+struct CigarExtent {
+    int32_t leading_clips, trailing_clips, reference_length;
+
+    CigarExtent() : leading_clips(0), trailing_clips(0), reference_length(0) {}
+
+    void add(char op, int32_t length) {
+        switch(op) {
+            case 'S': case 'H':
+                if(reference_length == 0 && trailing_clips == 0)
+                    leading_clips += length;
+                else
+                    trailing_clips += length;
+                break;
+            case 'M': case 'D': case 'N': case '=': case 'X':
+                reference_length += length;
+                trailing_clips = 0;
+                break;
+            default:
+                break;
+        }
+    }
+
+    int32_t unclippedFivePrime(int32_t position, bool reverse) const {
+        if(reverse)
+            return position + max(reference_length, 1) - 1 + trailing_clips;
+        return position - leading_clips;
+    }
+};
+
+void TemplateCoordinateKeyOrder::appendKey(const OGERead & read, string & key) const
+{
+    int32_t tid1 = INT_MAX, tid2 = INT_MAX, pos1 = INT_MAX, pos2 = INT_MAX;
+    bool neg1 = false, neg2 = false, upper = false;
+
+    if(read.getRefID() >= 0) {
+        static const char cigar_ops[] = "MIDNSHP=X";
+        CigarExtent extent;
+        const char * cigar = read.getBamEncodedStringData().data() + read.getNameLength();
+        for(uint32_t i = 0; i < read.getNumCigarOps(); i++) {
+            uint32_t op;
+            memcpy(&op, cigar + 4 * i, 4);
+            extent.add((op & 0xf) < 9 ? cigar_ops[op & 0xf] : '?', op >> 4);
+        }
+        tid1 = tid2 = read.getRefID();
+        neg1 = neg2 = read.IsReverseStrand();
+        pos1 = pos2 = extent.unclippedFivePrime(read.getPosition(), neg1);
+
+        if(read.IsPaired() && read.IsMateMapped() && read.getMateRefID() >= 0) {
+            // the mate's clips are in its CIGAR, if the MC tag has it
+            CigarExtent mate_extent;
+            const char * mate_cigar = findTag(read, "MC");
+            if(mate_cigar && *mate_cigar == 'Z') {
+                const char * p = mate_cigar + 1;
+                while(*p) {
+                    char * op;
+                    long length = strtol(p, &op, 10);
+                    if(op == p || !*op)
+                        break;
+                    mate_extent.add(*op, length);
+                    p = op + 1;
+                }
+            }
+            tid2 = read.getMateRefID();
+            neg2 = read.IsMateReverseStrand();
+            pos2 = mate_extent.unclippedFivePrime(read.getMatePosition(), neg2);
+        }
+
+        if(tid1 > tid2 || (tid1 == tid2 && (pos1 > pos2 || (pos1 == pos2 && (neg1 > neg2 || (neg1 == neg2 && read.IsSecondMate())))))) {
+            swap(tid1, tid2);
+            swap(pos1, pos2);
+            swap(neg1, neg2);
+            upper = true;
+        }
+    }
+
+    appendInt32(key, tid1);
+    appendInt32(key, tid2);
+    appendInt32(key, pos1);
+    appendInt32(key, pos2);
+    key.push_back(neg1);
+    key.push_back(neg2);
+
+    const char * read_group = findTag(read, "RG");
+    if(read_group && *read_group == 'Z') {
+        map<string, string>::const_iterator library = libraries.find(read_group + 1);
+        if(library != libraries.end())
+            key.append(library->second);
+    }
+    key.push_back(0);
+
+    // the strand suffix of duplex molecule IDs doesn't separate molecules
+    const char * molecule = findTag(read, "MI");
+    if(molecule && *molecule == 'Z') {
+        size_t length = strlen(molecule + 1);
+        if(length >= 2 && molecule[length - 1] == '/')
+            length -= 2;
+        key.append(molecule + 1, length);
+    }
+    key.push_back(0);
+
+    const char * name = read.getBamEncodedStringData().c_str();
+    appendString(key, name, strlen(name));
+    key.push_back(upper);
+}
+
+void TemplateCoordinateKeyOrder::setHeader(BamHeader & header) const
+{
+    header.setSortOrder(BamHeader::SORT_UNSORTED);
+    header.setGroupOrder("query");
+    header.setSubSort("unsorted:template-coordinate");
+}
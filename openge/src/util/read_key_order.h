@@ -0,0 +1,118 @@
+#ifndef OGE_READ_KEY_ORDER_H
+#define OGE_READ_KEY_ORDER_H
+
+/*********************************************************************
+ *
+ * read_key_order.h: Sort orders defined by keys extracted from reads.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * A ReadKeyOrder turns each read into a string of bytes, so that
+ * sorting reads is sorting their keys with memcmp (shorter keys
+ * first when one is a prefix of the other). Each key is built once
+ * per read when a run is sorted, and once per read when runs are
+ * merged, however complicated the order. Adding an order only takes
+ * a new appendKey().
+ *
+ * Numbers are stored big endian with the sign bit flipped, and
+ * strings with a terminating zero, so that both compare correctly
+ * as bytes.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+
+#include "oge_read.h"
+#include "bam_header.h"
+
+// Orders for sorting by name:
+//  ASCII   - names compared byte by byte, as Sort::ByName.
+//  PICARD  - as ASCII, then paired before unpaired reads, first before
+//            second of pair, forward before reverse strand, and primary
+//            before secondary and supplementary alignments, as Picard's
+//            queryname order.
+//  NATURAL - runs of digits compared as numbers, then first and second
+//            of pair, as samtools sort -n.
+typedef enum {
+    NAME_ORDER_ASCII = 0,
+    NAME_ORDER_PICARD = 1,
+    NAME_ORDER_NATURAL = 2
+} name_order_t;
+
+class ReadKeyOrder {
+public:
+    virtual ~ReadKeyOrder() {}
+
+    // Appends the key of read to key.
+    virtual void appendKey(const OGERead & read, std::string & key) const = 0;
+
+    // Sets the @HD sort fields of output sorted in this order.
+    virtual void setHeader(BamHeader & header) const = 0;
+
+    // The first 8 bytes of a key, big endian and padded with zeros, which
+    // orders keys the same way whenever it differs.
+    static uint64_t keyPrefix(const std::string & key, size_t offset = 0);
+    static int compareKeys(const std::string & a, const std::string & b) {
+        int cmp = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+        if(cmp != 0)
+            return cmp;
+        return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+    }
+
+    static void appendUInt32(std::string & key, uint32_t value);
+    static void appendInt32(std::string & key, int32_t value) { appendUInt32(key, (uint32_t)value ^ 0x80000000U); }
+    static void appendDouble(std::string & key, double value);
+    static void appendString(std::string & key, const char * value, size_t length);
+    // The read's name (and the flags that break ties between equal names),
+    // so that keys compare the same as ReadNameLess in this order.
+    static void appendName(std::string & key, const OGERead & read, name_order_t order);
+
+    // Finds a tag in the read. Returns a pointer to the tag's type, which is
+    // followed by its value, or NULL if the read doesn't have it.
+    static const char * findTag(const OGERead & read, const char * tag);
+};
+
+// Orders reads by the values of one or more tags, as samtools sort -t.
+// Reads without a tag come before reads with it; numbers (integer or
+// floating point) sort by value, and before strings. Ties are broken by
+// position, or by name in name_order.
+class TagKeyOrder : public ReadKeyOrder {
+public:
+    TagKeyOrder(const std::vector<std::string> & tags, bool then_by_name, name_order_t name_order = NAME_ORDER_ASCII);
+    virtual void appendKey(const OGERead & read, std::string & key) const;
+    virtual void setHeader(BamHeader & header) const;
+
+protected:
+    std::vector<std::string> tags;
+    bool then_by_name;
+    name_order_t name_order;
+};
+
+// Orders reads by the 5' unclipped positions of both reads of their
+// template, lower position first, then library, molecule (MI tag), name,
+// and the read with the lower position first. This is the
+// template-coordinate order of samtools and fgbio, which groups the reads
+// of each template and of each molecule.
+class TemplateCoordinateKeyOrder : public ReadKeyOrder {
+public:
+    TemplateCoordinateKeyOrder(const BamHeader & header);
+    virtual void appendKey(const OGERead & read, std::string & key) const;
+    virtual void setHeader(BamHeader & header) const;
+
+protected:
+    std::map<std::string, std::string> libraries;   // by read group
+};
+
+#endif
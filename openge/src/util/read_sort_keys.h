@@ -0,0 +1,231 @@
+#ifndef OGE_READ_SORT_KEYS_H
+#define OGE_READ_SORT_KEYS_H
+
+/*********************************************************************
+ *
+ * read_sort_keys.h: Integer keys and comparators for sorting reads.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Sorting and merging compare reads many times over, and the
+ * Sort::ByPosition and Sort::ByName comparators chase pointers into
+ * each read, and build strings from the read names. The keys here
+ * are extracted from a read once, and order reads the same way as
+ * the comparators whenever two keys differ. Only reads with equal
+ * keys need to be compared with ReadPositionLess or ReadNameLess,
+ * which give exactly the comparator order without building strings.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+#include "oge_read.h"
+#include "read_key_order.h"
+
+// Key shared by all unmapped reads, which Sort::ByPosition puts at the end
+// without ordering them.
+const uint64_t OGE_POSITION_KEY_UNMAPPED = ~(uint64_t)0;
+
+// refID, position+1 and strand, packed into 64 bits. Invalid (negative)
+// references and positions all map to the lowest key of their reference,
+// and are left to the comparator.
+inline uint64_t ogeReadPositionKey(const OGERead & read)
+{
+    int32_t ref = read.getRefID();
+    int32_t pos = read.getPosition();
+
+    if(ref == -1)
+        return OGE_POSITION_KEY_UNMAPPED;
+    if(ref < 0)
+        return 0;
+    if(pos < -1)
+        return (uint64_t)ref << 32;
+    return ((uint64_t)ref << 32) | ((uint64_t)(pos + 1) << 1) | (read.IsReverseStrand() ? 1 : 0);
+}
+
+// 8 bytes of the read name from offset, big endian and padded with zeros, so
+// that keys compare in the same order as names that match before offset.
+inline uint64_t ogeReadNameKey(const OGERead & read, size_t offset = 0)
+{
+    const char * name = read.getBamEncodedStringData().data();
+    size_t name_len = read.getNameLength() ? read.getNameLength() - 1 : 0;
+    uint64_t key = 0;
+    for(size_t c = offset; c < offset + 8; c++)
+        key = (key << 8) | (c < name_len ? (uint8_t)name[c] : 0);
+    return key;
+}
+
+inline int ogeReadNameCompare(const OGERead & a, const OGERead & b)
+{
+    return strcmp(a.getBamEncodedStringData().c_str(), b.getBamEncodedStringData().c_str());
+}
+
+// Same order as Sort::ByPosition, comparing names in place. Reads that
+// differ only in their address are left equal, so that sorts and merges
+// can break the tie in their own stable way.
+struct ReadPositionLess {
+    bool operator()(const OGERead * a, const OGERead * b) const {
+        if(a->getRefID() == -1) return false;
+        if(b->getRefID() == -1) return true;
+
+        if(a->getRefID() != b->getRefID())
+            return a->getRefID() < b->getRefID();
+        if(a->getPosition() != b->getPosition())
+            return a->getPosition() < b->getPosition();
+        if(a->IsReverseStrand() != b->IsReverseStrand())
+            return !a->IsReverseStrand();
+        int name_cmp = ogeReadNameCompare(*a, *b);
+        if(name_cmp != 0)
+            return name_cmp < 0;
+        return a->getAlignmentFlag() < b->getAlignmentFlag();
+    }
+};
+
+inline bool ogeNameOrderFromName(const std::string & name, name_order_t & order)
+{
+    if(name == "ascii")
+        order = NAME_ORDER_ASCII;
+    else if(name == "picard")
+        order = NAME_ORDER_PICARD;
+    else if(name == "natural")
+        order = NAME_ORDER_NATURAL;
+    else
+        return false;
+    return true;
+}
+
+// Compares names the way samtools does, numbers within the names by value.
+inline int ogeNaturalNameCompare(const char * a, const char * b)
+{
+    const unsigned char * pa = (const unsigned char *) a, * pb = (const unsigned char *) b;
+    while(*pa && *pb) {
+        if(isdigit(*pa) && isdigit(*pb)) {
+            while(*pa == '0') ++pa;
+            while(*pb == '0') ++pb;
+            while(isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
+            if(isdigit(*pa) && isdigit(*pb)) {
+                // the longer number is larger, otherwise the first differing digit decides
+                int i = 0;
+                while(isdigit(pa[i]) && isdigit(pb[i])) ++i;
+                return isdigit(pa[i]) ? 1 : isdigit(pb[i]) ? -1 : (int)*pa - (int)*pb;
+            } else if(isdigit(*pa))
+                return 1;
+            else if(isdigit(*pb))
+                return -1;
+            else if(pa - (const unsigned char *) a != pb - (const unsigned char *) b)
+                return pa - (const unsigned char *) a < pb - (const unsigned char *) b ? 1 : -1;
+        } else {
+            if(*pa != *pb)
+                return (int)*pa - (int)*pb;
+            ++pa, ++pb;
+        }
+    }
+    return *pa ? 1 : *pb ? -1 : 0;
+}
+
+// Orders reads by name, comparing names in place. The ASCII order is the
+// same as Sort::ByName.
+struct ReadNameLess {
+    ReadNameLess(name_order_t order = NAME_ORDER_ASCII)
+    : order(order)
+    {}
+
+    bool operator()(const OGERead * a, const OGERead * b) const {
+        if(order == NAME_ORDER_ASCII)
+            return ogeReadNameCompare(*a, *b) < 0;
+
+        int name_cmp;
+        if(order == NAME_ORDER_NATURAL)
+            name_cmp = ogeNaturalNameCompare(a->getBamEncodedStringData().c_str(), b->getBamEncodedStringData().c_str());
+        else
+            name_cmp = ogeReadNameCompare(*a, *b);
+        if(name_cmp != 0)
+            return name_cmp < 0;
+
+        uint16_t fa = a->getAlignmentFlag(), fb = b->getAlignmentFlag();
+        if(order == NAME_ORDER_NATURAL)
+            return (fa & 0xc0) < (fb & 0xc0);
+
+        // paired, first mate, second mate, reverse strand, secondary, supplementary.
+        // Reads with the paired or first mate flag set come first; for the
+        // others, reads without the flag do.
+        static const uint16_t picard_flags[] = {0x1, 0x40, 0x80, 0x10, 0x100, 0x800};
+        for(size_t i = 0; i < sizeof(picard_flags) / sizeof(picard_flags[0]); i++) {
+            uint16_t bit = picard_flags[i];
+            if((fa & bit) != (fb & bit))
+                return (bit == 0x1 || bit == 0x40) ? (fa & bit) != 0 : (fb & bit) != 0;
+        }
+        return false;
+    }
+
+    name_order_t order;
+};
+
+// A read, with its key, waiting to be merged.
+// full_key is only used by key orders.
+struct ReadMergeItem {
+    uint64_t key;
+    OGERead * read;
+    const std::string * full_key;
+};
+
+// Orders merge items by position (as Sort::ByPosition), by name, or by a
+// ReadKeyOrder, and makes items with the matching key. Numbers in names
+// don't sort the same as their bytes, so the natural name order has no key.
+struct ReadMergeLess {
+    ReadMergeLess(bool by_name = false, name_order_t name_order = NAME_ORDER_ASCII)
+    : by_name(by_name)
+    , name_less(name_order)
+    , key_order(NULL)
+    {}
+
+    ReadMergeLess(const ReadKeyOrder * key_order)
+    : by_name(false)
+    , key_order(key_order)
+    {}
+
+    // Items of key orders keep their full key in key_storage, which must
+    // stay in place until the item is merged.
+    ReadMergeItem item(OGERead * read, std::string * key_storage = NULL) const {
+        ReadMergeItem ret;
+        ret.full_key = NULL;
+        if(key_order) {
+            key_storage->clear();
+            key_order->appendKey(*read, *key_storage);
+            ret.key = ReadKeyOrder::keyPrefix(*key_storage);
+            ret.full_key = key_storage;
+        } else if(!by_name)
+            ret.key = ogeReadPositionKey(*read);
+        else
+            ret.key = name_less.order == NAME_ORDER_NATURAL ? 0 : ogeReadNameKey(*read);
+        ret.read = read;
+        return ret;
+    }
+
+    bool operator()(const ReadMergeItem & a, const ReadMergeItem & b) const {
+        if(a.key != b.key)
+            return a.key < b.key;
+        if(key_order)
+            return ReadKeyOrder::compareKeys(*a.full_key, *b.full_key) < 0;
+        if(by_name)
+            return name_less(a.read, b.read);
+        return a.key != OGE_POSITION_KEY_UNMAPPED && ReadPositionLess()(a.read, b.read);
+    }
+
+    bool by_name;
+    ReadNameLess name_less;
+    const ReadKeyOrder * key_order;
+};
+
+#endif
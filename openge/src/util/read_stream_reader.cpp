@@ -20,6 +20,7 @@
 #include "bgzf_input_stream.h"
 #include "bam_deserializer.h"
 #include "sequential_reader_cache.h"
+#include "spill_file.h"
 
 bool MultiReader::open(const std::vector<std::string> & filenames) {
     for(std::vector<std::string>::const_iterator i = filenames.begin(); i != filenames.end(); i++) {
@@ -29,6 +30,7 @@ bool MultiReader::open(const std::vector<std::string> & filenames) {
             case FORMAT_BAM: reader = new BamDeserializer<BgzfInputStream>(); break;
             case FORMAT_RAWBAM: reader = new BamDeserializer<std::ifstream>(); break;
             case FORMAT_SAM: reader = new ::SamReader(); break;
+            case FORMAT_SPILL: reader = new SpillReader(); break;
             default:
                 std::cerr << "File " << *i << " is of an unknown format. Aborting." << std::endl;
                 exit(-1);
@@ -44,18 +46,21 @@ bool MultiReader::open(const std::vector<std::string> & filenames) {
     }
     
     if(readers.size() > 1) {
-        // first, get one read from each queue
-        // make sure and deal with the case where one chain will never have any reads. TODO LCB
-        
-        for(std::vector<ReadStreamReader *>::iterator i = readers.begin(); i != readers.end(); i++)
-        {
-            OGERead * read = (*i)->read();
-            
-            if(!read)
-                continue;
-            
-            reads.insert(SortedMergeElement(read, (*i)));
+        // first, get one read from each file. Files with no reads at all are
+        // left exhausted.
+        if(key_order)
+            merge_less = ReadMergeLess(key_order);
+        else
+            merge_less = ReadMergeLess(sort_order == BamHeader::SORT_QUERYNAME, name_order);
+        source_keys.assign(readers.size(), std::string());
+        reads = LoserTree<ReadMergeItem, ReadMergeLess>(readers.size(), merge_less);
+
+        for(size_t i = 0; i < readers.size(); i++) {
+            OGERead * read = readers[i]->read();
+            if(read)
+                reads.setItem(i, merge_less.item(read, &source_keys[i]));
         }
+        reads.build();
     }
     return true;
 }
\ No newline at end of file
@@ -20,20 +20,21 @@
 #include "bam_header.h"
 #include "bamtools/Sort.h"
 #include "oge_read.h"
+#include "loser_tree.h"
+#include "read_sort_keys.h"
 
 #include <iostream>
 
 #include <stdio.h>
 
-#include <set>
-
 class ReadStreamReader {
 public:
     typedef enum
     {
-        FORMAT_BAM, FORMAT_RAWBAM, FORMAT_SAM, FORMAT_CRAM, FORMAT_UNKNOWN
+        FORMAT_BAM, FORMAT_RAWBAM, FORMAT_SAM, FORMAT_CRAM, FORMAT_SPILL, FORMAT_UNKNOWN
     } file_format_t;
 
+    virtual ~ReadStreamReader() {}
     virtual bool open(const std::string & filename) = 0;
     virtual const BamHeader & getHeader() const = 0;
     virtual void close() = 0;
@@ -79,6 +80,8 @@ ReadStreamReader::file_format_t ReadStreamReader::detectFileFormat(std::string f
         this_file_format = FORMAT_BAM;
     else if(data[0] == 'B' && data[1] == 'A')
         this_file_format = FORMAT_RAWBAM;
+    else if(data[0] == 'O' && data[1] == 'G')
+        this_file_format = FORMAT_SPILL;    // see spill_file.h
     else
         this_file_format = FORMAT_UNKNOWN;
     
@@ -86,25 +89,31 @@ ReadStreamReader::file_format_t ReadStreamReader::detectFileFormat(std::string f
 }
 
 class MultiReader : public ReadStreamReader {
-
-    class SortedMergeElement{
-    public:
-        OGERead * read;
-        ReadStreamReader * source;
-        bool operator<(const SortedMergeElement & t) const {
-            BamTools::Algorithms::Sort::ByPosition cmp = BamTools::Algorithms::Sort::ByPosition();
-            return cmp(this->read, t.read);
-        }
-
-        SortedMergeElement(OGERead * read, ReadStreamReader * source)
-        : read(read)
-        , source(source)
-        {}
-    };
-
     std::vector<ReadStreamReader *> readers;
-    std::multiset<SortedMergeElement> reads;
+    BamHeader::sort_order_t sort_order;
+    name_order_t name_order;
+    const ReadKeyOrder * key_order;
+    std::vector<std::string> source_keys;   // keys of each file's next read, for key orders
+    ReadMergeLess merge_less;
+    LoserTree<ReadMergeItem, ReadMergeLess> reads;
 public:
+    MultiReader()
+    : sort_order(BamHeader::SORT_COORDINATE)
+    , name_order(NAME_ORDER_ASCII)
+    , key_order(NULL)
+    {}
+
+    ~MultiReader() {
+        for( std::vector<ReadStreamReader *>::iterator i = readers.begin(); i != readers.end(); i++)
+            delete *i;
+    }
+
+    // Order used to merge multiple files. Must be set before open().
+    void setSortOrder(BamHeader::sort_order_t order) { sort_order = order; }
+    void setNameOrder(name_order_t order) { name_order = order; }
+    // Merges by key instead of the sort order, if not NULL.
+    void setKeyOrder(const ReadKeyOrder * order) { key_order = order; }
+
     virtual bool open(const std::string & filename) {
         std::vector<std::string> fn;
         fn.push_back(filename);
@@ -133,21 +142,16 @@ public:
         if(readers.size() == 1)
             return readers.front()->read();
         
-        OGERead * ret = NULL;
-        //now handle the steady state situation. When sources are done, We
-        // won't have a read any more in the reads pqueue.
-        while(!ret && !reads.empty()) {
-            SortedMergeElement el = *reads.begin();
-            reads.erase(reads.begin());
-            
-            ret = el.read;
-            
-            el.read = el.source->read();
-            if(!el.read)
-                continue;
-            
-            reads.insert(el);
-        }
+        if(reads.empty())
+            return NULL;
+
+        OGERead * ret = reads.top().read;
+        size_t source = reads.topSource();
+        OGERead * next = readers[source]->read();
+        if(next)
+            reads.replaceTop(merge_less.item(next, &source_keys[source]));
+        else
+            reads.popTop();
 
         return ret;
     }
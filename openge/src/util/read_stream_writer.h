@@ -21,6 +21,8 @@
 #include "oge_read.h"
 
 class ReadStreamWriter {
+public:
+    virtual ~ReadStreamWriter() {}
     virtual bool open(const std::string & filename, const BamHeader & header) = 0;
     virtual void close() = 0;
     virtual bool is_open() const = 0;
@@ -19,12 +19,13 @@
 
 #include "read_stream_reader.h"
 #include "thread_pool.h"
+#include "queue_budget.h"
 
 template <class reader_t>
 class SequentialReaderCache : public ReadStreamReader {
 public:
-    SequentialReaderCache() : thread_job(this) { read_finished.clear(); }
-    virtual bool open(const std::string & filename) { read_finished.clear(); return reader.open(filename); }
+    SequentialReaderCache() : read_budget("read cache"), thread_job(this) { read_finished.clear(); }
+    virtual bool open(const std::string & filename) { read_finished.clear(); read_budget.reset(); return reader.open(filename); }
     virtual const BamHeader & getHeader() const { return reader.getHeader(); };
     virtual void close() { return reader.close(); }
     virtual OGERead * read();
@@ -32,6 +33,7 @@ public:
 protected:
     reader_t reader;
     SynchronizedBlockingQueue<OGERead *> read_queue;
+    QueueBudget read_budget;    // prefetching stops when full, and resumes once half empty
     
     class PrefetchJob : public ThreadJob {
         SequentialReaderCache * cache;
@@ -57,7 +59,7 @@ OGERead * SequentialReaderCache<reader_t>::read() {
     if(read_finished.isSet() && read_queue.empty())
         return NULL;
 
-    if(read_queue.size() < 5000 &&
+    if(read_budget.bytesQueued() < read_budget.getLimit() / 2 &&
        (read_queue.empty() || read_queue.back() != NULL) &&
        !read_finished.isSet())
     {
@@ -69,16 +71,20 @@ OGERead * SequentialReaderCache<reader_t>::read() {
     
     if(NULL == ret)
         read_finished.set();
+    else
+        read_budget.release(ret->memoryUsage());
     
     return ret;
 }
 
 template <class reader_t>
 void SequentialReaderCache<reader_t>::PrefetchJob::runJob() {
-    while(cache->read_queue.size() < 10000 && !cache->read_finished.isSet()) {
+    while(!cache->read_budget.isFull() && !cache->read_finished.isSet()) {
         OGERead * al = cache->reader.read();
         if(al == NULL)
             cache->read_finished.set();
+        else
+            cache->read_budget.charge(al->memoryUsage());
         cache->read_queue.push(al);
     }
     is_running = false;
@@ -0,0 +1,280 @@
+/*********************************************************************
+ *
+ * spill_file.cpp: Temporary files of reads.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "spill_file.h"
+
+#include "bgzf_codec.h"
+#include "lz4_block.h"
+#include "bamtools/BamAux.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+static const char SPILL_MAGIC[3] = {'O', 'G', 'S'};
+static const int SPILL_DEFLATE_LEVEL = 6;
+
+spill_codec_t SpillWriter::default_codec = SPILL_CODEC_LZ4;
+
+bool SpillWriter::codecFromName(const string & name, spill_codec_t & codec)
+{
+    if(name == "none")
+        codec = SPILL_CODEC_NONE;
+    else if(name == "lz4")
+        codec = SPILL_CODEC_LZ4;
+    else if(name == "deflate")
+        codec = SPILL_CODEC_DEFLATE;
+    else
+        return false;
+    return true;
+}
+
+SpillWriter::SpillWriter()
+: fp(NULL)
+, codec(default_codec)
+{ }
+
+SpillWriter::~SpillWriter()
+{
+    if(fp)
+        close();
+}
+
+bool SpillWriter::open(const string & filename, const BamHeader &)
+{
+    return open(filename);
+}
+
+bool SpillWriter::open(const string & filename)
+{
+    this->filename = filename;
+    fp = fopen(filename.c_str(), "wb");
+    if(!fp)
+        return false;
+
+    block.reserve(SPILL_BLOCK_SIZE + 64 * 1024);
+    compressed.resize(ogeLz4CompressBound(block.capacity()));
+
+    char codec_byte = (char)codec;
+    fwrite(SPILL_MAGIC, 1, sizeof(SPILL_MAGIC), fp);
+    fwrite(&codec_byte, 1, 1, fp);
+    return !ferror(fp);
+}
+
+bool SpillWriter::write(const OGERead & al)
+{
+    const string & char_data = al.getSupportData().getAllCharData();
+    uint32_t block_size = al.getSupportData().getBlockLength();
+
+    // same layout as a BAM record
+    uint32_t core[9];
+    core[0] = block_size;
+    core[1] = al.getRefID();
+    core[2] = al.getPosition();
+    core[3] = (al.getBin() << 16) | (al.getMapQuality() << 8) | al.getNameLength();
+    core[4] = (al.getAlignmentFlag() << 16) | al.getNumCigarOps();
+    core[5] = al.getLength();
+    core[6] = al.getMateRefID();
+    core[7] = al.getMatePosition();
+    core[8] = al.getInsertSize();
+
+    block.insert(block.end(), (const char *)core, (const char *)core + sizeof(core));
+    block.insert(block.end(), char_data.begin(), char_data.end());
+
+    if(block.size() >= SPILL_BLOCK_SIZE)
+        flushBlock();
+    return true;
+}
+
+void SpillWriter::flushBlock()
+{
+    if(block.empty())
+        return;
+
+    if(compressed.size() < ogeLz4CompressBound(block.size()))
+        compressed.resize(ogeLz4CompressBound(block.size()));
+
+    size_t stored_size = 0;
+    switch(codec) {
+        case SPILL_CODEC_LZ4:
+            stored_size = ogeLz4Compress(&block[0], block.size(), &compressed[0], compressed.size());
+            break;
+        case SPILL_CODEC_DEFLATE:
+            stored_size = BgzfCodec::threadCodec()->compress(&block[0], block.size(), &compressed[0], compressed.size(), SPILL_DEFLATE_LEVEL);
+            break;
+        default:
+            break;
+    }
+
+    uint32_t sizes[2];
+    sizes[0] = block.size();
+    const char * data = &compressed[0];
+    if(stored_size == 0 || stored_size >= block.size()) {
+        stored_size = block.size();
+        data = &block[0];
+    }
+    sizes[1] = stored_size;
+
+    fwrite(sizes, sizeof(sizes), 1, fp);
+    if(1 != fwrite(data, stored_size, 1, fp)) {
+        perror("Spill file write failed");
+        cerr << "Couldn't write to temporary file " << filename << ". Aborting." << endl;
+        exit(-1);
+    }
+
+    block.clear();
+}
+
+void SpillWriter::close()
+{
+    if(!fp)
+        return;
+
+    flushBlock();
+
+    uint32_t end_marker[2] = {0, 0};
+    fwrite(end_marker, sizeof(end_marker), 1, fp);
+    if(0 != fclose(fp)) {
+        perror("Spill file close failed");
+        cerr << "Couldn't write to temporary file " << filename << ". Aborting." << endl;
+        exit(-1);
+    }
+    fp = NULL;
+}
+
+SpillReader::SpillReader()
+: fp(NULL)
+, codec(SPILL_CODEC_NONE)
+, block_used(0)
+, block_offset(0)
+{ }
+
+SpillReader::~SpillReader()
+{
+    close();
+}
+
+bool SpillReader::open(const string & filename)
+{
+    this->filename = filename;
+    fp = fopen(filename.c_str(), "rb");
+    if(!fp)
+        return false;
+
+    char magic[4];
+    if(1 != fread(magic, sizeof(magic), 1, fp) || memcmp(magic, SPILL_MAGIC, sizeof(SPILL_MAGIC))) {
+        cerr << filename << " is not a temporary file written by OpenGE." << endl;
+        close();
+        return false;
+    }
+
+    codec = (spill_codec_t) magic[3];
+    block_used = block_offset = 0;
+    return true;
+}
+
+void SpillReader::close()
+{
+    if(fp)
+        fclose(fp);
+    fp = NULL;
+
+    std::vector<char>().swap(block);
+    std::vector<char>().swap(compressed);
+    block_used = block_offset = 0;
+}
+
+bool SpillReader::readBlock()
+{
+    uint32_t sizes[2];
+    if(1 != fread(sizes, sizeof(sizes), 1, fp)) {
+        cerr << "Temporary file " << filename << " is truncated. Aborting." << endl;
+        exit(-1);
+    }
+
+    // end of file marker
+    if(sizes[0] == 0)
+        return false;
+
+    block.resize(sizes[0]);
+    block_used = sizes[0];
+    block_offset = 0;
+
+    char * dest = &block[0];
+    if(sizes[1] != sizes[0]) {
+        compressed.resize(sizes[1]);
+        dest = &compressed[0];
+    }
+    if(1 != fread(dest, sizes[1], 1, fp)) {
+        cerr << "Temporary file " << filename << " is truncated. Aborting." << endl;
+        exit(-1);
+    }
+
+    if(sizes[1] != sizes[0]) {
+        bool ok = false;
+        switch(codec) {
+            case SPILL_CODEC_LZ4:
+                ok = ogeLz4Decompress(&compressed[0], sizes[1], &block[0], sizes[0]);
+                break;
+            case SPILL_CODEC_DEFLATE:
+                ok = BgzfCodec::threadCodec()->decompress(&compressed[0], sizes[1], &block[0], sizes[0]);
+                break;
+            default:
+                break;
+        }
+        if(!ok) {
+            cerr << "Temporary file " << filename << " is corrupt. Aborting." << endl;
+            exit(-1);
+        }
+    }
+
+    return true;
+}
+
+OGERead * SpillReader::read()
+{
+    if(!fp)
+        return NULL;
+
+    if(block_offset == block_used && !readBlock()) {
+        close();
+        return NULL;
+    }
+
+    const char * record = &block[block_offset];
+    uint32_t block_length = BamTools::UnpackUnsignedInt(record);
+    if(block_length < 32 || block_offset + 4 + block_length > block_used) {
+        cerr << "Temporary file " << filename << " is corrupt. Aborting." << endl;
+        exit(-1);
+    }
+    const char * buffer = record + 4;
+    block_offset += 4 + block_length;
+
+    OGERead * al = OGERead::allocate();
+    al->setRefID(BamTools::UnpackSignedInt(&buffer[0]));
+    al->setPosition(BamTools::UnpackSignedInt(&buffer[4]));
+    uint32_t name_length = ((unsigned char *)buffer)[8];
+    al->setMapQuality(((unsigned char *)buffer)[9]);
+    al->setBin(BamTools::UnpackUnsignedShort(&buffer[10]));
+    uint32_t num_cigar_ops = BamTools::UnpackUnsignedShort(&buffer[12]);
+    al->setAlignmentFlag(BamTools::UnpackUnsignedShort(&buffer[14]));
+    uint32_t sequence_length = BamTools::UnpackUnsignedInt(&buffer[16]);
+    al->setMateRefID(BamTools::UnpackSignedInt(&buffer[20]));
+    al->setMatePosition(BamTools::UnpackSignedInt(&buffer[24]));
+    al->setInsertSize(BamTools::UnpackSignedInt(&buffer[28]));
+    al->setBamStringData(&buffer[32], block_length - 32, num_cigar_ops, sequence_length, name_length);
+
+    return al;
+}
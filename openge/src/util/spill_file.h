@@ -0,0 +1,98 @@
+#ifndef OGE_SPILL_FILE_H
+#define OGE_SPILL_FILE_H
+
+/*********************************************************************
+ *
+ * spill_file.h: Temporary files of reads.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * Sorting and duplicate marking write reads to temporary files that
+ * are read back once by the same process. These don't need to be
+ * BAM files: they have no header, and are compressed in large blocks
+ * with a codec chosen for speed. LZ4 typically makes BAM records 2-3
+ * times smaller, for a small fraction of the CPU time of deflate.
+ *
+ * A spill file starts with the magic "OGS" and a codec byte, followed
+ * by blocks:
+ *     uint32_t raw_size, stored_size; char data[stored_size];
+ * where the block is stored uncompressed if stored_size == raw_size.
+ * A block with raw_size 0 ends the file. Uncompressed blocks hold
+ * BAM records (block size, 32 byte core, and variable length data).
+ *
+ *********************************************************************/
+
+#include "read_stream_reader.h"
+#include "read_stream_writer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+const size_t SPILL_BLOCK_SIZE = 256 * 1024;
+
+typedef enum {
+    SPILL_CODEC_NONE = 0,
+    SPILL_CODEC_LZ4 = 1,
+    SPILL_CODEC_DEFLATE = 2
+} spill_codec_t;
+
+class SpillWriter : public ReadStreamWriter {
+public:
+    SpillWriter();
+    ~SpillWriter();
+
+    // The header isn't stored.
+    virtual bool open(const std::string & filename, const BamHeader & header);
+    bool open(const std::string & filename);
+    virtual void close();
+    virtual bool is_open() const { return fp != NULL; }
+    virtual bool write(const OGERead & alignment);
+
+    // Must be set before open().
+    void setCodec(spill_codec_t codec) { this->codec = codec; }
+    spill_codec_t getCodec() const { return codec; }
+
+    // Codec used by writers that don't select one. Set with --tempcodec.
+    static void setDefaultCodec(spill_codec_t codec) { default_codec = codec; }
+    static spill_codec_t getDefaultCodec() { return default_codec; }
+    static bool codecFromName(const std::string & name, spill_codec_t & codec);
+
+protected:
+    void flushBlock();
+
+    FILE * fp;
+    std::string filename;
+    spill_codec_t codec;
+    std::vector<char> block;
+    std::vector<char> compressed;
+
+    static spill_codec_t default_codec;
+};
+
+class SpillReader : public ReadStreamReader {
+public:
+    SpillReader();
+    ~SpillReader();
+
+    virtual bool open(const std::string & filename);
+    // Spill files have no header, so this is always empty.
+    virtual const BamHeader & getHeader() const { return header; }
+    virtual void close();
+    virtual OGERead * read();
+
+protected:
+    bool readBlock();
+
+    FILE * fp;
+    std::string filename;
+    spill_codec_t codec;
+    BamHeader header;
+    std::vector<char> block;
+    std::vector<char> compressed;
+    size_t block_used, block_offset;
+};
+
+#endif
@@ -0,0 +1,137 @@
+/*********************************************************************
+ *
+ * spill_queue.cpp: First in, first out queue of reads that overflows
+ *                  to temporary files.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "spill_queue.h"
+#include "spill_file.h"
+#include "temp_directories.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+static size_t readBytes(const OGERead * read)
+{
+    return read->memoryUsage() + sizeof(OGERead *);
+}
+
+SpillQueue::SpillQueue(size_t memory_limit)
+: memory_limit(memory_limit)
+, count(0)
+, memory_bytes(0)
+, spilled(0)
+, total_spilled(0)
+, next_segment(0)
+, writer(NULL)
+, reader(NULL)
+{ }
+
+SpillQueue::~SpillQueue()
+{
+    while(!memory.empty()) {
+        delete memory.front();
+        memory.pop_front();
+    }
+    delete writer;
+    delete reader;
+    for(deque<string>::const_iterator i = segments.begin(); i != segments.end(); i++)
+        remove(i->c_str());
+}
+
+void SpillQueue::push(OGERead * read)
+{
+    count++;
+    size_t bytes = readBytes(read);
+
+    if(spilled == 0 && (memory.empty() || memory_bytes + bytes <= memory_limit)) {
+        memory.push_back(read);
+        memory_bytes += bytes;
+        return;
+    }
+
+    if(!writer) {
+        char filename[64];
+        sprintf(filename, "oge_queue_%d_%lx_%d.spill", getpid(), (uintptr_t)this, next_segment++);
+        segments.push_back(TempDirectories::choose(memory_limit) + filename);
+
+        writer = new SpillWriter();
+        if(!writer->open(segments.back())) {
+            cerr << "Couldn't open temporary file " << segments.back() << ". Aborting." << endl;
+            exit(-1);
+        }
+    }
+
+    writer->write(*read);
+    delete read;
+    spilled++;
+    total_spilled++;
+}
+
+OGERead * SpillQueue::pop()
+{
+    if(memory.empty() && spilled > 0)
+        refill();
+    if(memory.empty())
+        return NULL;
+
+    OGERead * read = memory.front();
+    memory.pop_front();
+    memory_bytes -= readBytes(read);
+    count--;
+    return read;
+}
+
+void SpillQueue::closeSegment()
+{
+    delete reader;
+    reader = NULL;
+    remove(segments.front().c_str());
+    segments.pop_front();
+}
+
+// Read spilled reads back until half the memory limit is used, leaving
+// room for reads that are pushed while these are popped.
+void SpillQueue::refill()
+{
+    while(spilled > 0 && (memory.empty() || memory_bytes < memory_limit / 2)) {
+        if(!reader) {
+            // reading the segment that is being written ends it
+            if(writer && segments.size() == 1) {
+                writer->close();
+                delete writer;
+                writer = NULL;
+            }
+            reader = new SpillReader();
+            if(!reader->open(segments.front())) {
+                cerr << "Couldn't open temporary file " << segments.front() << ". Aborting." << endl;
+                exit(-1);
+            }
+        }
+
+        OGERead * read = reader->read();
+        if(!read) {
+            closeSegment();
+            continue;
+        }
+        memory.push_back(read);
+        memory_bytes += readBytes(read);
+        spilled--;
+    }
+
+    // the segment has been read to its end, but the reader hasn't seen it yet
+    if(reader && spilled == 0 && !writer)
+        closeSegment();
+}
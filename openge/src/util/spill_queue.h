@@ -0,0 +1,71 @@
+#ifndef OGE_SPILL_QUEUE_H
+#define OGE_SPILL_QUEUE_H
+
+/*********************************************************************
+ *
+ * spill_queue.h: First in, first out queue of reads that overflows
+ *                to temporary files.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Reads are kept in memory until they take up the memory limit. After
+ * that, reads are appended to spill files until the queue has been
+ * drained back down to memory, so only the part of the queue that
+ * doesn't fit is ever written to disk.
+ *
+ *********************************************************************/
+
+#include "oge_read.h"
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+
+class SpillWriter;
+class SpillReader;
+
+class SpillQueue {
+public:
+    SpillQueue(size_t memory_limit = 0);
+    ~SpillQueue();
+
+    void setMemoryLimit(size_t memory_limit) { this->memory_limit = memory_limit; }
+
+    // Takes ownership of read.
+    void push(OGERead * read);
+    // Returns NULL if the queue is empty. The caller owns the read.
+    OGERead * pop();
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    // Reads written to spill files since the queue was created.
+    uint64_t spilledReads() const { return total_spilled; }
+
+protected:
+    void refill();
+    void closeSegment();
+
+    size_t memory_limit;
+    size_t count;
+
+    std::deque<OGERead *> memory;   // the front of the queue
+    size_t memory_bytes;
+
+    // The rest of the queue, oldest first. The writer appends to the last
+    // segment and the reader reads from the first.
+    std::deque<std::string> segments;
+    size_t spilled;
+    uint64_t total_spilled;
+    int next_segment;
+    SpillWriter * writer;
+    SpillReader * reader;
+};
+
+#endif
@@ -0,0 +1,93 @@
+/*********************************************************************
+ *
+ * temp_directories.cpp: Placement of temporary files.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************/
+
+#include "temp_directories.h"
+
+#include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace std;
+
+// Room left free on a disk, on top of the file being placed on it.
+static const uint64_t TEMP_DIRECTORY_RESERVE = 64 * 1024 * 1024;
+
+vector<string> TempDirectories::directories(1, "/tmp/");
+size_t TempDirectories::next = 0;
+Spinlock TempDirectories::next_lock;
+
+bool TempDirectories::setDirectories(const string & list)
+{
+    vector<string> dirs;
+    size_t start = 0;
+    while(start <= list.size()) {
+        size_t end = list.find(',', start);
+        if(end == string::npos)
+            end = list.size();
+        string dir = list.substr(start, end - start);
+        start = end + 1;
+        if(dir.empty())
+            continue;
+
+        struct stat st;
+        if(0 != stat(dir.c_str(), &st) || !S_ISDIR(st.st_mode) || 0 != access(dir.c_str(), W_OK | X_OK)) {
+            cerr << "Temp directory " << dir << " does not exist or is not writable." << endl;
+            return false;
+        }
+        dirs.push_back(dir + "/");
+    }
+
+    if(dirs.empty()) {
+        cerr << "No temp directory given." << endl;
+        return false;
+    }
+
+    directories = dirs;
+    next = 0;
+    return true;
+}
+
+uint64_t TempDirectories::freeSpace(const string & directory)
+{
+    struct statvfs st;
+    if(0 != statvfs(directory.c_str(), &st))
+        return 0;
+    return (uint64_t)st.f_bavail * st.f_frsize;
+}
+
+string TempDirectories::choose(uint64_t expected_bytes)
+{
+    if(directories.size() == 1)
+        return directories.front();
+
+    next_lock.lock();
+    size_t first = next;
+    next = (next + 1) % directories.size();
+    next_lock.unlock();
+
+    size_t best = first;
+    uint64_t best_free = 0;
+    for(size_t i = 0; i < directories.size(); i++) {
+        size_t d = (first + i) % directories.size();
+        uint64_t free_bytes = freeSpace(directories[d]);
+        if(free_bytes >= expected_bytes + TEMP_DIRECTORY_RESERVE)
+            return directories[d];
+        if(free_bytes > best_free) {
+            best = d;
+            best_free = free_bytes;
+        }
+    }
+
+    return directories[best];
+}
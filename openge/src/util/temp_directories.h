@@ -0,0 +1,51 @@
+#ifndef OGE_TEMP_DIRECTORIES_H
+#define OGE_TEMP_DIRECTORIES_H
+
+/*********************************************************************
+ *
+ * temp_directories.h: Placement of temporary files.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * --tmpdir takes a comma separated list of directories. Temporary
+ * files are spread over them in turn, so that with one directory per
+ * disk, sorted runs are written to (and merged from) every disk at
+ * once. A directory is skipped if it doesn't have room for the file
+ * being created; if none do, the one with the most free space is
+ * used.
+ *
+ *********************************************************************/
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+class TempDirectories {
+public:
+    // Sets the directories from a comma separated list. Returns false if
+    // any of them is not a writable directory.
+    static bool setDirectories(const std::string & list);
+    static const std::vector<std::string> & getDirectories() { return directories; }
+
+    // Directory, ending in '/', for a new temp file of about expected_bytes.
+    static std::string choose(uint64_t expected_bytes = 0);
+
+    // Bytes available to unprivileged users in the directory's filesystem.
+    static uint64_t freeSpace(const std::string & directory);
+
+protected:
+    static std::vector<std::string> directories;
+    static size_t next;
+    static Spinlock next_lock;
+};
+
+#endif
@@ -22,6 +22,7 @@
 #include <string>
 #include <iostream>
 #include <stdio.h>
+#include <sched.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -37,21 +38,32 @@ const int THREADPOOL_MAX_JOBS_IN_QUEUE = 128;
 ThreadPool * ThreadPool::_sharedPool = NULL;
 
 ThreadPool::ThreadPool(int num_threads)
-: num_jobs_running(0)
+: shared_jobs(0)
+, queued_jobs(0)
+, outstanding_jobs(0)
+, sleeping_workers(0)
 {
     threads_exit.clear();
 	if(num_threads == -1 || num_threads == 0)
 		num_threads = OGEParallelismSettings::getNumberThreads();
-
+    
+    pthread_key_create(&worker_key, NULL);
+
+    // create all of the workers before starting any, since they steal from each other
+	for(int thread_ctr = 0; thread_ctr < num_threads; thread_ctr++) {
+        Worker * worker = new Worker;
+        worker->pool = this;
+        worker->steal_seed = thread_ctr + 1;
+        workers.push_back(worker);
+    }
+    
 	for(int thread_ctr = 0; thread_ctr < num_threads; thread_ctr++)
 	{
-		pthread_t thread;
-		int error_code = pthread_create(&thread, NULL, ThreadPool::thread_start, this);
+		int error_code = pthread_create(&workers[thread_ctr]->thread, NULL, ThreadPool::thread_start, workers[thread_ctr]);
 		if(0 != error_code) {
 			cerr << "Error creating threadpool worker threads. Aborting. (error " << error_code << ")" << endl;
             exit(-1);
         }
-		threads.push_back(thread);
 	}
 }
 
@@ -66,8 +78,13 @@ ThreadPool::~ThreadPool()
     job_queue_mutex.unlock();
 
 	//wait for threads to return
-	for(size_t thread_ctr = 0; thread_ctr < threads.size(); thread_ctr++)
-		pthread_join(threads[thread_ctr], NULL);
+	for(size_t thread_ctr = 0; thread_ctr < workers.size(); thread_ctr++)
+		pthread_join(workers[thread_ctr]->thread, NULL);
+    
+	for(size_t thread_ctr = 0; thread_ctr < workers.size(); thread_ctr++)
+        delete workers[thread_ctr];
+    
+    pthread_key_delete(worker_key);
 }
 
 int ThreadPool::availableCores()
@@ -75,74 +92,150 @@ int ThreadPool::availableCores()
     return OGEParallelismSettings::availableCores();
 }
 
-//add a job to the queue to be 
-bool ThreadPool::addJob(ThreadJob * job)
+ThreadPool::Worker * ThreadPool::currentWorker()
 {
-    job_queue_mutex.lock();
-
-	jobs.push(job);
+    return (Worker *) pthread_getspecific(worker_key);
+}
 
-    job_queue_cond.notify_one();
-    job_queue_mutex.unlock();
+//add a job to the queue to be 
+bool ThreadPool::addJob(ThreadJob * job, ThreadJobGroup * group)
+{
+    job->group = group;
+    if(group) {
+        group->lock.lock();
+        group->pending++;
+        group->lock.unlock();
+    }
+    
+    __sync_add_and_fetch(&outstanding_jobs, 1);
+    
+    Worker * self = currentWorker();
+    
+    if(job->getPriority() == JOB_PRIORITY_HIGH || !self) {
+        shared_lock.lock();
+        if(job->getPriority() == JOB_PRIORITY_HIGH)
+            high_priority_jobs.push_back(job);
+        else
+            submitted_jobs.push_back(job);
+        __sync_add_and_fetch(&shared_jobs, 1);
+        shared_lock.unlock();
+    } else {
+        self->lock.lock();
+        self->jobs.push_back(job);
+        self->lock.unlock();
+    }
+    
+    __sync_add_and_fetch(&queued_jobs, 1);
+    
+    // Either a worker going to sleep sees queued_jobs, or we see that it is sleeping.
+    __sync_synchronize();
+    if(sleeping_workers) {
+        job_queue_mutex.lock();
+        job_queue_cond.notify_one();
+        job_queue_mutex.unlock();
+    }
 
     return true;
 }
 
-// When this function is released, it means a thread in the threadpool has had a semaphore
-// released, signalling that there is a job available.
-// @return A pointer to the task to start, or NULL if the thread should exit.
-ThreadJob * ThreadPool::startJob()
+// Find the next job for a worker (or NULL if there are none): high priority
+// jobs first, then the worker's own newest job, then jobs submitted from
+// outside the pool, and finally the oldest job of another worker.
+ThreadJob * ThreadPool::findJob(Worker * self)
 {
     ThreadJob * job = NULL;
     
-    struct timespec wait_time = {0};
-    wait_time.tv_sec = 1;
-
-    job_queue_mutex.lock();
-
-    while(true) {
-        //if we are quitting, then allow tht thread to quit
-        if(threads_exit.isSet())
-            break;
-        //if we hit this, there is a job in the queue and we are the only thread that can acquire it
-        if(!jobs.empty())
-            break;
-        
-        job_queue_cond.wait(job_queue_mutex);
+    if(shared_jobs) {
+        shared_lock.lock();
+        if(!high_priority_jobs.empty()) {
+            job = high_priority_jobs.front();
+            high_priority_jobs.pop_front();
+            __sync_sub_and_fetch(&shared_jobs, 1);
+        }
+        shared_lock.unlock();
     }
-
-    jobs_running_mutex.lock();
-    num_jobs_running++;
-    jobs_running_mutex.unlock();
     
-    if(!threads_exit.isSet()) {
-        job = jobs.pop();
+    if(!job && self) {
+        self->lock.lock();
+        if(!self->jobs.empty()) {
+            job = self->jobs.back();
+            self->jobs.pop_back();
+        }
+        self->lock.unlock();
     }
+    
+    if(!job && shared_jobs) {
+        shared_lock.lock();
+        if(!submitted_jobs.empty()) {
+            job = submitted_jobs.front();
+            submitted_jobs.pop_front();
+            __sync_sub_and_fetch(&shared_jobs, 1);
+        }
+        shared_lock.unlock();
+    }
+    
+    if(!job)
+        job = stealJob(self);
+    
+    if(job)
+        __sync_sub_and_fetch(&queued_jobs, 1);
+    
+    return job;
+}
 
-    job_queue_mutex.unlock();
-
-	if(threads_exit.isSet())
-		return NULL;
-	
-	return job;
+ThreadJob * ThreadPool::stealJob(Worker * self)
+{
+    size_t num_workers = workers.size();
+    if(!num_workers || !queued_jobs)
+        return NULL;
+    
+    // start at a pseudo-random victim so thieves don't all pile onto the same worker
+    size_t first = 0;
+    if(self) {
+        self->steal_seed = self->steal_seed * 1103515245 + 12345;
+        first = (self->steal_seed >> 16) % num_workers;
+    }
+    
+    for(size_t i = 0; i < num_workers; i++) {
+        Worker * victim = workers[(first + i) % num_workers];
+        if(victim == self)
+            continue;
+        
+        ThreadJob * job = NULL;
+        victim->lock.lock();
+        if(!victim->jobs.empty()) {
+            job = victim->jobs.front();
+            victim->jobs.pop_front();
+        }
+        victim->lock.unlock();
+        
+        if(job)
+            return job;
+    }
+    
+    return NULL;
 }
 
-void ThreadPool::stopJob(ThreadJob * job)
+void ThreadPool::runJob(ThreadJob * job)
 {
-    // Determine if all jobs are complete, and there are no more jobs in the queue.
-    // If so, we can notify the waitForJobCompletion threads.
+    // the job may be deleted (by us, or whoever is waiting for it) once it has run
+    ThreadJobGroup * group = job->group;
     
-    jobs_running_mutex.lock();
-    num_jobs_running--;
-    bool all_jobs_complete = (0 == num_jobs_running) && jobs.empty();
-    jobs_running_mutex.unlock();
+    job->runJob();
     
     if(job->deleteOnCompletion())
         delete job;
     else
         job->done.set();
     
-	if(all_jobs_complete) {
+    if(group) {
+        group->lock.lock();
+        if(0 == --group->pending)
+            group->cv.notify_all();
+        group->lock.unlock();
+    }
+    
+    if(0 == __sync_sub_and_fetch(&outstanding_jobs, 1)) {
         busy_mutex.lock();
         busy_cond.notify_all();
         busy_mutex.unlock();
@@ -152,39 +245,71 @@ void ThreadPool::stopJob(ThreadJob * job)
 void ThreadPool::waitForJobCompletion()
 {
     busy_mutex.lock();
-    
-    while(true) {
-        jobs_running_mutex.lock();
-        bool empty = jobs.empty() && 0 == num_jobs_running;
-        jobs_running_mutex.unlock();
+    while(outstanding_jobs)
+        busy_cond.wait(busy_mutex);
+    busy_mutex.unlock();
+}
 
-        if(empty) break;
+void ThreadPool::waitForJobCompletion(ThreadJobGroup & group)
+{
+    // A worker blocking here could starve the group it is waiting for, so
+    // it helps out instead. Once there is nothing left to run, the rest of
+    // the group is running on other threads, and it can sleep.
+    //
+    // pending is only read with the group's lock held, so that the group
+    // (which is often on the caller's stack) can't go away while runJob()
+    // is still signalling it.
+    Worker * self = currentWorker();
+    
+    group.lock.lock();
+    while(group.pending) {
+        ThreadJob * job = NULL;
+        if(self) {
+            group.lock.unlock();
+            job = findJob(self);
+            if(job)
+                runJob(job);
+            group.lock.lock();
+        }
         
-        busy_cond.wait(busy_mutex);
+        if(!job && group.pending)
+            group.cv.wait(group.lock);
     }
-    
-    busy_mutex.unlock();
+    group.lock.unlock();
 }
 
 int ThreadPool::numJobs()
 {
-	return jobs.size();
+	return queued_jobs;
 }
 
-void * ThreadPool::thread_start(void * thread_pool)
+void * ThreadPool::thread_start(void * data)
 {
     ogeNameThread("TPoolWorker");
-	ThreadPool * pool = (ThreadPool *)thread_pool;
+	Worker * self = (Worker *) data;
+	ThreadPool * pool = self->pool;
+    pthread_setspecific(pool->worker_key, self);
+    
 	while(true)
-	{		
-		// now pull and do the job
-		ThreadJob * job = pool->startJob();
-		if(job == NULL)
-			return NULL;
-		job->runJob();
-		pool->stopJob(job);
+	{
+		ThreadJob * job = pool->findJob(self);
+		if(job) {
+            pool->runJob(job);
+            continue;
+        }
+        
+        // nothing to do; sleep until a job is added
+        pool->job_queue_mutex.lock();
+        __sync_add_and_fetch(&pool->sleeping_workers, 1);
+        __sync_synchronize();
+        while(!pool->queued_jobs && !pool->threads_exit.isSet())
+            pool->job_queue_cond.wait(pool->job_queue_mutex);
+        __sync_sub_and_fetch(&pool->sleeping_workers, 1);
+        pool->job_queue_mutex.unlock();
+        
+        if(pool->threads_exit.isSet())
+            return NULL;
 	}
-	
 }
 
 ThreadJob::~ThreadJob() {}
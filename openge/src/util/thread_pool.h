@@ -20,11 +20,13 @@
 
 #include <vector>
 #include <queue>
+#include <deque>
 #include <cassert>
 #include <pthread.h>
 #include <semaphore.h>
 
 #include <algorithm>
+#include <iterator>
 
 #include <unistd.h>
 
@@ -219,6 +221,126 @@ protected:
     condition_variable wait_cv;
 };
 
+// Bounded queue for exactly one producer thread and one consumer thread.
+// push() and pop() don't take any locks while the queue is neither full nor
+// empty. When it is, the waiting side parks on a condition variable, and is
+// woken by the other side. The producer calls close() when it has finished,
+// after which pop() returns false once the queue has been drained.
+#define OGE_CACHE_LINE_SIZE 64
+
+template <class T>
+class SpscRing
+{
+public:
+    SpscRing(size_t min_capacity = 1024)
+    : head(0)
+    , tail(0)
+    , closed(false)
+    , consumer_waiting(0)
+    , producer_waiting(0)
+    {
+        capacity = 1;
+        while(capacity < min_capacity)
+            capacity *= 2;
+        mask = capacity - 1;
+        items.resize(capacity);
+    }
+    
+    size_t getCapacity() const { return capacity; }
+    size_t size() const { return tail - head; }
+    bool empty() const { return tail == head; }
+    bool isClosed() const { return closed; }
+    
+    bool try_push(const T & item) {
+        size_t t = tail;
+        if(t - head == capacity)
+            return false;
+        items[t & mask] = item;
+        __sync_synchronize();   // item must be visible before the new tail
+        tail = t + 1;
+        wake(consumer_waiting);
+        return true;
+    }
+    
+    bool try_pop(T & item) {
+        size_t h = head;
+        if(h == tail)
+            return false;
+        __sync_synchronize();   // don't read the item before seeing the tail
+        item = items[h & mask];
+        __sync_synchronize();   // finish reading the slot before handing it back
+        head = h + 1;
+        wake(producer_waiting);
+        return true;
+    }
+    
+    void push(const T & item) {
+        while(!try_push(item)) {
+            park_lock.lock();
+            producer_waiting = 1;
+            __sync_synchronize();
+            if(tail - head == capacity)
+                park_cv.wait(park_lock);
+            producer_waiting = 0;
+            park_lock.unlock();
+        }
+    }
+    
+    // Returns false if the queue is closed and empty.
+    bool pop(T & item) {
+        while(!try_pop(item)) {
+            park_lock.lock();
+            consumer_waiting = 1;
+            __sync_synchronize();
+            bool done = false;
+            if(head == tail) {
+                if(closed)
+                    done = true;
+                else
+                    park_cv.wait(park_lock);
+            }
+            consumer_waiting = 0;
+            park_lock.unlock();
+            if(done)
+                return false;
+        }
+        return true;
+    }
+    
+    void close() {
+        park_lock.lock();
+        closed = true;
+        park_cv.notify_all();
+        park_lock.unlock();
+    }
+    
+protected:
+    // Full barriers on both sides ensure that either the waiting thread sees the
+    // change to head/tail before it sleeps, or this thread sees the waiting flag.
+    void wake(volatile int & waiting) {
+        __sync_synchronize();
+        if(waiting) {
+            park_lock.lock();
+            park_cv.notify_all();
+            park_lock.unlock();
+        }
+    }
+    
+    // head is only written by the consumer and tail by the producer, so they are
+    // kept on separate cache lines.
+    volatile size_t head;
+    char head_padding[OGE_CACHE_LINE_SIZE - sizeof(size_t)];
+    volatile size_t tail;
+    char tail_padding[OGE_CACHE_LINE_SIZE - sizeof(size_t)];
+    
+    std::vector<T> items;
+    size_t capacity, mask;
+    volatile bool closed;
+    volatile int consumer_waiting, producer_waiting;
+    mutex park_lock;
+    condition_variable park_cv;
+};
+
 class SynchronizedFlag {
     Spinlock s;
     bool b;
@@ -281,6 +403,29 @@ protected:
 
 class ThreadPool;
 
+// Jobs that something is waiting on right now (eg. decompressing the next
+// BGZF block a reader needs) should be high priority. High priority jobs
+// are started in the order they were submitted, before any normal job.
+enum ThreadJobPriority {
+    JOB_PRIORITY_HIGH,
+    JOB_PRIORITY_NORMAL
+};
+
+// A set of jobs that can be waited on together, without waiting for
+// everything else running in the pool. Pass the group to addJob(), then
+// call waitForJobCompletion(group).
+class ThreadJobGroup
+{
+    friend class ThreadPool;
+public:
+    ThreadJobGroup() : pending(0) {}
+    int numPending() const { return pending; }
+protected:
+    volatile int pending;
+    mutex lock;
+    condition_variable cv;
+};
+
 // The ThreadJob abstract class provides a way to provide jobs to
 // the ThreadPool thread pool. To use, create a thread pool, subclass ThreadJob,
 // implement the runJob method of your subclass, and pass an instance to the pool's
@@ -289,15 +434,22 @@ class ThreadJob
 {
 	friend class ThreadPool;
 public:
-    ThreadJob() : done(false) {}
+    ThreadJob() : done(false), group(NULL) {}
     virtual ~ThreadJob();
 	virtual void runJob() = 0;
     virtual bool deleteOnCompletion() { return false; }
+    virtual ThreadJobPriority getPriority() { return JOB_PRIORITY_NORMAL; }
     bool isDone() { return done.isSet(); }
 protected:
     SynchronizedFlag done;
+    ThreadJobGroup * group;
 };
 
+// Each worker thread has its own deque of jobs. Jobs submitted by a worker
+// go on its own deque, and are run newest first, while the data they use is
+// still in cache. Idle workers steal the oldest jobs from other workers.
+// Jobs submitted from outside the pool, and high priority jobs, go on
+// shared queues and run oldest first.
 class ThreadPool
 {
 	friend class ThreadJob;
@@ -305,29 +457,48 @@ public:
 	ThreadPool( int threads = 0);
 	virtual ~ThreadPool();
 	
-	bool addJob(ThreadJob * job);
+	bool addJob(ThreadJob * job, ThreadJobGroup * group = NULL);
 	int numJobs();
 	static int availableCores();
+    
+    // Wait for every job in the pool, or only the jobs in a group. When a
+    // worker of this pool waits for a group, it runs other jobs meanwhile,
+    // so jobs may safely wait for groups of jobs they have submitted.
 	void waitForJobCompletion();
+	void waitForJobCompletion(ThreadJobGroup & group);
     static ThreadPool * sharedPool();
     static void closeSharedPool();
     static bool sharedPoolIsStarted() { return NULL != _sharedPool; }
 	
 protected:
+    struct Worker {
+        ThreadPool * pool;
+        pthread_t thread;
+        Spinlock lock;
+        std::deque<ThreadJob *> jobs;     // owner uses the back, thieves the front
+        unsigned int steal_seed;
+    };
+    
     static ThreadPool * _sharedPool;
-	static void * thread_start(void * thread_pool);
-	ThreadJob * startJob();
-	void stopJob(ThreadJob * job);
+	static void * thread_start(void * worker);
+    Worker * currentWorker();
+    ThreadJob * findJob(Worker * self);
+    ThreadJob * stealJob(Worker * self);
+	void runJob(ThreadJob * job);
     
+    std::vector<Worker *> workers;
+    pthread_key_t worker_key;
+    
+    Spinlock shared_lock;
+    std::deque<ThreadJob *> high_priority_jobs, submitted_jobs;
+    volatile int shared_jobs;           // in high_priority_jobs or submitted_jobs
+    
+    volatile int queued_jobs;           // waiting in any queue
+    volatile int outstanding_jobs;      // queued or running
+    volatile int sleeping_workers;
     condition_variable job_queue_cond, busy_cond;
-    mutex job_queue_mutex;
-	
-    SynchronizedQueue<ThreadJob *> jobs;
-	std::vector<pthread_t> threads;
+    mutex job_queue_mutex, busy_mutex;
 	SynchronizedFlag threads_exit;
-	Spinlock jobs_running_mutex;
-    int num_jobs_running;
-	mutex busy_mutex;
 };
 
 template<typename _RandomAccessIterator, typename _Compare>
@@ -336,64 +507,158 @@ class OGESortJob : public ThreadJob
 protected:
     _RandomAccessIterator first, last;
     _Compare comp;
-    int & completion_ct;
-    Spinlock & completion_spinlock;
 
     virtual void runJob() {
         std::sort(first, last, comp);
-        completion_spinlock.lock();
-        completion_ct++;
-        completion_spinlock.unlock();
     }
 public:
-    OGESortJob(_RandomAccessIterator __first, _RandomAccessIterator __last,
-               _Compare __comp, int & completion_ct, Spinlock & completion_spinlock)
+    OGESortJob(_RandomAccessIterator __first, _RandomAccessIterator __last, _Compare __comp)
     : first(__first)
     , last(__last)
     , comp(__comp)
-    , completion_ct(completion_ct)
-    , completion_spinlock(completion_spinlock)
     {}
+    virtual bool deleteOnCompletion() { return true; }
 };
 
+// Merges [a_first, a_last) and [b_first, b_last) to out. Elements of the
+// first range come first when equal, as with std::merge.
+template<typename _InputIterator, typename _OutputIterator, typename _Compare>
+class OGEMergeJob : public ThreadJob
+{
+protected:
+    _InputIterator a_first, a_last, b_first, b_last;
+    _OutputIterator out;
+    _Compare comp;
+    
+    virtual void runJob() {
+        std::merge(a_first, a_last, b_first, b_last, out, comp);
+    }
+public:
+    OGEMergeJob(_InputIterator a_first, _InputIterator a_last, _InputIterator b_first, _InputIterator b_last, _OutputIterator out, _Compare comp)
+    : a_first(a_first), a_last(a_last)
+    , b_first(b_first), b_last(b_last)
+    , out(out)
+    , comp(comp)
+    {}
+    virtual bool deleteOnCompletion() { return true; }
+};
+
+// Number of elements from a in the first k elements of the stable merge of
+// a (length a_len) and b (length b_len).
+template<typename _RandomAccessIterator, typename _Compare>
+size_t ogeMergeSplit(_RandomAccessIterator a, size_t a_len, _RandomAccessIterator b, size_t b_len, size_t k, _Compare comp)
+{
+    size_t lo = k > b_len ? k - b_len : 0;
+    size_t hi = std::min(k, a_len);
+    
+    while(lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        size_t j = k - i;
+        if(j > 0 && i < a_len && !comp(b[j-1], a[i]))
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+// One round of ogeSortMt's merge: merge neighbouring pairs of the sorted runs
+// in src to the same offsets in dst. Each pair is cut into pieces of equal
+// output size so that every thread has work, even in the last round.
+template<typename _SrcIterator, typename _DstIterator, typename _Compare>
+void ogeMergeRound(_SrcIterator src, _DstIterator dst, std::vector<size_t> & runs, _Compare comp, size_t pieces_per_round)
+{
+    ThreadPool * shared_pool = ThreadPool::sharedPool();
+    ThreadJobGroup merge_jobs;
+    size_t total = runs.back();
+    std::vector<size_t> merged_runs;
+    ThreadJob * last_job = NULL;
+    
+    for(size_t r = 0; r + 1 < runs.size(); r += 2) {
+        size_t a_start = runs[r];
+        size_t b_start = runs[r+1];
+        size_t b_end = (r + 2 < runs.size()) ? runs[r+2] : b_start;    // an odd run out is just copied
+        size_t a_len = b_start - a_start, b_len = b_end - b_start;
+        size_t len = a_len + b_len;
+        size_t pieces = std::max((size_t)1, (len * pieces_per_round + total - 1) / total);
+        
+        size_t prev_k = 0, prev_i = 0;
+        for(size_t p = 1; p <= pieces; p++) {
+            size_t k = len * p / pieces;
+            size_t i = ogeMergeSplit(src + a_start, a_len, src + b_start, b_len, k, comp);
+            
+            if(last_job)
+                shared_pool->addJob(last_job, &merge_jobs);
+            last_job = new OGEMergeJob<_SrcIterator, _DstIterator, _Compare>(src + a_start + prev_i, src + a_start + i,
+                                                                                src + b_start + (prev_k - prev_i), src + b_start + (k - i),
+                                                                                dst + a_start + prev_k, comp);
+            prev_k = k;
+            prev_i = i;
+        }
+        merged_runs.push_back(a_start);
+    }
+    merged_runs.push_back(total);
+    
+    // the calling thread does a share of the work rather than just waiting
+    if(last_job) {
+        last_job->runJob();
+        delete last_job;
+    }
+    shared_pool->waitForJobCompletion(merge_jobs);
+    
+    runs.swap(merged_runs);
+}
+
+// Multithreaded replacement for std::sort. The range is cut into one chunk
+// per thread, and the chunks are sorted in parallel. Sorted runs are then
+// merged pairwise, with every merge split between the threads, ping-ponging
+// between the range and a temporary buffer.
 template<typename _RandomAccessIterator, typename _Compare>
 inline void
 ogeSortMt(_RandomAccessIterator __first, _RandomAccessIterator __last,
 	 _Compare __comp)
 {
-    if(!OGEParallelismSettings::isMultithreadingEnabled())
-        return sort(__first, __last, __comp);
+    typedef typename std::iterator_traits<_RandomAccessIterator>::value_type value_type;
+    typedef typename std::vector<value_type>::iterator buffer_iterator;
+    
+    size_t n = __last - __first;
+    size_t num_threads = std::max(OGEParallelismSettings::getNumberThreads(), 1);
+    
+    // below this size, dispatching the jobs costs more than it saves
+    const size_t min_chunk_size = 4096;
     
-    size_t job_size = (__last - __first) / ThreadPool::availableCores();
+    if(!OGEParallelismSettings::isMultithreadingEnabled() || num_threads == 1 || n < 2 * min_chunk_size)
+        return std::sort(__first, __last, __comp);
+    
+    size_t num_chunks = std::min(num_threads, n / min_chunk_size);
+    std::vector<size_t> runs;
+    for(size_t i = 0; i <= num_chunks; i++)
+        runs.push_back(n * i / num_chunks);
     
     ThreadPool * shared_pool = ThreadPool::sharedPool();
-    int completion_ct = 1;
-    Spinlock completion_spinlock;
+    ThreadJobGroup sort_jobs;
     
     //perform separate sorts
-    for(int i = 0; i < ThreadPool::availableCores() - 1; i++) {
-        shared_pool->addJob(new OGESortJob<_RandomAccessIterator, _Compare>(__first + i * job_size, __first + (i+1) * job_size, __comp, completion_ct, completion_spinlock));
-    }
+    for(size_t i = 0; i + 1 < num_chunks; i++)
+        shared_pool->addJob(new OGESortJob<_RandomAccessIterator, _Compare>(__first + runs[i], __first + runs[i+1], __comp), &sort_jobs);
 
-    std::sort(__first + (ThreadPool::availableCores() - 1) * job_size, __last, __comp);
+    std::sort(__first + runs[num_chunks - 1], __last, __comp);
 
-    //wait for completion:
-    while(true) {
-        completion_spinlock.lock();
-        bool complete = (ThreadPool::availableCores() == completion_ct);
-        completion_spinlock.unlock();
-        if(complete)
-            break;
-        usleep(20000);
-    }
+    shared_pool->waitForJobCompletion(sort_jobs);
 
-    //now merge sorted subarrays
-    for(int i = 1; i < ThreadPool::availableCores(); i++)  {
-        if(i == ThreadPool::availableCores() - 1)   //last
-            inplace_merge(__first, __first + i * job_size, __last, __comp);
+    //now merge sorted runs
+    std::vector<value_type> buffer(n);
+    bool in_buffer = false;
+    while(runs.size() > 2) {
+        if(in_buffer)
+            ogeMergeRound<buffer_iterator, _RandomAccessIterator, _Compare>(buffer.begin(), __first, runs, __comp, num_threads);
         else
-            inplace_merge(__first, __first + i * job_size, __first + (i+1) * job_size, __comp);
+            ogeMergeRound<_RandomAccessIterator, buffer_iterator, _Compare>(__first, buffer.begin(), runs, __comp, num_threads);
+        in_buffer = !in_buffer;
     }
+    
+    if(in_buffer)
+        std::copy(buffer.begin(), buffer.end(), __first);
 }
 
 
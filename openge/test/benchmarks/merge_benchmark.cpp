@@ -0,0 +1,186 @@
+/*********************************************************************
+ *
+ * merge_benchmark.cpp: Compare k-way merges of sorted runs of reads.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Splits a set of generated reads into sorted runs, and merges them
+ * with a std::multiset ordered by the BamTools comparators (as
+ * MultiReader and SortedMerge used to), and with a LoserTree on merge
+ * keys, by position and by name. Both outputs are checked to be in
+ * order and to contain every read, so this also serves as a
+ * correctness test.
+ *
+ * Usage: merge_benchmark [reads]
+ *
+ *********************************************************************/
+
+#include "../../src/util/oge_read.h"
+#include "../../src/util/loser_tree.h"
+#include "../../src/util/read_sort_keys.h"
+#include "../../src/util/bamtools/Sort.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <iostream>
+#include <cstdlib>
+#include <set>
+#include <sys/time.h>
+
+using namespace std;
+using namespace BamTools::Algorithms;
+
+static double now() {
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + 1e-6 * t.tv_usec;
+}
+
+template <class compare_t>
+class MultisetElement {
+public:
+    OGERead * read;
+    size_t source;
+    bool operator<(const MultisetElement & t) const {
+        return compare_t()(read, t.read);
+    }
+    MultisetElement(OGERead * read, size_t source)
+    : read(read)
+    , source(source)
+    {}
+};
+
+template <class compare_t>
+static void multisetMerge(const vector<vector<OGERead *> > & runs, vector<OGERead *> & out) {
+    multiset<MultisetElement<compare_t> > reads;
+    vector<size_t> next(runs.size(), 0);
+
+    for(size_t i = 0; i < runs.size(); i++)
+        if(!runs[i].empty())
+            reads.insert(MultisetElement<compare_t>(runs[i][next[i]++], i));
+
+    while(!reads.empty()) {
+        MultisetElement<compare_t> el = *reads.begin();
+        reads.erase(reads.begin());
+        out.push_back(el.read);
+
+        if(next[el.source] < runs[el.source].size()) {
+            el.read = runs[el.source][next[el.source]++];
+            reads.insert(el);
+        }
+    }
+}
+
+static void loserTreeMerge(const vector<vector<OGERead *> > & runs, vector<OGERead *> & out, bool by_name) {
+    ReadMergeLess merge_less(by_name);
+    LoserTree<ReadMergeItem, ReadMergeLess> reads(runs.size(), merge_less);
+    vector<size_t> next(runs.size(), 0);
+
+    for(size_t i = 0; i < runs.size(); i++)
+        if(!runs[i].empty())
+            reads.setItem(i, merge_less.item(runs[i][next[i]++]));
+    reads.build();
+
+    while(!reads.empty()) {
+        out.push_back(reads.top().read);
+
+        size_t source = reads.topSource();
+        if(next[source] < runs[source].size())
+            reads.replaceTop(merge_less.item(runs[source][next[source]++]));
+        else
+            reads.popTop();
+    }
+}
+
+template <class compare_t>
+static bool checkMerge(const vector<OGERead *> & reads, const vector<OGERead *> & merged, compare_t comp) {
+    if(merged.size() != reads.size())
+        return false;
+
+    for(size_t i = 1; i < merged.size(); i++)
+        if(comp(merged[i], merged[i-1]))
+            return false;
+
+    set<OGERead *> seen(merged.begin(), merged.end());
+    return seen.size() == reads.size() && seen == set<OGERead *>(reads.begin(), reads.end());
+}
+
+int main(int argc, const char ** argv) {
+    size_t num_reads = argc > 1 ? atol(argv[1]) : 2000000;
+    const size_t run_counts[] = {64, 256, 1024};
+    bool ok = true;
+
+    srand(1);
+    vector<OGERead *> reads(num_reads);
+    for(size_t i = 0; i < num_reads; i++) {
+        OGERead * read = new OGERead();
+        char name[32];
+        // some names repeat, so that some reads are tied on position and name
+        sprintf(name, "SIM:%d:%d", rand() % 8, rand() % (int)(num_reads / 2 + 1));
+        read->setName(name);
+
+        if(rand() % 50 == 0)
+            read->setRefID(-1);
+        else {
+            read->setRefID(rand() % 24);
+            read->setPosition(rand() % 1000000);
+        }
+        read->setAlignmentFlag(rand() % 2 ? 0x10 : 0);
+        reads[i] = read;
+    }
+
+    for(int by_name = 0; by_name < 2; by_name++) {
+        for(size_t r = 0; r < sizeof(run_counts) / sizeof(run_counts[0]); r++) {
+            vector<vector<OGERead *> > runs(run_counts[r]);
+            for(size_t i = 0; i < num_reads; i++)
+                runs[rand() % runs.size()].push_back(reads[i]);
+            for(size_t i = 0; i < runs.size(); i++) {
+                if(by_name)
+                    stable_sort(runs[i].begin(), runs[i].end(), ReadNameLess());
+                else
+                    stable_sort(runs[i].begin(), runs[i].end(), ReadPositionLess());
+            }
+
+            vector<OGERead *> multiset_out, loser_tree_out;
+            multiset_out.reserve(num_reads);
+            loser_tree_out.reserve(num_reads);
+
+            double start = now();
+            if(by_name)
+                multisetMerge<Sort::ByName>(runs, multiset_out);
+            else
+                multisetMerge<Sort::ByPosition>(runs, multiset_out);
+            double multiset_time = now() - start;
+
+            start = now();
+            loserTreeMerge(runs, loser_tree_out, by_name);
+            double loser_tree_time = now() - start;
+
+            bool multiset_ok, loser_tree_ok;
+            if(by_name) {
+                multiset_ok = checkMerge(reads, multiset_out, ReadNameLess());
+                loser_tree_ok = checkMerge(reads, loser_tree_out, ReadNameLess());
+            } else {
+                multiset_ok = checkMerge(reads, multiset_out, ReadPositionLess());
+                loser_tree_ok = checkMerge(reads, loser_tree_out, ReadPositionLess());
+            }
+
+            cout << (by_name ? "By name" : "By position") << ", " << num_reads << " reads in " << runs.size() << " runs: multiset "
+                 << multiset_time << "s" << (multiset_ok ? "" : " FAILED")
+                 << ", loser tree " << loser_tree_time << "s" << (loser_tree_ok ? "" : " FAILED") << endl;
+            ok = ok && multiset_ok && loser_tree_ok;
+        }
+    }
+
+    for(size_t i = 0; i < num_reads; i++)
+        delete reads[i];
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+/*********************************************************************
+ *
+ * queue_benchmark.cpp: Compare module-to-module queue implementations.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Passes a number of items from one producer thread to one consumer
+ * thread, first through a SynchronizedQueue polled with usleep() (as
+ * AlgorithmModule used to), then through an SpscRing. Each item is
+ * checked on arrival, so this also serves as a correctness test.
+ *
+ * Usage: queue_benchmark [items]
+ *
+ *********************************************************************/
+
+#include "../../src/util/thread_pool.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <sys/time.h>
+
+using namespace std;
+
+const size_t QUEUE_LIMIT = 6000;
+
+struct BenchmarkData {
+    size_t items;
+    SynchronizedQueue<size_t> queue;
+    SynchronizedFlag producer_done;
+    SpscRing<size_t> ring;
+    
+    BenchmarkData(size_t items)
+    : items(items)
+    , producer_done(false)
+    , ring(QUEUE_LIMIT)
+    {}
+};
+
+static double now() {
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + 1e-6 * t.tv_usec;
+}
+
+static void * queueProducer(void * d) {
+    BenchmarkData * data = (BenchmarkData *) d;
+    for(size_t i = 0; i < data->items; i++) {
+        while(data->queue.size() > QUEUE_LIMIT)
+            usleep(10000);
+        data->queue.push(i);
+    }
+    data->producer_done.set();
+    return NULL;
+}
+
+static bool queueConsumer(BenchmarkData * data) {
+    size_t expected = 0;
+    while(true) {
+        while(data->queue.empty()) {
+            if(data->producer_done.isSet() && data->queue.empty())
+                return expected == data->items;
+            usleep(10000);
+        }
+        if(data->queue.pop() != expected++)
+            return false;
+    }
+}
+
+static void * ringProducer(void * d) {
+    BenchmarkData * data = (BenchmarkData *) d;
+    for(size_t i = 0; i < data->items; i++)
+        data->ring.push(i);
+    data->ring.close();
+    return NULL;
+}
+
+static bool ringConsumer(BenchmarkData * data) {
+    size_t expected = 0, item;
+    while(data->ring.pop(item))
+        if(item != expected++)
+            return false;
+    return expected == data->items;
+}
+
+static bool runBenchmark(const char * name, void * (*producer)(void *), bool (*consumer)(BenchmarkData *), size_t items) {
+    BenchmarkData data(items);
+    pthread_t thread;
+    
+    double start = now();
+    pthread_create(&thread, NULL, producer, &data);
+    bool ok = consumer(&data);
+    pthread_join(thread, NULL);
+    double elapsed = now() - start;
+    
+    cout << name << ": " << items << " items in " << elapsed << "s (" << (size_t)(items / elapsed) << " items/s)" << (ok ? "" : " FAILED") << endl;
+    return ok;
+}
+
+int main(int argc, const char ** argv) {
+    size_t items = argc > 1 ? atol(argv[1]) : 10000000;
+    
+    bool ok = runBenchmark("SynchronizedQueue", queueProducer, queueConsumer, items);
+    ok = runBenchmark("SpscRing         ", ringProducer, ringConsumer, items) && ok;
+    
+    return ok ? 0 : 1;
+}
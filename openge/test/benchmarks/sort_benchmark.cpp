@@ -0,0 +1,105 @@
+/*********************************************************************
+ *
+ * sort_benchmark.cpp: Compare parallel sort implementations.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Sorts the same random data with std::sort, with the previous
+ * ogeSortMt merge (chunks sorted in parallel, then merged by a chain
+ * of serial inplace_merge calls), and with ogeSortMt, for several
+ * thread counts. Data with many duplicate keys is included. Every
+ * result is compared against std::sort, so this also serves as a
+ * correctness test.
+ *
+ * Usage: sort_benchmark [elements]
+ *
+ *********************************************************************/
+
+#include "../../src/util/thread_pool.h"
+
+#include <stdint.h>
+#include <iostream>
+#include <cstdlib>
+#include <sys/time.h>
+
+using namespace std;
+
+static double now() {
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + 1e-6 * t.tv_usec;
+}
+
+static bool lessThan(const uint64_t & a, const uint64_t & b) {
+    return a < b;
+}
+
+// ogeSortMt as it was before the merge phase was parallelised
+static void serialMergeSort(vector<uint64_t>::iterator first, vector<uint64_t>::iterator last) {
+    int chunks = OGEParallelismSettings::getNumberThreads();
+    size_t job_size = (last - first) / chunks;
+    ThreadJobGroup sort_jobs;
+
+    for(int i = 0; i < chunks - 1; i++)
+        ThreadPool::sharedPool()->addJob(new OGESortJob<vector<uint64_t>::iterator, bool (*)(const uint64_t &, const uint64_t &)>(first + i * job_size, first + (i+1) * job_size, lessThan), &sort_jobs);
+    std::sort(first + (chunks - 1) * job_size, last, lessThan);
+    ThreadPool::sharedPool()->waitForJobCompletion(sort_jobs);
+
+    for(int i = 1; i < chunks; i++)
+        inplace_merge(first, first + i * job_size, (i == chunks - 1) ? last : first + (i+1) * job_size, lessThan);
+}
+
+static bool runBenchmark(const vector<uint64_t> & data, const vector<uint64_t> & expected, bool parallel_merge, double & elapsed) {
+    vector<uint64_t> v(data);
+
+    double start = now();
+    if(parallel_merge)
+        ogeSortMt(v.begin(), v.end(), lessThan);
+    else
+        serialMergeSort(v.begin(), v.end());
+    elapsed = now() - start;
+
+    return v == expected;
+}
+
+int main(int argc, const char ** argv) {
+    size_t elements = argc > 1 ? atol(argv[1]) : 10000000;
+    const int thread_counts[] = {1, 2, 4, 8, 16};
+    bool ok = true;
+
+    srand(1);
+    for(int duplicates = 0; duplicates < 2; duplicates++) {
+        vector<uint64_t> data(elements);
+        for(size_t i = 0; i < elements; i++)
+            data[i] = duplicates ? rand() % 16 : ((uint64_t)rand() << 31) ^ rand();
+
+        vector<uint64_t> expected(data);
+        double start = now();
+        std::sort(expected.begin(), expected.end(), lessThan);
+        cout << (duplicates ? "Few distinct keys" : "Random keys") << ", " << elements << " elements. std::sort: " << now() - start << "s" << endl;
+
+        for(size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            OGEParallelismSettings::setNumberThreads(thread_counts[t]);
+            OGEParallelismSettings::enableMultithreading();
+
+            double serial_time, parallel_time;
+            bool serial_ok = runBenchmark(data, expected, false, serial_time);
+            bool parallel_ok = runBenchmark(data, expected, true, parallel_time);
+
+            cout << "  " << thread_counts[t] << " threads: serial merge " << serial_time << "s" << (serial_ok ? "" : " FAILED")
+                 << ", parallel merge " << parallel_time << "s" << (parallel_ok ? "" : " FAILED") << endl;
+            ok = ok && serial_ok && parallel_ok;
+
+            ThreadPool::closeSharedPool();
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+/*********************************************************************
+ *
+ * spill_benchmark.cpp: Time temp file codecs, and check round trips.
+ * Open Genomics Engine
+ *
+ *********************************************************************
+ *
+ * This file is released under the Virginia Tech Non-Commercial
+ * Purpose License. A copy of this license has been provided in
+ * the openge/ directory.
+ *
+ *********************************************************************
+ *
+ * Writes generated reads to spill files with each temp file codec,
+ * and reads them back. Long reads with random names, bases and
+ * qualities give blocks that don't compress, and must be stored as
+ * they are; a single read repeated over and over gives blocks that
+ * compress very well, with long matches, and must shrink. Every read
+ * must come back unchanged, so this also serves as a test of the LZ4
+ * block codec.
+ *
+ * Usage: spill_benchmark [reads]
+ *
+ *********************************************************************/
+
+#include "../../src/util/spill_file.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <iostream>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+using namespace std;
+
+static double now() {
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + 1e-6 * t.tv_usec;
+}
+
+static string randomString(const char * alphabet, size_t alphabet_size, size_t len) {
+    string s(len, ' ');
+    for(size_t i = 0; i < len; i++)
+        s[i] = alphabet[rand() % alphabet_size];
+    return s;
+}
+
+static OGERead * randomRead() {
+    static const char name_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789:";
+    static const char bases[] = "=ACMGRSVTWYHKDBN";
+    OGERead * read = new OGERead();
+    size_t length = 1000 + rand() % 4000;
+    string qualities(length, ' ');
+    for(size_t i = 0; i < length; i++)
+        qualities[i] = 33 + rand() % 200;
+
+    read->setName(randomString(name_chars, sizeof(name_chars) - 1, 10 + rand() % 40));
+    read->setRefID(rand() % 24);
+    read->setPosition(rand() % 100000000);
+    read->setMapQuality(rand() % 61);
+    read->setAlignmentFlag(rand() % 0x800);
+    read->setQueryBases(randomString(bases, 16, length));
+    read->setQualities(qualities);
+    vector<CigarOp> cigar;
+    cigar.push_back(CigarOp('M', length));
+    read->setCigarData(cigar);
+    read->setMateRefID(rand() % 24);
+    read->setMatePosition(rand() % 100000000);
+    read->setInsertSize(rand() % 2000 - 1000);
+    return read;
+}
+
+static bool sameRead(const OGERead * a, const OGERead * b) {
+    return a->getRefID() == b->getRefID() && a->getPosition() == b->getPosition()
+        && a->getMapQuality() == b->getMapQuality() && a->getAlignmentFlag() == b->getAlignmentFlag()
+        && a->getMateRefID() == b->getMateRefID() && a->getMatePosition() == b->getMatePosition()
+        && a->getInsertSize() == b->getInsertSize()
+        && a->getBamEncodedStringData() == b->getBamEncodedStringData();
+}
+
+// Writes the reads with the codec, reads them back and compares them. Returns
+// the size of the file, or 0 if the reads didn't come back the same.
+static size_t roundTrip(const vector<OGERead *> & reads, const char * codec_name, const string & filename, double & write_time, double & read_time) {
+    spill_codec_t codec;
+    SpillWriter::codecFromName(codec_name, codec);
+
+    double start = now();
+    SpillWriter writer;
+    writer.setCodec(codec);
+    if(!writer.open(filename))
+        return 0;
+    for(size_t i = 0; i < reads.size(); i++)
+        writer.write(*reads[i]);
+    writer.close();
+    write_time = now() - start;
+
+    struct stat st;
+    if(0 != stat(filename.c_str(), &st))
+        return 0;
+
+    start = now();
+    SpillReader reader;
+    if(!reader.open(filename))
+        return 0;
+    bool ok = true;
+    size_t count = 0;
+    for(OGERead * read = reader.read(); read; read = reader.read()) {
+        ok = ok && count < reads.size() && sameRead(reads[count], read);
+        count++;
+        delete read;
+    }
+    reader.close();
+    read_time = now() - start;
+
+    unlink(filename.c_str());
+    return ok && count == reads.size() ? st.st_size : 0;
+}
+
+int main(int argc, const char ** argv) {
+    size_t num_reads = argc > 1 ? atol(argv[1]) : 20000;
+    const char * codecs[] = {"none", "lz4", "deflate"};
+    bool ok = true;
+
+    char filename[64];
+    sprintf(filename, "/tmp/oge_spill_benchmark_%d", (int)getpid());
+
+    srand(1);
+    vector<OGERead *> random_reads(num_reads), repeated_reads(num_reads);
+    OGERead * repeated = randomRead();
+    size_t repeated_size = num_reads * (4 + 32 + repeated->getBamEncodedStringData().size());
+    for(size_t i = 0; i < num_reads; i++) {
+        random_reads[i] = randomRead();
+        repeated_reads[i] = repeated;
+    }
+
+    for(int repetitive = 0; repetitive < 2; repetitive++) {
+        const vector<OGERead *> & reads = repetitive ? repeated_reads : random_reads;
+        size_t uncompressed_size = 0;
+        for(size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+            double write_time = 0, read_time = 0;
+            size_t size = roundTrip(reads, codecs[c], filename, write_time, read_time);
+            bool codec_ok = size != 0;
+
+            // random blocks are stored as they are when they can't be
+            // compressed, and repeated ones must shrink
+            if(c == 0)
+                uncompressed_size = size;
+            else if(!repetitive && size > uncompressed_size)
+                codec_ok = false;
+            if(repetitive && c != 0 && size > repeated_size / 20)
+                codec_ok = false;
+
+            cout << (repetitive ? "Repeated" : "Random") << " reads, " << codecs[c] << ": " << size << " bytes, write "
+                 << write_time << "s, read " << read_time << "s" << (codec_ok ? "" : " FAILED") << endl;
+            ok = ok && codec_ok;
+        }
+    }
+
+    for(size_t i = 0; i < num_reads; i++)
+        delete random_reads[i];
+    delete repeated;
+
+    return ok ? 0 : 1;
+}
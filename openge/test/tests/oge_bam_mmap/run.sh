@@ -0,0 +1,16 @@
+#!/bin/bash
+# Files are memory mapped, while stdin is streamed. Check both give the same reads.
+source $(dirname $0)/../common.sh
+rm -f test_mapped.sam test_stream.sam
+
+$OGE view --nopg -F sam $DATA/208.yhet.bam -o test_mapped.sam || err "Failed to read memory mapped file"
+cat $DATA/208.yhet.bam | $OGE view --nopg -F sam -o test_stream.sam || err "Failed to read from stdin"
+
+cmp test_mapped.sam test_stream.sam || err "Memory mapped and streamed input differ"
+
+$OGE view --nopg -d -F sam $DATA/208.yhet.bam -o test_mapped.sam || err "Failed to read memory mapped file (no threads)"
+cmp test_mapped.sam test_stream.sam || err "Memory mapped and streamed input differ (no threads)"
+
+rm -f test_mapped.sam test_stream.sam
+
+true
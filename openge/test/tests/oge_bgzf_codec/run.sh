@@ -0,0 +1,28 @@
+#!/bin/bash
+# Round-trip a BAM file through the BGZF codec given as the first argument
+# (default zlib), and check that the decompressed data is byte-identical
+# to the original when read back with both that codec and zlib.
+source $(dirname $0)/../common.sh
+CODEC=${1:-zlib}
+rm -f test_*.bam test_*.rawbam
+
+$OGE view --nopg --codec zlib $DATA/208.yhet.bam -o test_ref.rawbam || err "Failed to decompress reference file"
+
+for LEVEL in -1 0 1 6 9; do
+    $OGE view --nopg -c $LEVEL --codec $CODEC $DATA/208.yhet.bam -o test_$LEVEL.bam || err "Failed to compress with $CODEC (level $LEVEL)"
+    
+    $OGE view --nopg --codec $CODEC test_$LEVEL.bam -o test_${LEVEL}_codec.rawbam || err "Failed to decompress with $CODEC (level $LEVEL)"
+    $OGE view --nopg --codec zlib test_$LEVEL.bam -o test_${LEVEL}_zlib.rawbam || err "Failed to decompress with zlib (level $LEVEL)"
+    
+    cmp test_ref.rawbam test_${LEVEL}_codec.rawbam || err "$CODEC round trip differs from original (level $LEVEL)"
+    cmp test_ref.rawbam test_${LEVEL}_zlib.rawbam || err "zlib decompression of $CODEC output differs from original (level $LEVEL)"
+done
+
+# and once more without the thread pool, which compresses on the calling thread
+$OGE view --nopg -d --codec $CODEC $DATA/208.yhet.bam -o test_nothreads.bam || err "Failed to compress with $CODEC (no threads)"
+$OGE view --nopg -d --codec $CODEC test_nothreads.bam -o test_nothreads.rawbam || err "Failed to decompress with $CODEC (no threads)"
+cmp test_ref.rawbam test_nothreads.rawbam || err "$CODEC round trip differs from original (no threads)"
+
+rm -f test_*.bam test_*.rawbam
+
+true
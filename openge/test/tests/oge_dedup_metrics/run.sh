@@ -0,0 +1,28 @@
+#!/bin/bash
+# Duplicate metrics must count the same duplicates, and find the same
+# optical duplicates, however duplicates are marked.
+source $(dirname $0)/../common.sh
+rm -f test_sorted.bam test_memory.txt test_stream.txt test_split.txt test_wide.txt
+
+$OGE mergesort --nopg $DATA/208.yhet.bam -o test_sorted.bam || err "Failed to sort"
+
+$OGE dedup --nopg --dedup-window 0 --nosplit --metrics test_memory.txt test_sorted.bam -o /dev/null || err "Failed to mark duplicates"
+grep -q "^## METRICS CLASS" test_memory.txt || err "Metrics file has no header"
+awk -F '\t' '$1 == "Unknown Library" { if ($7 > 0 && $8 > 0 && $8 <= $7) ok = 1 } END { exit !ok }' test_memory.txt || err "No optical duplicates counted"
+
+$OGE dedup --nopg --dedup-window 256 --metrics test_stream.txt test_sorted.bam -o /dev/null || err "Failed to mark duplicates while streaming"
+cmp test_memory.txt test_stream.txt || err "Metrics differ while streaming"
+$OGE dedup --nopg -t 4 --dedup-window 0 --metrics test_split.txt test_sorted.bam -o /dev/null || err "Failed to mark duplicates split by chromosome"
+cmp test_memory.txt test_split.txt || err "Metrics differ when split by chromosome"
+
+# 208.wide.bam is 208.yhet.bam, sorted, with 65536 added to the x coordinate
+# in every read name. Coordinates past 16 bits must find the same optical
+# duplicates.
+$OGE dedup --nopg --metrics test_wide.txt $DATA/208.wide.bam -o /dev/null || err "Failed to mark duplicates with wide coordinates"
+cmp test_memory.txt test_wide.txt || err "Metrics differ with wide coordinates"
+$OGE dedup --nopg --dedup-window 256 --metrics test_wide.txt $DATA/208.wide.bam -o /dev/null || err "Failed to mark duplicates with wide coordinates while streaming"
+cmp test_memory.txt test_wide.txt || err "Metrics differ with wide coordinates while streaming"
+
+rm -f test_sorted.bam test_memory.txt test_stream.txt test_split.txt test_wide.txt
+
+true
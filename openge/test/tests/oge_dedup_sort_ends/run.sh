@@ -0,0 +1,17 @@
+#!/bin/bash
+# Sorting read ends in temp files when they don't fit in --dedup-mem must
+# mark the same duplicates as sorting them in memory.
+source $(dirname $0)/../common.sh
+rm -f test_input.bam test_memory.sam test_spill.sam test_spill.log
+
+# three copies of each read, for about 90,000 read ends
+$OGE mergesort --nopg $DATA/208.yhet.bam $DATA/208.yhet.bam $DATA/208.yhet.bam -o test_input.bam || err "Failed to make input"
+
+$OGE dedup --nopg -F sam -d --dedup-window 0 test_input.bam -o test_memory.sam || err "Failed to mark duplicates"
+$OGE dedup --nopg -F sam -d -v --dedup-window 0 --dedup-mem 1 test_input.bam -o test_spill.sam 2> test_spill.log || err "Failed to mark duplicates with temp files"
+grep -q "temporary files" test_spill.log || err "Read ends were not sorted in temp files"
+cmp test_memory.sam test_spill.sam || err "Output differs when sorting read ends in temp files"
+
+rm -f test_input.bam test_memory.sam test_spill.sam test_spill.log
+
+true
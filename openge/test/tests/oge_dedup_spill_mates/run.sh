@@ -0,0 +1,35 @@
+#!/bin/bash
+# Setting aside pairs whose mates are on later chromosomes must find the
+# same mates, and so mark the same duplicates, as keeping them all in memory.
+source $(dirname $0)/../common.sh
+rm -f test_sorted.bam test_memory.sam test_spill.sam test_spill.log
+
+$OGE mergesort --nopg $DATA/208.yhet.bam -o test_sorted.bam || err "Failed to sort"
+
+$OGE dedup --nopg -F sam -d --dedup-window 0 test_sorted.bam -o test_memory.sam || err "Failed to mark duplicates"
+$OGE dedup --nopg -F sam -d --dedup-window 0 --dedup-spill-mates test_sorted.bam -o test_spill.sam || err "Failed to mark duplicates setting aside mates"
+cmp test_memory.sam test_spill.sam || err "Output differs when setting aside mates"
+$OGE dedup --nopg -F sam -d --dedup-window 256 --dedup-spill-mates test_sorted.bam -o test_spill.sam || err "Failed to mark duplicates while streaming, setting aside mates"
+cmp test_memory.sam test_spill.sam || err "Output differs when setting aside mates while streaming"
+
+# dedup_mates.bam has 16000 pairs, each with its mate on a later chromosome,
+# too many to hold in a quarter of 1MB, so they go to temp files.
+$OGE dedup --nopg -F sam -d $DATA/dedup_mates.bam -o test_memory.sam || err "Failed to mark duplicates"
+[ $(grep -v '^@' test_memory.sam | awk '{ if (int($2 / 1024) % 2) n++ } END { print n + 0 }') -gt 0 ] || err "No duplicates marked"
+$OGE dedup --nopg -F sam -d -v --dedup-mem 1 --dedup-spill-mates $DATA/dedup_mates.bam -o test_spill.sam 2> test_spill.log || err "Failed to mark duplicates setting aside mates in temp files"
+grep -q "Unmatched pairs were set aside in [1-9][0-9]* temporary files" test_spill.log || err "Mates not set aside in temp files"
+cmp test_memory.sam test_spill.sam || err "Output differs when setting aside mates in temp files"
+$OGE dedup --nopg -F sam -d -v --dedup-window 1 --dedup-mem 1 --dedup-spill-mates $DATA/dedup_mates.bam -o test_spill.sam 2> test_spill.log || err "Failed to mark duplicates while streaming, setting aside mates in temp files"
+grep -q "Unmatched pairs were set aside in [1-9][0-9]* temporary files" test_spill.log || err "Mates not set aside in temp files while streaming"
+cmp test_memory.sam test_spill.sam || err "Output differs when setting aside mates in temp files while streaming"
+
+# each chromosome's chain never reads the mates on other chromosomes, so has
+# nothing to set them aside for
+$OGE dedup --nopg -F sam -t 4 --dedup-mem 1 $DATA/dedup_mates.bam -o test_memory.sam || err "Failed to mark duplicates split by chromosome"
+$OGE dedup --nopg -F sam -t 4 -v --dedup-mem 1 --dedup-spill-mates $DATA/dedup_mates.bam -o test_spill.sam 2> test_spill.log || err "Failed to mark duplicates split by chromosome, setting aside mates"
+grep -q "Unmatched pairs were set aside" test_spill.log && err "Mates set aside when split by chromosome"
+cmp test_memory.sam test_spill.sam || err "Output differs when split by chromosome, setting aside mates"
+
+rm -f test_sorted.bam test_memory.sam test_spill.sam test_spill.log
+
+true
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Marking duplicates in sorted input as it streams through must flag the
+# same reads as writing it all to a temp file first, including when held
+# reads overflow to temp files. Streaming is only used when asked for, so
+# reads with too many clipped bases to stream, or input whose header says
+# it is sorted when it isn't, are still marked by default.
+source $(dirname $0)/../common.sh
+rm -f test_sorted.bam test_stream.sam test_spill.sam
+
+$OGE mergesort --nopg $DATA/208.yhet.bam -o test_sorted.bam || err "Failed to sort"
+
+$OGE dedup --nopg -F sam -d --dedup-window 0 test_sorted.bam -o test_stream.sam || err "Failed to mark duplicates with a temp file"
+[ $(grep -v '^@' test_stream.sam | awk '{ if (int($2 / 1024) % 2) n++ } END { print n + 0 }') -gt 0 ] || err "No duplicates marked"
+
+$OGE dedup --nopg -F sam -d test_sorted.bam -o test_spill.sam || err "Failed to mark duplicates"
+cmp test_stream.sam test_spill.sam || err "Output differs by default"
+$OGE dedup --nopg -F sam -d --dedup-window 256 test_sorted.bam -o test_spill.sam || err "Failed to mark duplicates while streaming"
+cmp test_stream.sam test_spill.sam || err "Output differs while streaming"
+$OGE dedup --nopg -F sam -d --dedup-window 1 test_sorted.bam -o test_spill.sam || err "Failed to mark duplicates while streaming with a small window"
+cmp test_stream.sam test_spill.sam || err "Output differs while streaming with a small window"
+$OGE mergesort --nopg -F sam -M $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort and mark duplicates"
+cmp test_stream.sam test_spill.sam || err "Output differs when marking duplicates after sorting"
+$OGE mergesort --nopg -F sam -M --dedup-window 256 $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort and mark duplicates while streaming"
+cmp test_stream.sam test_spill.sam || err "Output differs when marking duplicates while streaming after sorting"
+
+$OGE dedup --nopg -F sam -d -r --dedup-window 0 test_sorted.bam -o test_stream.sam || err "Failed to remove duplicates with a temp file"
+$OGE dedup --nopg -F sam -d -r --dedup-window 256 test_sorted.bam -o test_spill.sam || err "Failed to remove duplicates while streaming"
+cmp test_stream.sam test_spill.sam || err "Output differs when removing duplicates while streaming"
+
+# dedup_clipped.bam has a read with 15000 hard clipped bases, a duplicate of
+# an earlier read once its clipped bases are counted.
+# dedup_mislabelled.bam says SO:coordinate, but its reads are out of order.
+for input in dedup_clipped dedup_mislabelled; do
+    $OGE dedup --nopg -F sam $DATA/$input.bam -o test_stream.sam || err "Failed to mark duplicates in $input.bam"
+    [ $(grep -v '^@' test_stream.sam | wc -l) = $($OGE count $DATA/$input.bam) ] || err "Reads missing from $input.bam"
+    [ $(grep -v '^@' test_stream.sam | awk '{ if (int($2 / 1024) % 2) n++ } END { print n + 0 }') = 1 ] || err "Duplicate not marked in $input.bam"
+    $OGE dedup --nopg -F sam -d $DATA/$input.bam -o test_spill.sam || err "Failed to mark duplicates in $input.bam in one thread"
+    cmp test_stream.sam test_spill.sam || err "Output of $input.bam differs in one thread"
+    $OGE mergesort --nopg -F sam -M $DATA/$input.bam -o test_spill.sam || err "Failed to sort and mark duplicates in $input.bam"
+    [ $(grep -v '^@' test_spill.sam | awk '{ if (int($2 / 1024) % 2) n++ } END { print n + 0 }') = 1 ] || err "Duplicate not marked when sorting $input.bam"
+    $OGE dedup --nopg --dedup-window 64 $DATA/$input.bam -o /dev/null 2> /dev/null && err "Streamed $input.bam"
+done
+
+rm -f test_sorted.bam test_stream.sam test_spill.sam
+
+true
@@ -1,6 +1,6 @@
 #!/bin/bash
 source $(dirname $0)/../common.sh
-rm test.bam test.out test2.bam test2.out
+rm test.bam test.out test2.bam test2.out test3.sam test4.sam
 
 $OGE mergesort $DATA/simple.bam -o test.bam
 
@@ -18,4 +18,20 @@ $OGE stats test2.bam > test2.out
 
 grep -q "Sorted: *Yes" test2.out || err "Failed to find expected command output (Sorted: Yes)"
 
+# Coordinate sorting must give the same order with and without threads, and
+# whether or not the input is split across several temp files.
+$OGE mergesort --nopg -F sam -n 1000 $DATA/208.yhet.bam -o test3.sam || err "Failed to sort with threads"
+$OGE mergesort --nopg -F sam -n 1000 -d $DATA/208.yhet.bam -o test4.sam || err "Failed to sort without threads"
+cmp test3.sam test4.sam || err "Sorting with and without threads gave different results"
+$OGE mergesort --nopg -F sam -d $DATA/208.yhet.bam -o test4.sam || err "Failed to sort into a single temp file"
+cmp test3.sam test4.sam || err "Sorting into one and several temp files gave different results"
+
+# Name sorting must keep names in order across several temp files. Reads
+# with the same name may come out in either order, so only compare names.
+$OGE mergesort --nopg -F sam -b -n 1000 $DATA/208.yhet.bam -o test3.sam || err "Failed to sort by name into several temp files"
+$OGE mergesort --nopg -F sam -b -d $DATA/208.yhet.bam -o test4.sam || err "Failed to sort by name into a single temp file"
+cmp <(grep -v '^@' test3.sam | cut -f 1) <(grep -v '^@' test4.sam | cut -f 1) || err "Merging temp files sorted by name gave a different order"
+
+rm -f test3.sam test4.sam
+
 true
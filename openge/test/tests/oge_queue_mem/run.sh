@@ -0,0 +1,15 @@
+#!/bin/bash
+# Small queue budgets must only slow processing down, never change the output.
+source $(dirname $0)/../common.sh
+rm -f test_default.sam test_small.sam test_verbose.txt
+
+$OGE mergesort --nopg -F sam $DATA/208.yhet.bam -o test_default.sam || err "Failed to sort with default queue memory"
+$OGE mergesort --nopg -F sam --queue-mem 1 $DATA/208.yhet.bam -o test_small.sam || err "Failed to sort with 1MB queues"
+cmp test_default.sam test_small.sam || err "Output differs with 1MB queues"
+
+$OGE count -v --queue-mem 1 $DATA/208.yhet.bam 2> test_verbose.txt || err "Failed to count with 1MB queues"
+grep -q "^Queue memory (1024 KB per queue)" test_verbose.txt || err "Queue statistics missing from verbose output"
+
+rm -f test_default.sam test_small.sam test_verbose.txt
+
+true
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Tag and template-coordinate orders must give the same output sorted in
+# memory, through temp files, and without threads, and say so in @HD.
+source $(dirname $0)/../common.sh
+rm -f test_memory.sam test_spill.sam
+
+function check_modes() {
+    $OGE mergesort --nopg -F sam "$@" $DATA/208.yhet.bam -o test_memory.sam || err "Failed to sort with $*"
+    $OGE mergesort --nopg -F sam "$@" --sort-mem 1 --merge-fanin 2 $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort with $* and temp files"
+    cmp test_memory.sam test_spill.sam || err "Output differs with temp files with $*"
+    $OGE mergesort --nopg -F sam "$@" -d $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort with $* without threads"
+    cmp test_memory.sam test_spill.sam || err "Output differs without threads with $*"
+}
+
+check_modes --sort-tag NM,MD
+grep -q "^@HD.*SO:unsorted.*SS:unsorted:NM:MD" test_memory.sam || err "Missing tag sort order in header"
+grep -v '^@' test_memory.sam | grep -o 'NM:i:[0-9]*' | cut -d : -f 3 | sort -n -c || err "Reads not sorted by NM"
+
+check_modes --sort-tag NM -b
+grep -v '^@' test_memory.sam | grep -o 'NM:i:[0-9]*' | cut -d : -f 3 | sort -n -c || err "Reads not sorted by NM with --byname"
+
+# ties between tag values follow --name-order
+function nm_names() {
+    grep -v '^@' $1 | awk -F '\t' '{ nm = -1; for(i = 12; i <= NF; i++) if($i ~ /^NM:i:/) nm = substr($i, 6); print nm "\t" $1 "\t" $2 }'
+}
+for order in picard natural; do
+    check_modes --sort-tag NM -b --name-order $order
+    $OGE mergesort --nopg -F sam -b --name-order $order $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort by $order name order"
+    cmp <(nm_names test_memory.sam) <(nm_names test_spill.sam | sort -s -n -k 1,1) || err "Reads not sorted by NM, then $order name order"
+done
+
+# integers and floats sort by value, after reads without the tag and before strings
+$OGE mergesort --nopg -F sam --sort-tag XV $DATA/tag_values.bam -o test_memory.sam || err "Failed to sort by XV"
+[ "$(grep -v '^@' test_memory.sam | cut -f 1 | tr '\n' ' ')" == "t6 t9 t5 t4 t2 t1 t7 t8 t10 t3 " ] || err "Wrong order of numeric and string tag values"
+
+check_modes --template-coordinate
+grep -q "^@HD.*SO:unsorted.*GO:query.*SS:unsorted:template-coordinate" test_memory.sam || err "Missing template-coordinate order in header"
+
+rm -f test_memory.sam test_spill.sam
+
+true
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Inputs that fit in --sort-mem are sorted without temp files. Ones that don't
+# must sort to the same result.
+source $(dirname $0)/../common.sh
+rm -f test_memory.sam test_spill.sam test_verbose.txt
+
+$OGE mergesort -v --nopg -F sam $DATA/208.yhet.bam -o test_memory.sam 2> test_verbose.txt || err "Failed to sort in memory"
+grep -q "in memory" test_verbose.txt || err "Sorting did not stay in memory"
+$OGE mergesort -v --nopg -F sam --sort-mem 1 $DATA/208.yhet.bam -o test_spill.sam 2> test_verbose.txt || err "Failed to sort with 1MB of sort memory"
+grep -q "using temp files" test_verbose.txt || err "Sorting with 1MB of sort memory did not use temp files"
+cmp test_memory.sam test_spill.sam || err "Output differs when sorting with temp files"
+
+$OGE mergesort --nopg -F sam -d --sort-mem 1 $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort with 1MB of sort memory without threads"
+cmp test_memory.sam test_spill.sam || err "Output differs when sorting with temp files without threads"
+
+# temp files are read back the same with each codec
+for codec in none lz4 deflate; do
+    $OGE mergesort --nopg -F sam --sort-mem 1 --tempcodec $codec $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort with $codec temp files"
+    cmp test_memory.sam test_spill.sam || err "Output differs with $codec temp files"
+done
+$OGE mergesort --nopg -F sam --sort-mem 1 -C $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort with compressed temp files"
+cmp test_memory.sam test_spill.sam || err "Output differs with compressed temp files"
+
+# with a fan-in of 2, temp files are merged in several passes, partly while
+# others are still being written
+for threads in "-t 1" "-t 4" "-d"; do
+    $OGE mergesort --nopg -F sam --sort-mem 1 --merge-fanin 2 $threads $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort with a merge fan-in of 2 ($threads)"
+    cmp test_memory.sam test_spill.sam || err "Output differs with a merge fan-in of 2 ($threads)"
+done
+# reads with the same name may come out in either order
+$OGE mergesort --nopg -F sam -b $DATA/208.yhet.bam -o test_memory.sam || err "Failed to sort by name in memory"
+$OGE mergesort --nopg -F sam -b --sort-mem 1 --merge-fanin 3 $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort by name with a merge fan-in of 3"
+cmp <(grep -v '^@' test_memory.sam | cut -f 1) <(grep -v '^@' test_spill.sam | cut -f 1) || err "Name order differs with a merge fan-in of 3"
+
+rm -f test_memory.sam test_spill.sam test_verbose.txt
+
+true
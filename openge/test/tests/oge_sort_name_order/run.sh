@@ -0,0 +1,32 @@
+#!/bin/bash
+# Each name order must give the same output sorted in memory, through temp
+# files, and without threads.
+source $(dirname $0)/../common.sh
+rm -f test_memory.sam test_spill.sam test_ascii.sam
+
+for order in ascii picard natural; do
+    $OGE mergesort --nopg -F sam -b --name-order $order $DATA/208.yhet.bam -o test_memory.sam || err "Failed to sort by $order name order"
+    $OGE mergesort --nopg -F sam -b --name-order $order --sort-mem 1 --merge-fanin 2 $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort by $order name order with temp files"
+    cmp test_memory.sam test_spill.sam || err "Output differs with temp files in $order name order"
+    $OGE mergesort --nopg -F sam -b --name-order $order -d $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort by $order name order without threads"
+    cmp test_memory.sam test_spill.sam || err "Output differs without threads in $order name order"
+    [ $order == ascii ] && cp test_memory.sam test_ascii.sam
+done
+
+# tile 100 sorts before tile 2 as text, but after it as a number
+function first_line() {
+    grep -v '^@' $1 | cut -f 1 | grep -n "$2" | head -1 | cut -d : -f 1
+}
+[ $(first_line test_ascii.sam FC304J0AAXX:3:100:) -lt $(first_line test_ascii.sam FC304J0AAXX:3:2:) ] || err "ASCII name order sorts numbers by value"
+[ $(first_line test_memory.sam FC304J0AAXX:3:100:) -gt $(first_line test_memory.sam FC304J0AAXX:3:2:) ] || err "Natural name order sorts numbers as text"
+
+# reads that share a name: picard puts paired reads before unpaired ones,
+# the first of a pair before the second, and the forward strand first
+for threads in "" "-d"; do
+    $OGE mergesort --nopg -F sam -b --name-order picard $threads $DATA/name_order_flags.bam -o test_memory.sam || err "Failed to sort by picard name order ($threads)"
+    [ "$(grep -v '^@' test_memory.sam | cut -f 1,2 | tr '\t\n' ': ')" == "r1:65 r1:129 r1:0 r2:97 r2:0 r2:16 r3:1 r3:0 " ] || err "Wrong flag order in picard name order ($threads)"
+done
+
+rm -f test_memory.sam test_spill.sam test_ascii.sam
+
+true
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Input already sorted by coordinate is streamed through the reorder window,
+# and must come out the same as when it is sorted again. Input that isn't
+# sorted must still be sorted, unless output had already started.
+source $(dirname $0)/../common.sh
+rm -f test_presorted.bam test_sorted.sam test_streamed.sam test_verbose.txt test_byname.bam
+
+$OGE mergesort --nopg $DATA/208.yhet.bam -o test_presorted.bam || err "Failed to sort input"
+$OGE mergesort --nopg -F sam test_presorted.bam -o test_sorted.sam || err "Failed to sort presorted input"
+
+$OGE mergesort -v --nopg -F sam --reorder-window 64 test_presorted.bam -o test_streamed.sam 2> test_verbose.txt || err "Failed to stream presorted input"
+grep -q "reordering reads within" test_verbose.txt || err "Presorted input was sorted again"
+cmp test_sorted.sam test_streamed.sam || err "Output differs when streaming presorted input"
+
+for options in "--reorder-window 64 -d" "--reorder-window 1" "--reorder-window 64 --sort-mem 1"; do
+    $OGE mergesort --nopg -F sam $options test_presorted.bam -o test_streamed.sam || err "Failed to stream presorted input ($options)"
+    cmp test_sorted.sam test_streamed.sam || err "Output differs when streaming presorted input ($options)"
+done
+
+# not sorted by coordinate; found out before any output, unless the sort memory is tiny
+$OGE mergesort --nopg --byname test_presorted.bam -o test_byname.bam || err "Failed to sort input by name"
+for options in "" "--reorder-window 1" "--reorder-window 1 --sort-mem 4"; do
+    $OGE mergesort -v --nopg -F sam $options test_byname.bam -o test_streamed.sam 2> test_verbose.txt || err "Failed to sort unsorted input ($options)"
+    grep -q "reordering reads within" test_verbose.txt && err "Unsorted input was streamed ($options)"
+    cmp test_sorted.sam test_streamed.sam || err "Output differs when sorting unsorted input ($options)"
+done
+$OGE mergesort --nopg -F sam --reorder-window 1 --sort-mem 1 test_byname.bam -o test_streamed.sam 2> /dev/null && err "Input out of order after output started was accepted"
+
+rm -f test_presorted.bam test_sorted.sam test_streamed.sam test_verbose.txt test_byname.bam
+
+true
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Temp files spread over several directories must sort the same as in one,
+# and be cleaned up from all of them.
+source $(dirname $0)/../common.sh
+rm -rf test_tmp1 test_tmp2 test_memory.sam test_spill.sam
+mkdir test_tmp1 test_tmp2
+
+$OGE mergesort --nopg -F sam $DATA/208.yhet.bam -o test_memory.sam || err "Failed to sort in memory"
+$OGE mergesort --nopg -F sam --sort-mem 1 -T test_tmp1,test_tmp2 $DATA/208.yhet.bam -o test_spill.sam || err "Failed to sort with two temp directories"
+cmp test_memory.sam test_spill.sam || err "Output differs with two temp directories"
+$OGE mergesort --nopg -F sam --sort-mem 1 -M -T test_tmp1,test_tmp2 $DATA/208.yhet.bam -o /dev/null || err "Failed to mark duplicates with two temp directories"
+[ -z "$(ls test_tmp1 test_tmp2 | grep spill)" ] || err "Temp files were left behind"
+
+rm -rf test_tmp1 test_tmp2 test_memory.sam test_spill.sam
+
+true